@@ -0,0 +1,47 @@
+/**
+ * compile time / binary size benchmark for then() / error() / finally().
+ * 100 functions, each one chain with distinct callbacks of every kind
+ * (value, void, promise returning), as in a TU with a lot of chains.
+ * see the compile_bench target in CMakeLists.txt.
+ */
+#include <string>
+#include <vector>
+#include <iostream>
+#include <jpromise/jpromise.h>
+
+using namespace JPromise;
+
+#define CHAIN(n) \
+  static Promise<int>::sp chain_##n(Promise<int>::sp p) { \
+    return p \
+      ->then([](const int& x){ return x + n; }) \
+      ->then([](const int& x){ return std::to_string(x); }) \
+      ->then([](const std::string& s){ (void)s; }) \
+      ->then([](const std::string& s){ return std::vector<char>(s.begin(), s.end()); }) \
+      ->then([](const std::vector<char>& v){ return Promise<>::resolve(static_cast<int>(v.size()) + n); }) \
+      ->error([](std::exception_ptr){ return n; }) \
+      ->error([](std::exception_ptr){}) \
+      ->error([](std::exception_ptr e){ return Promise<>::reject<int>(e); }) \
+      ->finally([](){}) \
+      ->finally([](){ return Promise<>::resolve(n); }); \
+  }
+
+#define CHAIN10(n) \
+  CHAIN(n##0) CHAIN(n##1) CHAIN(n##2) CHAIN(n##3) CHAIN(n##4) \
+  CHAIN(n##5) CHAIN(n##6) CHAIN(n##7) CHAIN(n##8) CHAIN(n##9)
+
+CHAIN10(1) CHAIN10(2) CHAIN10(3) CHAIN10(4) CHAIN10(5)
+CHAIN10(6) CHAIN10(7) CHAIN10(8) CHAIN10(9) CHAIN10(10)
+
+#define CALL(n) sum += chain_##n(Promise<>::resolve(0))->wait();
+#define CALL10(n) \
+  CALL(n##0) CALL(n##1) CALL(n##2) CALL(n##3) CALL(n##4) \
+  CALL(n##5) CALL(n##6) CALL(n##7) CALL(n##8) CALL(n##9)
+
+int main() {
+  long sum = 0;
+  CALL10(1) CALL10(2) CALL10(3) CALL10(4) CALL10(5)
+  CALL10(6) CALL10(7) CALL10(8) CALL10(9) CALL10(10)
+  std::cout << sum << std::endl;
+  return 0;
+}
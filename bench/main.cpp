@@ -0,0 +1,1359 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <jpromise/jpromise.h>
+#include <jpromise/async_cache.h>
+#include <jpromise/async_stream.h>
+#include <jpromise/batch_loader.h>
+#include <jpromise/reactor.h>
+#include <jpromise/file_io.h>
+#include <jpromise/executor.h>
+#include <jpromise/async_queue.h>
+#include <jpromise/async_sync.h>
+#include <jpromise/pipeline.h>
+#include <jpromise/virtual_time.h>
+#include <jpromise/shared_memory.h>
+#include <jpromise/async_scope.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace JPromise;
+using bench_clock = std::chrono::steady_clock;
+
+std::ostream& log() {
+  return std::cout << std::this_thread::get_id() << " : ";
+}
+
+/** percentile of a sorted latency sample (ns) */
+template <typename T> T percentile(const std::vector<T>& sorted, double p) {
+  if(sorted.empty()) return T{};
+  return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+}
+
+template <typename T> void report_latency(const char* name, std::vector<T>& ns) {
+  std::sort(ns.begin(), ns.end());
+  double sum = 0;
+  for(auto x : ns) sum += x;
+  log() << std::setw(32) << std::left << name
+        << " n=" << ns.size()
+        << " mean=" << (ns.empty() ? 0 : sum / ns.size()) << "ns"
+        << " p50=" << percentile(ns, 0.50) << "ns"
+        << " p99=" << percentile(ns, 0.99) << "ns" << std::endl;
+}
+
+/** zipf(s) sampler over [0, n) */
+class zipf_distribution {
+  std::vector<double> cdf_;
+public:
+  zipf_distribution(std::size_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for(std::size_t i = 0; i < n; i++){
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for(auto& x : cdf_) x /= sum;
+  }
+  template <typename RNG> std::size_t operator()(RNG& rng) {
+    const auto u = std::uniform_real_distribution<double>(0, 1)(rng);
+    return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+  }
+};
+
+void bench_async_cache() {
+  const std::size_t nKeys = 100000;
+  const std::size_t nOps = 200000;
+  const auto nThreads = std::max(2u, std::thread::hardware_concurrency());
+  zipf_distribution zipf(nKeys, 0.99);
+
+  for(std::size_t shards : {1, 16, 64}){
+    AsyncCache<std::size_t, std::size_t> cache([](const std::size_t& key){
+      return Promise<>::resolve(key * 2);
+    }, { .capacity = nKeys / 10, .ttl = std::chrono::seconds(60), .shards = shards });
+
+    std::vector<std::vector<long long>> samples(nThreads);
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < nThreads; t++){
+      threads.emplace_back([&, t]{
+        std::mt19937_64 rng(t);
+        auto& ns = samples[t];
+        ns.reserve(nOps);
+        for(std::size_t i = 0; i < nOps; i++){
+          const auto key = zipf(rng);
+          const auto t0 = bench_clock::now();
+          auto p = cache.get(key);
+          const auto t1 = bench_clock::now();
+          ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+      });
+    }
+    for(auto& t : threads) t.join();
+
+    std::vector<long long> all;
+    for(auto& s : samples) all.insert(all.end(), s.begin(), s.end());
+    const auto st = cache.get_stats();
+    const auto total = st.hits + st.coalesced + st.misses;
+    log() << "async_cache shards=" << shards << " threads=" << nThreads
+          << " hit rate=" << (100.0 * (st.hits + st.coalesced) / total) << "%" << std::endl;
+    report_latency("  get()", all);
+  }
+}
+
+void bench_async_stream() {
+  const int nItems = 1000000;
+
+  for(std::size_t capacity : {16, 256, 4096}){
+    auto s = AsyncStream<int>::create(capacity);
+    auto sum = std::make_shared<long long>(0);
+    const auto t0 = bench_clock::now();
+    auto done = s->for_each([sum](const int& x){ *sum += x; }, capacity);
+    std::thread producer([s, nItems]{
+      for(int i = 0; i < nItems; i++){
+        if(!s->try_push(i)) s->push(i)->wait();
+      }
+      s->close();
+    });
+    done->wait();
+    producer.join();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "async_stream capacity=" << capacity << " : " << (nItems / sec / 1e6) << " M items/s" << std::endl;
+  }
+
+  {
+    /** producer runs ahead of the consumer, items are drained in batches */
+    const int nBurst = 1024;
+    auto s = AsyncStream<int>::create(nBurst);
+    auto sum = std::make_shared<long long>(0);
+    const auto t0 = bench_clock::now();
+    for(int i = 0; i < nItems; i += nBurst){
+      for(int j = 0; j < nBurst; j++) s->try_push(i + j);
+      for(auto& x : s->next(nBurst)->wait()) *sum += x;
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "async_stream burst=" << nBurst << "     : " << (nItems / sec / 1e6) << " M items/s" << std::endl;
+  }
+
+  {
+    /** one promise per item, chained */
+    const int n = nItems / 10;
+    auto sum = std::make_shared<long long>(0);
+    const auto t0 = bench_clock::now();
+    std::thread producer([sum, n]{
+      for(int i = 0; i < n; i++){
+        Promise<>::resolve(i)
+        ->then([sum](const int& x){ *sum += x; });
+      }
+    });
+    producer.join();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "promise per item              : " << (n / sec / 1e6) << " M items/s" << std::endl;
+  }
+}
+
+/** simulated backend round trip: fixed cost per call plus a small cost per key */
+Promise<std::vector<int>>::sp backend_lookup(const std::vector<int>& keys) {
+  const auto until = bench_clock::now() + std::chrono::microseconds(20) + std::chrono::nanoseconds(100) * keys.size();
+  while(bench_clock::now() < until){}
+  std::vector<int> values(keys.size());
+  for(std::size_t i = 0; i < keys.size(); i++) values[i] = keys[i] * 2;
+  return Promise<>::resolve(std::move(values));
+}
+
+void bench_batch_loader() {
+  const int nKeys = 10000;
+
+  for(std::size_t maxBatch : {1, 16, 256, 4096}){
+    BatchLoader<int, int> loader(backend_lookup, { .max_batch = maxBatch });
+    std::vector<Promise<int>::sp> ps;
+    ps.reserve(nKeys);
+    const auto t0 = bench_clock::now();
+    for(int i = 0; i < nKeys; i++){
+      ps.push_back(loader.load(i));
+    }
+    loader.dispatch();
+    for(auto& p : ps) p->wait();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "batch_loader max_batch=" << std::setw(5) << maxBatch
+          << " : calls=" << std::setw(6) << loader.batches()
+          << " " << (nKeys / sec / 1e6) << " M keys/s" << std::endl;
+  }
+}
+
+/** promise based I/O on the reactor loop thread */
+struct reactor_io {
+  Reactor& r;
+  Promise<std::size_t>::sp read(int fd, void* buf, std::size_t len) const { return r.async_read(fd, buf, len); }
+  Promise<std::size_t>::sp write(int fd, const void* buf, std::size_t len) const { return r.async_write(fd, buf, len); }
+  Promise<int>::sp accept(int fd) const { return r.async_accept(fd); }
+};
+
+/** promise based I/O with a blocking thread per request */
+struct thread_io {
+  template <typename T, typename F> static typename Promise<T>::sp spawn(F f) {
+    return Promise<>::create<T>([f](auto resolver){
+      std::thread([f, resolver]{
+        const auto n = f();
+        if(n < 0) resolver.reject(std::make_exception_ptr(std::system_error(errno, std::generic_category())));
+        else resolver.resolve(static_cast<T>(n));
+      }).detach();
+    });
+  }
+  Promise<std::size_t>::sp read(int fd, void* buf, std::size_t len) const {
+    return spawn<std::size_t>([=]{ return ::read(fd, buf, len); });
+  }
+  Promise<std::size_t>::sp write(int fd, const void* buf, std::size_t len) const {
+    return spawn<std::size_t>([=]{ return ::send(fd, buf, len, MSG_NOSIGNAL); });
+  }
+  Promise<int>::sp accept(int fd) const {
+    return spawn<int>([=]{ return ::accept(fd, nullptr, nullptr); });
+  }
+};
+
+template <typename IO> void echo_session(IO io, int s, std::shared_ptr<std::array<char, 256>> buf) {
+  io.read(s, buf->data(), buf->size())
+  ->then([io, s, buf](const std::size_t& n){
+    if(n == 0) return Promise<>::resolve(std::size_t(0));
+    return io.write(s, buf->data(), n);
+  })
+  ->then([io, s, buf](const std::size_t& n){
+    if(n > 0) echo_session(io, s, buf);
+    else ::close(s);
+  })
+  ->error([s](std::exception_ptr){ ::close(s); })
+  ->stand_alone();
+}
+
+template <typename IO> void echo_accept(IO io, int ls) {
+  io.accept(ls)
+  ->then([io, ls](const int& s){
+    const int one = 1;
+    ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    echo_session(io, s, std::make_shared<std::array<char, 256>>());
+    echo_accept(io, ls);
+  })
+  ->stand_alone();
+}
+
+template <typename IO> void bench_echo(const char* name, IO io) {
+  const int nClients = 4;
+  const int nRoundTrips = 5000;
+  const std::size_t msg = 64;
+
+  const int ls = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ::bind(ls, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  socklen_t len = sizeof(addr);
+  ::getsockname(ls, reinterpret_cast<sockaddr*>(&addr), &len);
+  ::listen(ls, 64);
+  echo_accept(io, ls);
+
+  std::vector<std::vector<long long>> samples(nClients);
+  std::vector<std::thread> clients;
+  const auto t0 = bench_clock::now();
+  for(int c = 0; c < nClients; c++){
+    clients.emplace_back([&, c]{
+      const int s = ::socket(AF_INET, SOCK_STREAM, 0);
+      const int one = 1;
+      ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      ::connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+      std::vector<char> out(msg, 'x'), in(msg);
+      for(int i = 0; i < nRoundTrips; i++){
+        const auto r0 = bench_clock::now();
+        ::send(s, out.data(), msg, MSG_NOSIGNAL);
+        std::size_t got = 0;
+        while(got < msg){
+          const auto n = ::read(s, in.data() + got, msg - got);
+          if(n <= 0) break;
+          got += n;
+        }
+        samples[c].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - r0).count());
+      }
+      ::close(s);
+    });
+  }
+  for(auto& t : clients) t.join();
+  const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+  ::shutdown(ls, SHUT_RDWR);
+  ::close(ls);
+
+  std::vector<long long> all;
+  for(auto& x : samples) all.insert(all.end(), x.begin(), x.end());
+  log() << name << " : " << (all.size() / sec) << " round trips/s" << std::endl;
+  report_latency("  round trip", all);
+}
+
+void bench_reactor() {
+  {
+    Reactor reactor;
+    std::thread loop([&]{ reactor.run(); });
+    bench_echo("reactor echo          ", reactor_io{ reactor });
+    reactor.stop();
+    loop.join();
+  }
+  bench_echo("thread per request echo", thread_io{});
+}
+
+void bench_file_io() {
+  const int nFiles = 16;
+  const std::size_t fileSize = 4 << 20;
+  const std::size_t blockSize = 16 << 10;
+  const std::size_t blocksPerFile = fileSize / blockSize;
+  const std::size_t nBlocks = nFiles * blocksPerFile;
+
+  std::vector<int> fds;
+  {
+    std::vector<char> data(fileSize, 'x');
+    for(int i = 0; i < nFiles; i++){
+      char path[] = "/tmp/jpromise_bench_XXXXXX";
+      const int fd = ::mkstemp(path);
+      ::unlink(path);
+      if(::pwrite(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) return;
+      fds.push_back(fd);
+    }
+  }
+
+  auto run = [&](FileIo& io, unsigned qd, bool fixed){
+    std::vector<char> buffers(qd * blockSize);
+    if(fixed) io.register_buffers({ iovec{ buffers.data(), buffers.size() } });
+    std::atomic<std::size_t> next{0};
+    std::atomic<unsigned> active{qd};
+    std::function<void(unsigned)> issue;
+    Promise<bool>::sp done = Promise<>::create<bool>([&](auto resolver){
+      issue = [&, resolver](unsigned slot){
+        const auto i = next++;
+        if(i >= nBlocks){
+          if(--active == 0) resolver.resolve(true);
+          return;
+        }
+        const int fd = fds[i % nFiles];
+        const off_t offset = static_cast<off_t>((i / nFiles) * blockSize);
+        auto p = fixed
+          ? io.read_fixed(fd, 0, blockSize, offset, slot * blockSize)
+          : io.read(fd, buffers.data() + slot * blockSize, blockSize, offset);
+        p->stand_alone({
+          .on_fulfilled = [&issue, slot](const std::size_t&){ issue(slot); }
+        });
+      };
+    });
+    const auto t0 = bench_clock::now();
+    for(unsigned slot = 0; slot < qd; slot++) issue(slot);
+    done->wait();
+    return std::chrono::duration<double>(bench_clock::now() - t0).count();
+  };
+
+  FileIo uring({ .queue_depth = 256 });
+  FileIo pool({ .queue_depth = 256, .threads = 16, .force_thread_pool = true });
+  const double mb = static_cast<double>(nBlocks * blockSize) / (1 << 20);
+  for(unsigned qd : {1, 4, 16, 64, 256}){
+    if(uring.uses_io_uring()){
+      const auto t = run(uring, qd, false);
+      const auto tf = run(uring, qd, true);
+      log() << "file_io qd=" << std::setw(3) << qd
+            << " io_uring " << std::setw(8) << (mb / t) << " MB/s " << std::setw(8) << (nBlocks / t / 1000) << " kIOPS"
+            << " | fixed " << std::setw(8) << (mb / tf) << " MB/s" << std::endl;
+    }
+    const auto tp = run(pool, qd, false);
+    log() << "file_io qd=" << std::setw(3) << qd
+          << " thread pool " << std::setw(8) << (mb / tp) << " MB/s " << std::setw(8) << (nBlocks / tp / 1000) << " kIOPS" << std::endl;
+  }
+  for(auto fd : fds) ::close(fd);
+}
+
+void bench_strand() {
+  const std::size_t nTasks = 1000000;
+  const unsigned nProducers = 4;
+
+  struct object {
+    std::mutex  mtx;
+    long long   state = 0;
+  };
+
+  auto run = [&](std::size_t nObjects, const char* name, std::function<void(std::size_t, std::function<void()>)> post, std::vector<object>& objects, bool bLock){
+    std::atomic<std::size_t> remain{nTasks};
+    std::mutex mtx;
+    std::condition_variable cond;
+    const auto t0 = bench_clock::now();
+    std::vector<std::thread> producers;
+    for(unsigned p = 0; p < nProducers; p++){
+      producers.emplace_back([&, p]{
+        for(std::size_t i = p; i < nTasks; i += nProducers){
+          const auto k = i % nObjects;
+          post(k, [&, k, bLock]{
+            auto& o = objects[k];
+            if(bLock){
+              std::lock_guard<std::mutex> lock(o.mtx);
+              o.state++;
+            }
+            else o.state++;
+            if(--remain == 0){
+              std::lock_guard<std::mutex> lock(mtx);
+              cond.notify_all();
+            }
+          });
+        }
+      });
+    }
+    for(auto& t : producers) t.join();
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, [&]{ return remain == 0; });
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << name << " : " << (nTasks / sec / 1e6) << " M tasks/s" << std::endl;
+  };
+
+  ThreadPool pool(16);
+  for(std::size_t nObjects : {1000, 16}){
+    log() << nObjects << " objects on 16 threads" << std::endl;
+    {
+      std::vector<object> objects(nObjects);
+      run(nObjects, "  mutex per object ", [&](std::size_t, std::function<void()> f){ pool.post(std::move(f)); }, objects, true);
+    }
+    {
+      std::vector<object> objects(nObjects);
+      std::vector<std::unique_ptr<Strand>> strands;
+      for(std::size_t i = 0; i < nObjects; i++) strands.emplace_back(new Strand(pool));
+      run(nObjects, "  strand per object", [&](std::size_t k, std::function<void()> f){ strands[k]->post(std::move(f)); }, objects, false);
+    }
+  }
+}
+
+struct increment {
+  int operator()(const int& x) const { return x + 1; }
+};
+
+template <std::size_t N> struct unfused_chain {
+  static Promise<int>::sp apply(Promise<int>::sp p) {
+    return unfused_chain<N - 1>::apply(p->then(increment{}));
+  }
+};
+template <> struct unfused_chain<0> {
+  static Promise<int>::sp apply(Promise<int>::sp p) { return p; }
+};
+
+template <std::size_t ...Is> Promise<int>::sp fused_chain(Promise<int>::sp p, std::index_sequence<Is...>) {
+  return p->pipe(((void)Is, stage::map(increment{}))...);
+}
+
+void bench_pipe() {
+  const int nChains = 20000;
+  const std::size_t nStages = 20;
+
+  auto run = [&](const char* name, std::function<Promise<int>::sp(Promise<int>::sp)> chain){
+    {
+      const auto t0 = bench_clock::now();
+      for(int i = 0; i < nChains; i++){
+        if(chain(Promise<>::resolve(0))->wait() != static_cast<int>(nStages)) std::abort();
+      }
+      const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / nChains;
+      log() << name << " ready   : " << ns << " ns/chain" << std::endl;
+    }
+    {
+      const auto t0 = bench_clock::now();
+      for(int i = 0; i < nChains; i++){
+        std::shared_ptr<Promise<int>::resolver> r;
+        auto p = Promise<>::create<int>([&](auto resolver){ r = std::make_shared<Promise<int>::resolver>(resolver); });
+        auto tail = chain(p);
+        r->resolve(0);
+        if(tail->wait() != static_cast<int>(nStages)) std::abort();
+      }
+      const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / nChains;
+      log() << name << " pending : " << ns << " ns/chain" << std::endl;
+    }
+  };
+
+  run("20 stages unfused then()", [](Promise<int>::sp p){ return unfused_chain<nStages>::apply(p); });
+  run("20 stages fused pipe()  ", [](Promise<int>::sp p){ return fused_chain(p, std::make_index_sequence<nStages>()); });
+}
+
+/** keep the thread busy for `d` */
+static void spin(std::chrono::microseconds d) {
+  const auto until = bench_clock::now() + d;
+  while(bench_clock::now() < until){}
+}
+
+void bench_priority() {
+  const std::size_t nBackground = 64;   /** chains in flight, always */
+  const std::size_t nStages = 10;
+  const std::size_t nSamples = 300;
+  const auto work = std::chrono::microseconds(20);
+
+  for(auto bPriority : {false, true}){
+    PriorityScheduler sched(1);   /** saturated by the background chains */
+    std::atomic<bool> stop{false};
+    std::atomic<std::size_t> inflight{0};
+    std::function<void()> spawn = [&]{
+      inflight++;
+      auto p = Promise<>::create<int>(sched.schedule(Priority::background), [](auto resolver){ resolver.resolve(0); });
+      for(std::size_t i = 0; i < nStages; i++){
+        p = p->then([work](const int& x){ spin(work); return x + 1; });
+      }
+      p->finally([&]{
+        if(!stop) spawn();
+        inflight--;
+      })->stand_alone();
+    };
+    for(std::size_t i = 0; i < nBackground; i++) spawn();
+
+    std::vector<long long> ns;
+    const auto cls = bPriority ? Priority::interactive : Priority::background;
+    for(std::size_t i = 0; i < nSamples; i++){
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      const auto t0 = bench_clock::now();
+      Promise<>::create<int>(sched.schedule(cls), [](auto resolver){ resolver.resolve(0); })
+      ->then([work](const int& x){ spin(work); return x + 1; })
+      ->then([work](const int& x){ spin(work); return x + 1; })
+      ->then([work](const int& x){ spin(work); return x + 1; })
+      ->wait();
+      ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+    }
+    stop = true;
+    while(inflight > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    report_latency(bPriority ? "3 stage chain, interactive" : "3 stage chain, background (fifo)", ns);
+  }
+}
+
+void bench_node() {
+  for(std::size_t nDepth : {20, 200}){
+    const std::size_t nThen = 2000000;
+    const std::size_t nChains = nThen / nDepth;
+    {
+      const auto t0 = bench_clock::now();
+      for(std::size_t i = 0; i < nChains; i++){
+        std::shared_ptr<Promise<int>::resolver> r;
+        auto p = Promise<>::create<int>([&](auto resolver){ r = std::make_shared<Promise<int>::resolver>(resolver); });
+        for(std::size_t n = 0; n < nDepth; n++){
+          p = p->then([](const int& x){ return x + 1; });
+        }
+        r->resolve(0);
+        if(p->wait() != static_cast<int>(nDepth)) std::abort();
+      }
+      const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / nThen;
+      log() << "depth " << std::setw(4) << nDepth << " then() + settle : " << ns << " ns/node" << std::endl;
+    }
+  }
+  {
+    const std::size_t n = 2000000;
+    const auto t0 = bench_clock::now();
+    for(std::size_t i = 0; i < n; i++){
+      Promise<>::resolve(static_cast<int>(i))->stand_alone();
+    }
+    const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / n;
+    log() << "resolve() + stand_alone()   : " << ns << " ns" << std::endl;
+  }
+}
+
+void bench_ready() {
+  const std::size_t n = 2000000;
+  auto ready = Promise<>::resolve(1);
+  {
+    const auto t0 = bench_clock::now();
+    long long sum = 0;
+    for(std::size_t i = 0; i < n; i++){
+      sum += ready->then([](const int& x){ return x + 1; })->wait();
+    }
+    const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / n;
+    log() << "ready->then()->wait()          : " << ns << " ns" << (sum == 0 ? "!" : "") << std::endl;
+  }
+  {
+    const auto t0 = bench_clock::now();
+    long long sum = 0;
+    for(std::size_t i = 0; i < n; i++){
+      sum += Promise<>::resolve(static_cast<int>(i))
+      ->then([](const int& x){ return x + 1; })
+      ->then([](const int& x){ return x * 2; })
+      ->then([](const int&){})
+      ->wait();
+    }
+    const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / n;
+    log() << "resolve()->then() x3 ->wait()  : " << ns << " ns" << (sum == 0 ? "!" : "") << std::endl;
+  }
+}
+
+void bench_completion() {
+  const std::size_t nBatch = 10000;
+  const std::size_t nRounds = 50;
+  ThreadPool pool(2);
+
+  auto run = [&](const char* name, std::function<void(std::vector<Promise<int>::resolver>&)> settle){
+    double sec = 0;
+    for(std::size_t round = 0; round < nRounds; round++){
+      std::vector<Promise<int>::resolver> rs;
+      std::vector<Promise<int>::sp> tails;
+      rs.reserve(nBatch);
+      tails.reserve(nBatch);
+      auto remain = std::make_shared<std::atomic<std::size_t>>(nBatch);
+      for(std::size_t i = 0; i < nBatch; i++){
+        auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+        tails.push_back(p->then([remain](const int& x){ (*remain)--; return x; }));
+      }
+      const auto t0 = bench_clock::now();
+      settle(rs);
+      while(*remain > 0) std::this_thread::yield();
+      sec += std::chrono::duration<double>(bench_clock::now() - t0).count();
+    }
+    log() << name << " : " << (nBatch * nRounds / sec / 1e6) << " M settlements/s" << std::endl;
+  };
+
+  run("resolve() one by one, inline          ", [](std::vector<Promise<int>::resolver>& rs){
+    for(std::size_t i = 0; i < rs.size(); i++) rs[i].resolve(static_cast<int>(i));
+  });
+  run("CompletionBatch, flush() inline       ", [](std::vector<Promise<int>::resolver>& rs){
+    CompletionBatch batch;
+    batch.reserve(rs.size());
+    for(std::size_t i = 0; i < rs.size(); i++) batch.resolve(rs[i], static_cast<int>(i));
+    batch.flush();
+  });
+  run("resolve() one task each, thread pool  ", [&](std::vector<Promise<int>::resolver>& rs){
+    for(std::size_t i = 0; i < rs.size(); i++){
+      auto r = rs[i];
+      pool.post([r, i]{ r.resolve(static_cast<int>(i)); });
+    }
+  });
+  run("CompletionBatch, flush(pool, 1000)    ", [&](std::vector<Promise<int>::resolver>& rs){
+    CompletionBatch batch;
+    batch.reserve(rs.size());
+    for(std::size_t i = 0; i < rs.size(); i++) batch.resolve(rs[i], static_cast<int>(i));
+    batch.flush(pool, 1000);
+  });
+}
+
+void bench_async_queue() {
+  const std::size_t nItems = 1 << 18;   /** divisible by every thread count */
+
+  /** the hand-off this replaces: mutex + condition variable bounded queue */
+  struct blocking_queue {
+    std::mutex mtx;
+    std::condition_variable not_empty, not_full;
+    std::deque<int> q;
+    std::size_t cap;
+    void push(int x) {
+      std::unique_lock<std::mutex> lock(mtx);
+      not_full.wait(lock, [&]{ return q.size() < cap; });
+      q.push_back(x);
+      not_empty.notify_one();
+    }
+    int pop() {
+      std::unique_lock<std::mutex> lock(mtx);
+      not_empty.wait(lock, [&]{ return !q.empty(); });
+      auto x = q.front();
+      q.pop_front();
+      not_full.notify_one();
+      return x;
+    }
+  };
+
+  auto run = [&](std::size_t nThreads, std::function<void(int)> push, std::function<int()> pop){
+    std::atomic<long long> sum{0};
+    const auto t0 = bench_clock::now();
+    std::vector<std::thread> ts;
+    for(std::size_t t = 0; t < nThreads; t++){
+      ts.emplace_back([&, t]{
+        for(std::size_t i = t; i < nItems; i += nThreads) push(static_cast<int>(i));
+      });
+      ts.emplace_back([&]{
+        long long local = 0;
+        for(std::size_t i = 0; i < nItems / nThreads; i++) local += pop();
+        sum += local;
+      });
+    }
+    for(auto& t : ts) t.join();
+    if(sum != static_cast<long long>(nItems) * (nItems - 1) / 2) std::abort();
+    return nItems / std::chrono::duration<double>(bench_clock::now() - t0).count() / 1e6;
+  };
+
+  for(std::size_t nThreads : {1, 2, 4, 8, 16, 32}){
+    AsyncQueue<int> aq(1024);
+    const auto a = run(nThreads, [&](int x){ aq.push(x)->wait(); }, [&]{ return aq.pop()->wait(); });
+    const auto r = run(nThreads,
+      [&](int x){ while(!aq.try_push(x)) std::this_thread::yield(); },
+      [&]{ int x; while(!aq.try_pop(x)) std::this_thread::yield(); return x; });
+    blocking_queue bq;
+    bq.cap = 1024;
+    const auto b = run(nThreads, [&](int x){ bq.push(x); }, [&]{ return bq.pop(); });
+    log() << std::setw(2) << nThreads << " x " << std::setw(2) << nThreads << " (M items/s)"
+          << " : push/pop promises " << a
+          << ", try_push/try_pop " << r
+          << ", mutex + condvar " << b << std::endl;
+  }
+}
+
+void bench_async_sync() {
+  const auto window = std::chrono::milliseconds(300);
+  const std::size_t nClients = 16;
+
+  auto spread = [&](const std::vector<long>& counts){
+    const auto mm = std::minmax_element(counts.begin(), counts.end());
+    long total = 0;
+    for(auto c : counts) total += c;
+    std::ostringstream os;
+    os << total / std::chrono::duration<double>(window).count() / 1e3 << "k ops/s"
+       << ", per client min " << *mm.first << " / max " << *mm.second;
+    return os.str();
+  };
+
+  /** fairness under contention: 16 clients with a 1us critical section */
+  {
+    std::mutex m;
+    std::atomic<bool> stop{false};
+    std::vector<long> counts(nClients);
+    std::vector<std::thread> ts;
+    for(std::size_t i = 0; i < nClients; i++){
+      ts.emplace_back([&, i]{
+        while(!stop){
+          std::lock_guard<std::mutex> lock(m);
+          spin(std::chrono::microseconds(1));
+          counts[i]++;
+        }
+      });
+    }
+    std::this_thread::sleep_for(window);
+    stop = true;
+    for(auto& t : ts) t.join();
+    log() << "std::mutex, 16 threads        : " << spread(counts) << std::endl;
+  }
+  {
+    AsyncMutex m;
+    ThreadPool pool(2);
+    std::atomic<bool> stop{false};
+    std::vector<long> counts(nClients);
+    std::function<void(std::size_t)> client = [&](std::size_t i){
+      m.acquire()->then([&, i](const AsyncMutex::Guard& g){
+        spin(std::chrono::microseconds(1));
+        counts[i]++;
+        g.release();
+        if(!stop) pool.post([&, i]{ client(i); });
+      })->stand_alone();
+    };
+    for(std::size_t i = 0; i < nClients; i++) pool.post([&, i]{ client(i); });
+    std::this_thread::sleep_for(window);
+    stop = true;
+    while(m.locked() || m.waiting() > 0) std::this_thread::yield();
+    log() << "AsyncMutex, 16 clients / 2 thr: " << spread(counts) << std::endl;
+  }
+
+  /**
+   * limiting a backend with 1ms latency to 8 requests in flight, 2 worker threads.
+   * a counting semaphore blocks a worker for the whole request, the async one does not
+   */
+  const int nRequests = 800;
+  const std::size_t nPermits = 8;
+  auto backend = [](int x){
+    return Promise<>::create<int>([x](auto resolver){
+      Timer::shared().after(std::chrono::milliseconds(1), [resolver, x]{ resolver.resolve(x); });
+    });
+  };
+  {
+    ThreadPool pool(2);
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::size_t permits = nPermits;
+    std::atomic<int> done{0};
+    const auto t0 = bench_clock::now();
+    for(int i = 0; i < nRequests; i++){
+      pool.post([&, i]{
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cond.wait(lock, [&]{ return permits > 0; });
+          permits--;
+        }
+        backend(i)->wait();
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          permits++;
+        }
+        cond.notify_one();
+        done++;
+      });
+    }
+    while(done < nRequests) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    log() << "blocking semaphore(8), 2 thr  : " << nRequests / std::chrono::duration<double>(bench_clock::now() - t0).count() << " req/s" << std::endl;
+  }
+  {
+    ThreadPool pool(2);
+    AsyncSemaphore sem(nPermits);
+    std::vector<Promise<int>::sp> ps(nRequests);
+    std::atomic<int> posted{0};
+    const auto t0 = bench_clock::now();
+    for(int i = 0; i < nRequests; i++){
+      pool.post([&, i]{
+        ps[i] = sem.run([&, i]{ return backend(i); });
+        posted++;
+      });
+    }
+    while(posted < nRequests) std::this_thread::yield();
+    for(auto& p : ps) p->wait();
+    log() << "AsyncSemaphore(8), 2 thr      : " << nRequests / std::chrono::duration<double>(bench_clock::now() - t0).count() << " req/s" << std::endl;
+  }
+
+  /** rate limiter: achieved rate and order */
+  {
+    const double rate = 20000;
+    const int n = 4000;
+    AsyncRateLimiter rl(rate, 10);
+    std::vector<int> order;
+    std::mutex mtx;
+    std::vector<Promise<bool>::sp> ps;
+    const auto t0 = bench_clock::now();
+    for(int i = 0; i < n; i++){
+      ps.push_back(rl.run([&, i]{
+        std::lock_guard<std::mutex> lock(mtx);
+        order.push_back(i);
+      }));
+    }
+    for(auto& p : ps) p->wait();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "AsyncRateLimiter(20000/s)     : " << n / sec << " acquisitions/s, "
+          << (std::is_sorted(order.begin(), order.end()) ? "FIFO" : "out of order") << std::endl;
+  }
+}
+
+/** compare jpromise_bench and jpromise_bench_metrics */
+void bench_metrics() {
+  const int n = 1 << 20;
+  auto ns_per = [](bench_clock::time_point t0, int count){
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / count;
+  };
+
+#if defined(JPROMISE_METRICS)
+  log() << "JPROMISE_METRICS on, 1 in " << Metrics::sample_every << " events timed" << std::endl;
+  {
+    auto t0 = bench_clock::now();
+    for(int i = 0; i < n; i++){
+      auto node = Metrics::created<int>();
+      Metrics::settled(node, true);
+      Metrics::destroyed(node, false);
+    }
+    log() << "create + settle + destroy hooks  : " << ns_per(t0, n * 3) << " ns/event" << std::endl;
+    t0 = bench_clock::now();
+    for(int i = 0; i < n; i++) Metrics::handlers_run(1);
+    log() << "handlers_run hook                : " << ns_per(t0, n) << " ns/event" << std::endl;
+    t0 = bench_clock::now();
+    for(int i = 0; i < n; i++) Metrics::callback_scope scope;
+    log() << "callback_scope hook              : " << ns_per(t0, n) << " ns/event" << std::endl;
+  }
+#else
+  log() << "JPROMISE_METRICS off" << std::endl;
+#endif
+
+  /** the same workloads in both builds */
+  long sum = 0;
+  auto t0 = bench_clock::now();
+  for(int i = 0; i < n; i++){
+    sum += Promise<>::resolve(i)->then([](const int& x){ return x + 1; })->wait();
+  }
+  log() << "resolve()->then()->wait()        : " << ns_per(t0, n) << " ns" << std::endl;
+
+  t0 = bench_clock::now();
+  for(int i = 0; i < n / 4; i++){
+    std::vector<Promise<int>::resolver> rs;
+    auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+    auto q = p->then([](const int& x){ return x + 1; })->then([](const int& x){ return x + 1; });
+    rs[0].resolve(i);
+    sum += q->wait();
+  }
+  log() << "pending create + then x2 + settle: " << ns_per(t0, n / 4) << " ns" << std::endl;
+
+#if defined(JPROMISE_METRICS)
+  const auto s = Metrics::shared().stats<int>();
+  log() << "Promise<int> created " << s.created << ", live " << s.live() << ", pending " << s.pending() << std::endl;
+#endif
+  if(sum == 0) std::abort();
+}
+
+/** 1 KiB result that counts how many copies are alive */
+struct counted_blob {
+  static std::atomic<long> live, peak;
+  std::vector<char> data;
+  counted_blob() = default;
+  explicit counted_blob(std::size_t n) : data(n) { up(); }
+  counted_blob(const counted_blob& o) : data(o.data) { if(!data.empty()) up(); }
+  counted_blob& operator=(const counted_blob& o) {
+    if(data.empty() && !o.data.empty()) up();
+    else if(!data.empty() && o.data.empty()) live--;
+    data = o.data;
+    return *this;
+  }
+  counted_blob& operator=(counted_blob&& o) {
+    if(!data.empty()) live--;
+    data = std::move(o.data);
+    return *this;
+  }
+  ~counted_blob() { if(!data.empty()) live--; }
+  static void up() {
+    const auto n = ++live;
+    auto p = peak.load();
+    while(n > p && !peak.compare_exchange_weak(p, n));
+  }
+};
+std::atomic<long> counted_blob::live{0};
+std::atomic<long> counted_blob::peak{0};
+
+void bench_fold() {
+  const int n = 100000;
+  const std::size_t nThreads = 2;
+
+  /** inputs settled by producer threads, the caller keeps no reference to them */
+  auto run = [&](const char* name, std::function<Promise<long>::sp(std::vector<Promise<counted_blob>::sp>&)> consume){
+    std::vector<Promise<counted_blob>::resolver> rs;
+    std::vector<Promise<counted_blob>::sp> ps;
+    rs.reserve(n);
+    for(int i = 0; i < n; i++) ps.push_back(Promise<>::create<counted_blob>([&](auto resolver){ rs.push_back(resolver); }));
+    counted_blob::peak = counted_blob::live.load();
+    const auto t0 = bench_clock::now();
+    auto result = consume(ps);
+    ps.clear();
+    std::vector<std::thread> ts;
+    for(std::size_t t = 0; t < nThreads; t++){
+      ts.emplace_back([&, t]{
+        for(std::size_t i = t; i < static_cast<std::size_t>(n); i += nThreads) rs[i].resolve(counted_blob(1024));
+      });
+    }
+    for(auto& t : ts) t.join();
+    const auto total = result->wait();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    if(total != static_cast<long>(n) * 1024) std::abort();
+    log() << std::setw(28) << std::left << name << std::right
+          << " : " << n / sec / 1e6 << " M results/s, peak " << counted_blob::peak << " results alive ("
+          << counted_blob::peak * 1024 / (1 << 20) << " MiB)" << std::endl;
+  };
+
+  run("all() then sum", [](std::vector<Promise<counted_blob>::sp>& ps){
+    return Promise<>::all(ps.data(), ps.data() + ps.size())->then([](const std::vector<counted_blob>& xs){
+      long sum = 0;
+      for(auto& x : xs) sum += static_cast<long>(x.data.size());
+      return sum;
+    });
+  });
+  run("reduce()", [](std::vector<Promise<counted_blob>::sp>& ps){
+    return Promise<>::reduce(ps.begin(), ps.end(), 0L, [](long acc, const counted_blob& x){
+      return acc + static_cast<long>(x.data.size());
+    });
+  });
+  run("as_completed()", [](std::vector<Promise<counted_blob>::sp>& ps){
+    auto sum = std::make_shared<long>(0);
+    return Promise<>::as_completed(ps.begin(), ps.end(), [sum](const counted_blob& x, std::size_t){
+      *sum += static_cast<long>(x.data.size());
+    })->then([sum](const std::size_t&){ return *sum; });
+  });
+}
+
+/** 1M pending nodes visited in random order: the cache misses one node costs */
+void bench_layout() {
+  const std::size_t n = 1000000;
+  log() << "sizeof(Promise<int>) " << sizeof(Promise<int>) << std::endl;
+  std::vector<Promise<int>::resolver> rs;
+  std::vector<Promise<int>::sp> ps;
+  rs.reserve(n);
+  ps.reserve(n);
+  for(std::size_t i = 0; i < n; i++){
+    ps.push_back(Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); }));
+  }
+  std::vector<std::size_t> order(n);
+  for(std::size_t i = 0; i < n; i++) order[i] = i;
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+  std::vector<Promise<int>*> walk(n);
+  for(std::size_t i = 0; i < n; i++) walk[i] = ps[order[i]].get();
+
+  auto report = [&](const char* name, bench_clock::time_point t0){
+    const auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count() / n;
+    log() << std::setw(28) << std::left << name << ": " << ns << " ns/node" << std::endl;
+  };
+  {
+    const auto t0 = bench_clock::now();
+    std::size_t nPending = 0;
+    for(auto p : walk) nPending += p->is_ready() ? 0 : 1;
+    report("walk, is_ready()", t0);
+    if(nPending != n) std::abort();
+  }
+  {
+    const auto t0 = bench_clock::now();
+    for(auto p : walk) p->then([](const int& x){ return x + 1; });
+    report("walk, then()", t0);
+  }
+  {
+    const auto t0 = bench_clock::now();
+    for(std::size_t i = 0; i < n; i++) rs[order[i]].resolve(static_cast<int>(i));
+    report("walk, resolve() + 1 handler", t0);
+  }
+  {
+    const auto t0 = bench_clock::now();
+    long long sum = 0;
+    for(auto p : walk) sum += *p->try_get();
+    report("walk, try_get()", t0);
+    if(sum == 0) std::abort();
+  }
+}
+
+/** one thread builds, settles and reads chains: the JPROMISE_SINGLE_THREADED use case */
+void bench_chain() {
+#if defined(JPROMISE_SINGLE_THREADED)
+  log() << "JPROMISE_SINGLE_THREADED, sizeof(Promise<int>) " << sizeof(Promise<int>) << std::endl;
+#else
+  log() << "thread safe, sizeof(Promise<int>) " << sizeof(Promise<int>) << std::endl;
+#endif
+  const std::size_t n = 1000000;
+  {
+    const auto t0 = bench_clock::now();
+    long long sum = 0;
+    for(std::size_t i = 0; i < n; i++){
+      std::vector<Promise<int>::resolver> rs;
+      auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); })
+      ->then([](const int& x){ return x + 1; })
+      ->then([](const int& x){ return x * 2; })
+      ->then([](const int& x){ return x - 1; })
+      ->then([](const int& x){ return x + 3; });
+      rs[0].resolve(static_cast<int>(i));
+      sum += *p->try_get();
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "pending, 4 x then(), settle : " << n / sec / 1e6 << " M chains/s" << (sum == 0 ? "!" : "") << std::endl;
+  }
+  {
+    const auto t0 = bench_clock::now();
+    long long sum = 0;
+    for(std::size_t i = 0; i < n; i++){
+      std::vector<Promise<int>::resolver> rs;
+      auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+      for(int k = 0; k < 8; k++){
+        p->then([&sum](const int& x){ sum += x; })->stand_alone();
+      }
+      rs[0].resolve(static_cast<int>(i));
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "pending, 8 handlers, settle : " << n / sec / 1e6 << " M fan-outs/s" << (sum == 0 ? "!" : "") << std::endl;
+  }
+}
+
+void bench_pipeline() {
+  /** parse -> enrich -> persist, enrich waits 200us on a timer (a remote call) */
+  const std::size_t n = 20000;
+  const auto delay = std::chrono::microseconds(200);
+  std::atomic<std::size_t> nEnrich{0}, nPeak{0};
+  auto parse = [](const int& x){ return Promise<>::resolve(std::to_string(x)); };
+  auto enrich = [&](const std::string& s){
+    const auto k = ++nEnrich;
+    for(auto peak = nPeak.load(); k > peak && !nPeak.compare_exchange_weak(peak, k);){}
+    return Promise<>::create<std::string>([&, s](auto resolver){
+      Timer::shared().after(delay, [&, resolver, s]{
+        nEnrich--;
+        resolver.resolve(s + "/enriched");
+      });
+    });
+  };
+  auto persist = [](const std::string& s){ return Promise<>::resolve(s.size()); };
+
+  {
+    /** what it replaces: one then() chain per message, every message in flight at once */
+    nPeak = 0;
+    const auto t0 = bench_clock::now();
+    std::vector<Promise<std::size_t>::sp> ps;
+    for(std::size_t i = 0; i < n; i++){
+      ps.push_back(parse(static_cast<int>(i))->then(enrich)->then(persist));
+    }
+    std::size_t sum = 0;
+    for(auto& p : ps) sum += p->wait();
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    log() << "then() chains              : " << std::setw(8) << static_cast<long>(n / sec) << " msgs/s, peak enrich in flight " << nPeak
+          << (sum == 0 ? "!" : "") << std::endl;
+  }
+  for(bool bOrdered : { true, false }){
+    for(std::size_t c : { 1, 8, 64 }){
+      nPeak = 0;
+      const auto t0 = bench_clock::now();
+      auto p = PipelineBuilder<int>()
+        .stage("parse", parse, { .concurrency = 1, .capacity = 64 })
+        .stage("enrich", enrich, { .concurrency = c, .capacity = 64 })
+        .stage("persist", persist, { .concurrency = 1, .capacity = 64 })
+        .build({ .ordered = bOrdered, .output_capacity = 64 });
+      std::size_t sum = 0;
+      auto done = p->output()->for_each([&sum](const std::size_t& x){ sum += x; });
+      for(std::size_t i = 0; i < n; i++) p->push(static_cast<int>(i))->wait();
+      p->close();
+      done->wait();
+      const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+      const auto stats = p->stats();
+      log() << "pipeline " << (bOrdered ? "ordered  " : "unordered") << " c=" << std::setw(2) << c
+            << " : " << std::setw(8) << static_cast<long>(n / sec) << " msgs/s, peak enrich in flight " << nPeak
+            << ", max queued " << stats[0].max_queued << "/" << stats[1].max_queued << "/" << stats[2].max_queued
+            << (sum == 0 ? "!" : "") << std::endl;
+    }
+  }
+}
+
+void bench_hedge() {
+  /**
+   * simulated on virtual time: 95% of the calls take ~10ms (lognormal), 5% hit a
+   * pareto(1.2) tail starting at 30ms. latency is measured from the first call to
+   * the result, load is the number of calls per request.
+   */
+  using us = std::chrono::microseconds;
+  const std::size_t n = 200000;
+  std::mt19937_64 rng(42);
+  std::lognormal_distribution<double> body(std::log(10000.0), 0.25);
+  std::uniform_real_distribution<double> u(0.0, 1.0);
+  auto draw = [&]{
+    if(u(rng) < 0.95) return us(static_cast<long>(body(rng)));
+    return us(static_cast<long>(std::min(30000.0 / std::pow(1.0 - u(rng), 1.0 / 1.2), 5e6)));
+  };
+
+  for(auto delay_ms : { 0, 15, 20, 30 }){
+    VirtualTimer vt;
+    std::size_t nCalls = 0;
+    std::vector<long> lat;
+    lat.reserve(n);
+    const auto t0 = bench_clock::now();
+    for(std::size_t i = 0; i < n; i++){
+      const auto start = vt.now();
+      auto factory = [&]{
+        nCalls++;
+        return Promise<>::create<int>([&](auto resolver){
+          vt.after(draw(), [resolver]{ resolver.resolve(1); });
+        });
+      };
+      auto p = delay_ms == 0 ? factory() : Promise<>::hedge(factory, std::chrono::milliseconds(delay_ms), 2, &vt);
+      while(!p->is_ready()) vt.run_all(1);
+      lat.push_back(std::chrono::duration_cast<us>(vt.now() - start).count());
+      vt.run_all();   /** the loser's reply, if any */
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    std::sort(lat.begin(), lat.end());
+    std::ostringstream name;
+    if(delay_ms == 0) name << "no hedge";
+    else name << "hedge after " << delay_ms << "ms";
+    log() << std::setw(18) << std::left << name.str() << std::right
+          << " p50 " << std::setw(6) << percentile(lat, 0.50) / 1000.0 << "ms"
+          << "  p99 " << std::setw(6) << percentile(lat, 0.99) / 1000.0 << "ms"
+          << "  p99.9 " << std::setw(7) << percentile(lat, 0.999) / 1000.0 << "ms"
+          << "  calls/request " << std::setprecision(3) << static_cast<double>(nCalls) / n << std::setprecision(6)
+          << "  (" << static_cast<long>(n / sec) << " simulated requests/s)" << std::endl;
+  }
+}
+
+void bench_scope() {
+  /**
+   * simulated on virtual time: a spike of n requests arrives at once, each child is a
+   * 10ms call holding a 4KiB buffer. fire-and-forget keeps all of them alive together,
+   * a capped scope trades drain time for memory.
+   */
+  const std::size_t n = 100000;
+  const auto call = std::chrono::milliseconds(10);
+  for(std::size_t cap : { 0, 1024, 256 }){
+    VirtualTimer vt;
+    std::size_t nLive = 0, nPeak = 0, nDone = 0;
+    auto child = [&]{
+      auto buffer = std::make_shared<std::vector<char>>(4096);
+      nPeak = std::max(nPeak, ++nLive);
+      return Promise<>::create<bool>([&, buffer](auto resolver){
+        vt.after(call, [&, buffer, resolver]{
+          nLive--;
+          nDone++;
+          resolver.resolve(true);
+        });
+      });
+    };
+    const auto t0 = bench_clock::now();
+    const auto start = vt.now();
+    if(cap == 0){
+      for(std::size_t i = 0; i < n; i++) child()->stand_alone({ .on_fulfilled = [](const bool&){}, .on_rejected = {} });
+      vt.run_all();
+    }
+    else{
+      AsyncScope scope({ .max_outstanding = cap });
+      for(std::size_t i = 0; i < n; i++){
+        auto started = scope.spawn(child);
+        while(!started->is_ready()) vt.run_all(1);
+      }
+      auto joined = scope.join();
+      while(!joined->is_ready()) vt.run_all(1);
+    }
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    const auto drain = std::chrono::duration_cast<std::chrono::milliseconds>(vt.now() - start).count();
+    std::ostringstream name;
+    if(cap == 0) name << "stand_alone";
+    else name << "scope, cap " << cap;
+    log() << std::setw(16) << std::left << name.str() << std::right
+          << " peak children " << std::setw(6) << nPeak
+          << "  peak buffers " << std::setw(4) << nPeak * 4096 / (1024 * 1024) << "MiB"
+          << "  drained in " << std::setw(5) << drain << "ms"
+          << "  (" << static_cast<long>(nDone / sec) << " simulated children/s)" << std::endl;
+  }
+
+  /** shutdown with n/10 children in 10s calls: wait them out, or cancel and let the tokens stop them */
+  for(bool bCancel : { false, true }){
+    VirtualTimer vt;
+    AsyncScope scope;
+    for(std::size_t i = 0; i < n / 10; i++){
+      scope.spawn([&vt](const AsyncScope::Token& token){
+        return Promise<>::create<bool>([&vt, token](auto resolver){
+          auto id = vt.after(std::chrono::seconds(10), [resolver]{ resolver.resolve(true); });
+          token.on_cancel([&vt, id, resolver]{
+            if(vt.cancel(id)) resolver.resolve(false);
+          });
+        });
+      });
+    }
+    const auto t0 = bench_clock::now();
+    const auto start = vt.now();
+    if(bCancel) scope.cancel();
+    auto joined = scope.join();
+    while(!joined->is_ready()) vt.run_all(1);
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - t0).count();
+    const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(vt.now() - start).count();
+    log() << std::setw(16) << std::left << (bCancel ? "cancel + join" : "join") << std::right
+          << " joined after " << std::setw(5) << waited << "ms simulated, " << us << "us of work" << std::endl;
+  }
+}
+
+void bench_shared_memory() {
+  /** coordinator -> worker process -> coordinator, one request at a time */
+  const std::size_t n = 20000;
+  SharedArena arena(2 * n * 256);   /** slots are 64 byte aligned */
+  std::vector<SharedSlot<int>*> req, resp;
+  for(std::size_t i = 0; i < n; i++){
+    req.push_back(arena.make<int>());
+    resp.push_back(arena.make<int>());
+  }
+  int to_worker[2], from_worker[2];
+  if(::pipe(to_worker) < 0 || ::pipe(from_worker) < 0) std::abort();
+
+  /** the worker answers n requests over the pipes, then n over the slots, and does it again */
+  const pid_t pid = fork();
+  if(pid == 0){
+    for(int round = 0; round < 2; round++){
+      for(std::size_t i = 0; i < n; i++){
+        int x;
+        if(::read(to_worker[0], &x, sizeof(x)) != sizeof(x)) _exit(1);
+        x++;
+        if(::write(from_worker[1], &x, sizeof(x)) != sizeof(x)) _exit(1);
+      }
+      for(std::size_t i = 0; i < n; i++) arena.resolve(resp[i], arena.wait(req[i]) + 1);
+    }
+    _exit(0);
+  }
+  auto reset = [&]{
+    for(std::size_t i = 0; i < n; i++){
+      req[i]->reset();
+      resp[i]->reset();
+    }
+  };
+  std::vector<long> ns;
+  ns.reserve(n);
+
+  /** blocking: read() on a pipe vs futex wait on the slot */
+  for(std::size_t i = 0; i < n; i++){
+    const auto t0 = bench_clock::now();
+    int x = static_cast<int>(i);
+    if(::write(to_worker[1], &x, sizeof(x)) != sizeof(x) || ::read(from_worker[0], &x, sizeof(x)) != sizeof(x)) std::abort();
+    ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+  }
+  report_latency("pipe round trip, blocking", ns);
+  ns.clear();
+  for(std::size_t i = 0; i < n; i++){
+    const auto t0 = bench_clock::now();
+    arena.resolve(req[i], static_cast<int>(i));
+    if(arena.wait(resp[i]) != static_cast<int>(i) + 1) std::abort();
+    ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+  }
+  report_latency("slot round trip, futex", ns);
+  ns.clear();
+  /** the worker is in its next round now, it waits on the pipe first */
+  reset();
+
+  /** promises on a reactor: async_read() of the pipe vs the slot's eventfd. each step is post()ed */
+  Reactor reactor;
+  std::thread loop([&]{ reactor.run(); });
+  std::function<void(std::size_t)> pipe_step, slot_step;
+  auto done = Promise<>::create<bool>([&](auto resolver){
+    auto buf = std::make_shared<int>();
+    pipe_step = [&, buf, resolver](std::size_t i){
+      if(i == n) { resolver.resolve(true); return; }
+      const auto t0 = bench_clock::now();
+      *buf = static_cast<int>(i);
+      reactor.async_write(to_worker[1], buf.get(), sizeof(int))
+      ->then([&, buf](const std::size_t&){ return reactor.async_read(from_worker[0], buf.get(), sizeof(int)); })
+      ->then([&, t0, i](const std::size_t&){
+        ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+        reactor.post([&, i]{ pipe_step(i + 1); });
+      });
+    };
+    reactor.post([&]{ pipe_step(0); });
+  });
+  done->wait();
+  report_latency("pipe round trip, Reactor", ns);
+  ns.clear();
+  done = Promise<>::create<bool>([&](auto resolver){
+    slot_step = [&, resolver](std::size_t i){
+      if(i == n) { resolver.resolve(true); return; }
+      const auto t0 = bench_clock::now();
+      arena.resolve(req[i], static_cast<int>(i));
+      arena.promise(reactor, resp[i])->then([&, t0, i](const int&){
+        ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+        reactor.post([&, i]{ slot_step(i + 1); });
+      });
+    };
+    reactor.post([&]{ slot_step(0); });
+  });
+  done->wait();
+  report_latency("slot round trip, Reactor", ns);
+  reactor.stop();
+  loop.join();
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  for(int fd : { to_worker[0], to_worker[1], from_worker[0], from_worker[1] }) ::close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+#if defined(JPROMISE_SINGLE_THREADED)
+  /** the others settle promises from pool or timer threads */
+  const std::vector<std::string> single_threaded = { "node", "ready", "chain", "layout" };
+#endif
+  const std::vector<std::pair<std::string, std::function<void()>>> benches = {
+    { "async_cache", bench_async_cache },
+    { "async_stream", bench_async_stream },
+    { "batch_loader", bench_batch_loader },
+    { "reactor", bench_reactor },
+    { "file_io", bench_file_io },
+    { "strand", bench_strand },
+    { "pipe", bench_pipe },
+    { "priority", bench_priority },
+    { "node", bench_node },
+    { "ready", bench_ready },
+    { "completion", bench_completion },
+    { "async_queue", bench_async_queue },
+    { "async_sync", bench_async_sync },
+    { "metrics", bench_metrics },
+    { "fold", bench_fold },
+    { "chain", bench_chain },
+    { "layout", bench_layout },
+    { "pipeline", bench_pipeline },
+    { "hedge", bench_hedge },
+    { "shared_memory", bench_shared_memory },
+    { "scope", bench_scope },
+  };
+  for(auto& b : benches){
+    if(argc > 1 && std::find(argv + 1, argv + argc, b.first) == argv + argc) continue;
+#if defined(JPROMISE_SINGLE_THREADED)
+    if(std::find(single_threaded.begin(), single_threaded.end(), b.first) == single_threaded.end()) continue;
+#endif
+    log() << "================ " << b.first << " ================" << std::endl;
+    b.second();
+  }
+}
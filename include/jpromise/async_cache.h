@@ -0,0 +1,214 @@
+#if !defined(__h_async_cache__)
+#define __h_async_cache__
+
+#include <chrono>
+#include <list>
+#include <atomic>
+#include <stdexcept>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * single-flight cache of Promise<V>::sp keyed by K.
+ *  - concurrent get() for the same key share one pending promise
+ *  - fulfilled values are kept until `ttl` expires or they fall out of the LRU
+ *  - rejected entries are evicted as soon as they settle
+ */
+template <typename K, typename V, typename HASH = std::hash<K>>
+class AsyncCache {
+public:
+  using clock       = std::chrono::steady_clock;
+  using promise_sp  = typename Promise<V>::sp;
+  using factory_fn  = std::function<promise_sp(const K&)>;
+
+  struct options {
+    std::size_t     capacity  = 1024;   /** upper bound of entries (all shards) */
+    clock::duration ttl       = std::chrono::seconds(60);
+    std::size_t     shards    = 16;
+  };
+
+  struct stats {
+    std::size_t hits      = 0;  /** served from a fulfilled entry */
+    std::size_t coalesced = 0;  /** joined a pending request */
+    std::size_t misses    = 0;  /** called the factory */
+  };
+
+private:
+  struct entry {
+    promise_sp                          promise;
+    bool                                ready = false;
+    clock::time_point                   expires;
+    typename std::list<K>::iterator     lru;
+  };
+
+  struct shard {
+    std::mutex                            mtx;
+    std::unordered_map<K, entry, HASH>    entries;
+    std::list<K>                          lru;      /** front = most recently used */
+    std::size_t                           capacity = 0;
+  };
+
+  struct state {
+    factory_fn                          factory;
+    clock::duration                     ttl;
+    std::vector<std::unique_ptr<shard>> shards;
+    std::atomic<std::size_t>            hits{0};
+    std::atomic<std::size_t>            coalesced{0};
+    std::atomic<std::size_t>            misses{0};
+  };
+  using state_sp = std::shared_ptr<state>;
+
+  state_sp state_;
+
+  static shard& shard_for(const state_sp& s, const K& key) {
+    return *s->shards[HASH{}(key) % s->shards.size()];
+  }
+
+  /** drop least recently used fulfilled entries, pending ones are never evicted */
+  static void evict(shard& sh) {
+    auto it = sh.lru.end();
+    while(sh.entries.size() > sh.capacity && it != sh.lru.begin()){
+      --it;
+      auto e = sh.entries.find(*it);
+      if(e->second.promise->state() != PromiseState::pending){
+        sh.entries.erase(e);
+        it = sh.lru.erase(it);
+      }
+    }
+  }
+
+  static void on_settled(std::weak_ptr<state> ws, const K& key, promise_sp p, bool fulfilled) {
+    auto s = ws.lock();
+    if(!s) return;
+    auto& sh = shard_for(s, key);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    auto it = sh.entries.find(key);
+    if(it == sh.entries.end() || it->second.promise != p) return;
+    if(fulfilled){
+      if(!it->second.ready){
+        it->second.ready = true;
+        it->second.expires = clock::now() + s->ttl;
+      }
+      evict(sh);
+    }
+    else{
+      sh.lru.erase(it->second.lru);
+      sh.entries.erase(it);
+    }
+  }
+
+public:
+  AsyncCache(factory_fn factory, options opt = {}) : state_(std::make_shared<state>()) {
+    const auto n = opt.shards > 0 ? opt.shards : 1;
+    state_->factory = std::move(factory);
+    state_->ttl = opt.ttl;
+    for(std::size_t i = 0; i < n; i++){
+      state_->shards.emplace_back(new shard());
+      state_->shards.back()->capacity = std::max<std::size_t>(1, (opt.capacity + n - 1) / n);
+    }
+  }
+
+  promise_sp get(const K& key) {
+    auto& sh = shard_for(state_, key);
+    std::function<void()> launch;
+    promise_sp p;
+    {
+      std::lock_guard<std::mutex> lock(sh.mtx);
+      auto it = sh.entries.find(key);
+      if(it != sh.entries.end()){
+        /** the promise settles before on_settled() runs: its state decides, not the flags */
+        auto& e = it->second;
+        const PromiseState ps = e.promise->state();
+        if(ps == PromiseState::fulfilled && !e.ready){
+          e.ready = true;
+          e.expires = clock::now() + state_->ttl;
+        }
+        if(ps == PromiseState::pending || (ps == PromiseState::fulfilled && clock::now() < e.expires)){
+          sh.lru.splice(sh.lru.begin(), sh.lru, e.lru);
+          (e.ready ? state_->hits : state_->coalesced)++;
+          return e.promise;
+        }
+        sh.lru.erase(e.lru);
+        sh.entries.erase(it);
+      }
+      state_->misses++;
+
+      /** placeholder promise, the factory is called after the shard is unlocked */
+      std::weak_ptr<state> ws = state_;
+      p = Promise<>::create<V>([&](auto resolver){
+        launch = [ws, key, resolver](){
+          auto s = ws.lock();
+          if(!s){
+            resolver.reject(std::make_exception_ptr(std::runtime_error("AsyncCache destroyed")));
+            return;
+          }
+          try{
+            s->factory(key)->stand_alone({
+              .on_fulfilled = [resolver](const V& x){ resolver.resolve(x); },
+              .on_rejected = [resolver](std::exception_ptr e){ resolver.reject(e); }
+            });
+          }
+          catch(...){
+            resolver.reject(std::current_exception());
+          }
+        };
+      });
+      sh.lru.push_front(key);
+      entry e;
+      e.promise = p;
+      e.lru = sh.lru.begin();
+      sh.entries.emplace(key, std::move(e));
+      evict(sh);
+    }
+
+    std::weak_ptr<state> ws = state_;
+    p->stand_alone({
+      .on_fulfilled = [ws, key, p](const V&){ on_settled(ws, key, p, true); },
+      .on_rejected = [ws, key, p](std::exception_ptr){ on_settled(ws, key, p, false); }
+    });
+    launch();
+    return p;
+  }
+
+  void erase(const K& key) {
+    auto& sh = shard_for(state_, key);
+    std::lock_guard<std::mutex> lock(sh.mtx);
+    auto it = sh.entries.find(key);
+    if(it == sh.entries.end()) return;
+    sh.lru.erase(it->second.lru);
+    sh.entries.erase(it);
+  }
+
+  void clear() {
+    for(auto& sh : state_->shards){
+      std::lock_guard<std::mutex> lock(sh->mtx);
+      sh->entries.clear();
+      sh->lru.clear();
+    }
+  }
+
+  std::size_t size() const {
+    std::size_t n = 0;
+    for(auto& sh : state_->shards){
+      std::lock_guard<std::mutex> lock(sh->mtx);
+      for(auto& e : sh->entries){
+        if(e.second.promise->state() != PromiseState::rejected) n++;
+      }
+    }
+    return n;
+  }
+
+  stats get_stats() const {
+    stats st;
+    st.hits = state_->hits;
+    st.coalesced = state_->coalesced;
+    st.misses = state_->misses;
+    return st;
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_async_cache__) */
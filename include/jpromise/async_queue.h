@@ -0,0 +1,263 @@
+#if !defined(__h_async_queue__)
+#define __h_async_queue__
+
+#include <deque>
+#include <atomic>
+#include <stdexcept>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * bounded multi-producer / multi-consumer queue for promise based consumers.
+ *  - try_push() / the fast paths of push() and pop() only touch a lock-free ring
+ *  - pop() is fulfilled at once if an item is available, otherwise its resolver
+ *    waits in a list and the next push() hands its item over directly
+ *  - push() on a full queue parks the item, the promise is fulfilled with true
+ *    once a pop() made room for it (false if the queue is closed first)
+ *  - the mutex is only taken when someone has to wait
+ */
+template <typename T> class AsyncQueue {
+public:
+  using value_type  = T;
+
+  /** rejects pop() on a closed and drained queue */
+  struct closed_error : std::runtime_error {
+    closed_error() : std::runtime_error("AsyncQueue closed") {}
+  };
+
+private:
+  using mtx   = std::mutex;
+  using guard = std::lock_guard<mtx>;
+
+  /** Vyukov bounded MPMC ring: a slot is free for ticket `n` when seq == n */
+  struct cell {
+    std::atomic<std::size_t>  seq;
+    T                         value;
+  };
+  struct writer {
+    typename Promise<bool>::resolver  r;
+    T                                 value;
+  };
+
+  std::unique_ptr<cell[]>   cells_;
+  const std::size_t         mask_;
+  char                      pad0_[64];
+  std::atomic<std::size_t>  enq_{0};
+  char                      pad1_[64];
+  std::atomic<std::size_t>  deq_{0};
+  char                      pad2_[64];
+  std::atomic<std::size_t>  nReaders_{0};   /** readers_.size(), read without the lock */
+  std::atomic<std::size_t>  nWriters_{0};
+  std::atomic<bool>         closed_{false};
+
+  mtx                                           mtx_;
+  std::deque<typename Promise<T>::resolver>     readers_;   /** consumers waiting for an item */
+  std::deque<writer>                            writers_;   /** producers waiting for space */
+  Promise<bool>::sp                             accepted_;  /** shared, already settled results of push() */
+  Promise<bool>::sp                             refused_;
+
+  static std::size_t round_up(std::size_t n) {
+    std::size_t c = 2;
+    while(c < n) c <<= 1;
+    return c;
+  }
+
+  /** `value` is only moved from on success */
+  bool enqueue(T& value) {
+    auto pos = enq_.load(std::memory_order_relaxed);
+    cell* c;
+    while(true){
+      c = &cells_[pos & mask_];
+      const auto seq = c->seq.load(std::memory_order_acquire);
+      const auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+      if(dif == 0){
+        if(enq_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      }
+      else if(dif < 0) return false; /** full */
+      else pos = enq_.load(std::memory_order_relaxed);
+    }
+    c->value = std::move(value);
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool dequeue(T& out) {
+    auto pos = deq_.load(std::memory_order_relaxed);
+    cell* c;
+    while(true){
+      c = &cells_[pos & mask_];
+      const auto seq = c->seq.load(std::memory_order_acquire);
+      const auto dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+      if(dif == 0){
+        if(deq_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      }
+      else if(dif < 0) return false; /** empty */
+      else pos = deq_.load(std::memory_order_relaxed);
+    }
+    out = std::move(c->value);
+    c->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * an item was enqueued: hand items to readers that parked meanwhile.
+   * readers park with the lock held after announcing themselves in nReaders_,
+   * and the fence pairs with theirs, so either they see the item or we see them.
+   */
+  void feed_readers() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(nReaders_.load(std::memory_order_relaxed) == 0) return;
+    std::vector<std::pair<typename Promise<T>::resolver, T>> ready;
+    {
+      guard lock(mtx_);
+      T value;
+      while(!readers_.empty() && dequeue(value)){
+        ready.emplace_back(std::move(readers_.front()), std::move(value));
+        readers_.pop_front();
+        nReaders_--;
+      }
+    }
+    for(auto& x : ready) x.first.resolve(std::move(x.second));
+  }
+
+  /** room was made: move parked items into the ring, see feed_readers() */
+  void admit_writers() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(nWriters_.load(std::memory_order_relaxed) == 0) return;
+    std::vector<typename Promise<bool>::resolver> admitted;
+    {
+      guard lock(mtx_);
+      while(!writers_.empty() && enqueue(writers_.front().value)){
+        admitted.push_back(std::move(writers_.front().r));
+        writers_.pop_front();
+        nWriters_--;
+      }
+    }
+    for(auto& r : admitted) r.resolve(true);
+    if(!admitted.empty()) feed_readers();
+  }
+
+  template <typename V>
+  static typename Promise<V>::sp pending(std::unique_ptr<typename Promise<V>::resolver>& r) {
+    return Promise<>::create<V>([&r](auto resolver){
+      r.reset(new typename Promise<V>::resolver(resolver));
+    });
+  }
+
+public:
+  /** `capacity` is rounded up to a power of two */
+  explicit AsyncQueue(std::size_t capacity) :
+    cells_(new cell[round_up(capacity)]),
+    mask_(round_up(capacity) - 1),
+    accepted_(Promise<>::resolve(true)),
+    refused_(Promise<>::resolve(false))
+  {
+    for(std::size_t i = 0; i <= mask_; i++) cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  AsyncQueue(const AsyncQueue&) = delete;
+  AsyncQueue& operator=(const AsyncQueue&) = delete;
+
+  ~AsyncQueue() { close(); }
+
+  /** false if the queue is full or closed */
+  bool try_push(T value) {
+    if(closed_.load(std::memory_order_acquire)) return false;
+    if(!enqueue(value)) return false;
+    feed_readers();
+    return true;
+  }
+
+  /** fulfilled with true once the item is in the queue, false if the queue was closed */
+  Promise<bool>::sp push(T value) {
+    if(closed_.load(std::memory_order_acquire)) return refused_;
+    if(nWriters_.load(std::memory_order_acquire) == 0 && enqueue(value)){
+      feed_readers();
+      return accepted_;
+    }
+    std::unique_ptr<Promise<bool>::resolver> r;
+    auto p = pending<bool>(r);
+    {
+      guard lock(mtx_);
+      if(closed_) return refused_;
+      nWriters_++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(writers_.empty() && enqueue(value)){
+        nWriters_--;
+      }
+      else{
+        writers_.push_back({ std::move(*r), std::move(value) });
+        return p;
+      }
+    }
+    feed_readers();
+    return accepted_;
+  }
+
+  /** next item. rejected with closed_error once the queue is closed and drained */
+  typename Promise<T>::sp pop() {
+    T value;
+    if(dequeue(value)){
+      admit_writers();
+      return Promise<>::resolve(std::move(value));
+    }
+    std::unique_ptr<typename Promise<T>::resolver> r;
+    auto p = pending<T>(r);
+    {
+      guard lock(mtx_);
+      nReaders_++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(!dequeue(value)){
+        if(closed_){
+          nReaders_--;
+          return Promise<>::reject<T>(std::make_exception_ptr(closed_error()));
+        }
+        readers_.push_back(std::move(*r));
+        return p;
+      }
+      nReaders_--;
+    }
+    admit_writers();
+    return Promise<>::resolve(std::move(value));
+  }
+
+  /** false if empty */
+  bool try_pop(T& out) {
+    if(!dequeue(out)) return false;
+    admit_writers();
+    return true;
+  }
+
+  /** waiting producers get false, waiting consumers closed_error. queued items can still be popped */
+  void close() {
+    std::deque<typename Promise<T>::resolver> readers;
+    std::deque<writer> writers;
+    {
+      guard lock(mtx_);
+      if(closed_) return;
+      closed_ = true;
+      readers.swap(readers_);
+      writers.swap(writers_);
+      nReaders_ = 0;
+      nWriters_ = 0;
+    }
+    for(auto& w : writers) w.r.resolve(false);
+    auto err = std::make_exception_ptr(closed_error());
+    for(auto& r : readers) r.reject(err);
+  }
+
+  /** approximate while other threads push / pop */
+  std::size_t size() const {
+    const auto e = enq_.load(std::memory_order_acquire);
+    const auto d = deq_.load(std::memory_order_acquire);
+    return e > d ? e - d : 0;
+  }
+
+  std::size_t capacity() const { return mask_ + 1; }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_async_queue__) */
@@ -0,0 +1,306 @@
+#if !defined(__h_async_scope__)
+#define __h_async_scope__
+
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <stdexcept>
+#include "jpromise.h"
+#include "async_sync.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+struct AsyncScopeOptions {
+  std::size_t max_outstanding = 0;    /** children started and not settled, 0 = no cap */
+  /** a spawn()ed child was rejected */
+  std::function<void(std::exception_ptr)> on_error = {};
+};
+
+/**
+ * owner of fire-and-forget work.
+ *  - spawn() / run() start a child: a function returning Promise<T>::sp, which is
+ *    given the child's Token if it takes one
+ *  - with max_outstanding, children beyond the cap wait in FIFO order and are started
+ *    as earlier ones settle. spawn() is fulfilled once its child started, so a loop
+ *    that waits for it before spawning more is throttled
+ *  - join() closes the scope and is fulfilled once every child settled (a child whose
+ *    promise can never settle counts as settled)
+ *  - cancel() closes the scope, drops the waiting children, fires the running ones'
+ *    tokens and rejects their run() results with cancelled_error. join() still waits
+ *    for them to settle: the token is how a child learns to finish early
+ * destroying the scope cancels it. the children keep what they need alive.
+ */
+class AsyncScope {
+public:
+  /** run() after join() or cancel() */
+  struct closed_error : std::runtime_error {
+    closed_error() : std::runtime_error("AsyncScope closed") {}
+  };
+  struct cancelled_error : std::runtime_error {
+    cancelled_error() : std::runtime_error("AsyncScope cancelled") {}
+  };
+
+  /** tells a child that its scope was cancelled */
+  class Token {
+  friend class AsyncScope;
+  private:
+    struct state {
+      std::mutex                          mtx;
+      bool                                bCancelled = false;
+      std::vector<std::function<void()>>  callbacks;
+    };
+    std::shared_ptr<state> s_ = std::make_shared<state>();
+
+    void cancel() const {
+      std::vector<std::function<void()>> callbacks;
+      {
+        std::lock_guard<std::mutex> lock(s_->mtx);
+        if(s_->bCancelled) return;
+        s_->bCancelled = true;
+        callbacks.swap(s_->callbacks);
+      }
+      for(auto& fn : callbacks) fn();
+    }
+
+  public:
+    bool cancelled() const {
+      std::lock_guard<std::mutex> lock(s_->mtx);
+      return s_->bCancelled;
+    }
+
+    /** `fn` runs on cancellation, at once if the scope is already cancelled */
+    void on_cancel(std::function<void()> fn) const {
+      {
+        std::lock_guard<std::mutex> lock(s_->mtx);
+        if(!s_->bCancelled){
+          s_->callbacks.push_back(std::move(fn));
+          return;
+        }
+      }
+      fn();
+    }
+  };
+
+private:
+  /** the guard is held by the child's handlers: its destruction means the child is done */
+  using start_fn = std::function<void(const Token&, std::shared_ptr<void>)>;
+
+  struct child {
+    start_fn                  start;
+    std::function<void(bool)> refuse;     /** never started, true if cancelled */
+    std::function<void()>     abort;      /** running when the scope was cancelled */
+  };
+  struct running_child {
+    Token                     token;
+    std::function<void()>     abort;
+  };
+
+  struct state : std::enable_shared_from_this<state> {
+    std::mutex                                          mtx;
+    const AsyncScopeOptions                             opts;
+    std::size_t                                         outstanding = 0;
+    std::size_t                                         peak = 0;
+    std::deque<child>                                   waiting;
+    std::unordered_map<std::uint64_t, running_child>    running;
+    std::uint64_t                                       nextId = 1;
+    bool                                                bClosed = false;
+    bool                                                bCancelled = false;
+    std::vector<Promise<bool>::resolver>                joiners;
+
+    explicit state(AsyncScopeOptions o) : opts(std::move(o)) {}
+
+    bool has_room_locked() const {
+      return opts.max_outstanding == 0 || outstanding < opts.max_outstanding;
+    }
+
+    /** count `c` as running. the returned task starts it, outside the lock */
+    std::function<void()> admit_locked(child c) {
+      const auto id = nextId++;
+      Token token;
+      running.emplace(id, running_child{ token, c.abort });
+      outstanding++;
+      peak = std::max(peak, outstanding);
+      auto self = shared_from_this();
+      auto start = std::move(c.start);
+      return [self, id, token, start]{
+        start(token, std::make_shared<finisher>(self, id));
+      };
+    }
+
+    /** child `id` settled, or its promise can never settle */
+    void finished(std::uint64_t id) {
+      std::function<void()> next;
+      std::vector<Promise<bool>::resolver> done;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        running.erase(id);
+        outstanding--;
+        if(!waiting.empty()){
+          next = admit_locked(std::move(waiting.front()));
+          waiting.pop_front();
+        }
+        else if(outstanding == 0){
+          done.swap(joiners);
+        }
+      }
+      /** a child that settles at once would otherwise start the next one recursively */
+      if(next) detail::trampoline(std::move(next));
+      for(auto& r : done) r.resolve(true);
+    }
+  };
+
+  struct finisher {
+    std::shared_ptr<state>  s;
+    std::uint64_t           id;
+    finisher(std::shared_ptr<state> st, std::uint64_t i) : s(std::move(st)), id(i) {}
+    ~finisher() { s->finished(id); }
+  };
+
+  std::shared_ptr<state> state_;
+
+  template <typename F> static auto invoke(F& f, const Token& t, int) -> decltype(f(t)) { return f(t); }
+  template <typename F> static auto invoke(F& f, const Token&, long) -> decltype(f()) { return f(); }
+
+  void submit(child c) {
+    std::function<void()> start;
+    bool bRefused = false, bCancelled = false;
+    {
+      std::lock_guard<std::mutex> lock(state_->mtx);
+      if(state_->bClosed){
+        bRefused = true;
+        bCancelled = state_->bCancelled;
+      }
+      else if(state_->waiting.empty() && state_->has_room_locked()){
+        start = state_->admit_locked(std::move(c));
+      }
+      else{
+        state_->waiting.push_back(std::move(c));
+      }
+    }
+    if(bRefused) c.refuse(bCancelled);
+    if(start) detail::trampoline(std::move(start));
+  }
+
+public:
+  explicit AsyncScope(AsyncScopeOptions opts = {}) : state_(std::make_shared<state>(std::move(opts))) {}
+
+  AsyncScope(const AsyncScope&) = delete;
+  AsyncScope& operator=(const AsyncScope&) = delete;
+
+  ~AsyncScope() { cancel(); }
+
+  /**
+   * start `func` as a child whose result nobody waits for, rejections go to AsyncScopeOptions::on_error.
+   * fulfilled with true once it started, false if the scope was closed first
+   */
+  template <typename F> Promise<bool>::sp spawn(F func) {
+    using R = decltype(invoke(func, std::declval<const Token&>(), 0));
+    static_assert(is_promise_sp<R>::value, "an AsyncScope child returns Promise<T>::sp");
+    auto s = state_;
+    return Promise<>::create<bool>([&](auto admitted){
+      submit({
+        .start = [func, admitted, s](const Token& token, std::shared_ptr<void> done) mutable {
+          admitted.resolve(true);
+          R p;
+          try{
+            p = invoke(func, token, 0);
+          }
+          catch(...){
+            p = Promise<>::reject<typename R::element_type::value_type>(std::current_exception());
+          }
+          p->stand_alone({
+            .on_fulfilled = [done](const auto&){},
+            .on_rejected = [done, s](std::exception_ptr e){
+              if(s->opts.on_error) s->opts.on_error(e);
+            }
+          });
+        },
+        .refuse = [admitted](bool){ admitted.resolve(false); },
+        .abort = {}
+      });
+    });
+  }
+
+  /**
+   * start `func` as a child and pass its result on. rejected with closed_error after
+   * join(), with cancelled_error when the scope is cancelled before the child settled
+   */
+  template <typename F, typename R = decltype(invoke(std::declval<F&>(), std::declval<const Token&>(), 0))>
+  typename R::element_type::sp run(F func) {
+    static_assert(is_promise_sp<R>::value, "an AsyncScope child returns Promise<T>::sp");
+    using T = typename R::element_type::value_type;
+    return Promise<>::create<T>([&](auto result){
+      submit({
+        .start = [func, result](const Token& token, std::shared_ptr<void> done) mutable {
+          R p;
+          try{
+            p = invoke(func, token, 0);
+          }
+          catch(...){
+            p = Promise<>::reject<T>(std::current_exception());
+          }
+          p->stand_alone({
+            .on_fulfilled = [done, result](const T& x){ result.resolve(x); },
+            .on_rejected = [done, result](std::exception_ptr e){ result.reject(e); }
+          });
+        },
+        .refuse = [result](bool bCancelled){
+          if(bCancelled) result.reject(std::make_exception_ptr(cancelled_error()));
+          else result.reject(std::make_exception_ptr(closed_error()));
+        },
+        .abort = [result]{ result.reject(std::make_exception_ptr(cancelled_error())); }
+      });
+    });
+  }
+
+  /** no more children. fulfilled once the ones already spawned settled */
+  Promise<bool>::sp join() {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    state_->bClosed = true;
+    if(state_->outstanding == 0 && state_->waiting.empty()) return Promise<>::resolve(true);
+    return Promise<>::create<bool>([this](auto resolver){
+      state_->joiners.push_back(resolver);
+    });
+  }
+
+  void cancel() {
+    std::deque<child> dropped;
+    std::vector<running_child> cancelled;
+    {
+      std::lock_guard<std::mutex> lock(state_->mtx);
+      if(state_->bCancelled) return;
+      state_->bClosed = state_->bCancelled = true;
+      dropped.swap(state_->waiting);
+      for(auto& r : state_->running) cancelled.push_back(r.second);
+    }
+    for(auto& c : dropped) c.refuse(true);
+    /** abort first: a child stopped by its token would otherwise reject run() with its own error */
+    for(auto& r : cancelled){
+      if(r.abort) r.abort();
+      r.token.cancel();
+    }
+  }
+
+  /** children started and not settled */
+  std::size_t outstanding() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->outstanding;
+  }
+
+  /** children spawned beyond max_outstanding, not started yet */
+  std::size_t waiting() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->waiting.size();
+  }
+
+  /** most children outstanding at once */
+  std::size_t peak() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->peak;
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_async_scope__) */
@@ -0,0 +1,318 @@
+#if !defined(__h_async_stream__)
+#define __h_async_stream__
+
+#include <deque>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * multi-value producer / consumer channel.
+ *  - next(max) returns up to `max` items, an empty vector means end of stream
+ *  - push() returns a promise that is fulfilled when the item is accepted,
+ *    so a producer that chains on it is throttled by the bounded buffer
+ *  - items live in a fixed ring buffer that is reused for the whole stream
+ *  - operators stop pulling and cancel() their source once downstream refuses items
+ */
+template <typename T> class AsyncStream : public std::enable_shared_from_this<AsyncStream<T>> {
+template <typename> friend class AsyncStream;
+public:
+  using value_type  = T;
+  using sp          = std::shared_ptr<AsyncStream<T>>;
+  using batch_type  = std::vector<T>;
+
+private:
+  using mtx   = std::mutex;
+  using guard = std::lock_guard<mtx>;
+
+  struct reader {
+    typename Promise<batch_type>::resolver  r;
+  };
+  struct writer {
+    typename Promise<bool>::resolver  r;
+    T                                 value;
+  };
+
+  mtx                     mtx_;
+  std::vector<T>          ring_;
+  std::size_t             head_ = 0;
+  std::size_t             count_ = 0;
+  bool                    closed_ = false;
+  std::exception_ptr      error_ = nullptr;
+  std::deque<reader>      readers_;   /** consumers waiting for an item */
+  std::deque<writer>      writers_;   /** producers waiting for space */
+  Promise<bool>::sp       accepted_;  /** shared, already fulfilled result of push() */
+  Promise<bool>::sp       refused_;
+
+  AsyncStream(std::size_t capacity) :
+    ring_(capacity > 0 ? capacity : 1),
+    accepted_(Promise<>::resolve(true)),
+    refused_(Promise<>::resolve(false)) {}
+
+  template <typename V>
+  static std::pair<typename Promise<V>::sp, std::shared_ptr<typename Promise<V>::resolver>> pending() {
+    std::shared_ptr<typename Promise<V>::resolver> r;
+    auto p = Promise<>::create<V>([&r](auto resolver){
+      r = std::make_shared<typename Promise<V>::resolver>(resolver);
+    });
+    return { p, r };
+  }
+
+  /** move buffered items to `out`, then refill the ring from waiting producers (lock held) */
+  void take_locked(batch_type& out, std::size_t max, std::vector<typename Promise<bool>::resolver>& admitted) {
+    const auto n = std::min(max, count_);
+    out.reserve(n);
+    for(std::size_t i = 0; i < n; i++){
+      out.push_back(std::move(ring_[head_]));
+      head_ = (head_ + 1) % ring_.size();
+    }
+    count_ -= n;
+    while(!writers_.empty() && count_ < ring_.size()){
+      ring_[(head_ + count_) % ring_.size()] = std::move(writers_.front().value);
+      count_++;
+      admitted.push_back(writers_.front().r);
+      writers_.pop_front();
+    }
+  }
+
+  /** drive `step` with batches from this stream until it ends, fails, or `step` yields false */
+  template <typename STEP, typename DONE>
+  static void pump(sp src, std::size_t batch, STEP step, DONE done) {
+    while(true){
+      auto p = src->next(batch);
+      if(p->state() == PromiseState::pending){
+        p->stand_alone({
+          .on_fulfilled = [src, batch, step, done](const batch_type& items){
+            if(items.empty()) { done(nullptr); return; }
+            auto c = step(items);
+            if(c->state() == PromiseState::pending){
+              c->stand_alone({
+                .on_fulfilled = [src, batch, step, done](bool go){
+                  if(go) pump(src, batch, step, done);
+                  else { src->cancel(); done(nullptr); }
+                },
+                .on_rejected = done
+              });
+            }
+            else if(c->wait()) pump(src, batch, step, done);
+            else { src->cancel(); done(nullptr); }
+          },
+          .on_rejected = done
+        });
+        return;
+      }
+      if(p->state() == PromiseState::rejected){
+        try{ p->wait(); } catch(...){ done(std::current_exception()); }
+        return;
+      }
+      const auto& items = p->wait();
+      if(items.empty()) { done(nullptr); return; }
+      auto c = step(items);
+      if(c->state() == PromiseState::pending){
+        c->stand_alone({
+          .on_fulfilled = [src, batch, step, done](bool go){
+            if(go) pump(src, batch, step, done);
+            else { src->cancel(); done(nullptr); }
+          },
+          .on_rejected = done
+        });
+        return;
+      }
+      if(!c->wait()) { src->cancel(); done(nullptr); return; }
+    }
+  }
+
+  template <typename U> static std::function<void(std::exception_ptr)> close_or_fail(typename AsyncStream<U>::sp down) {
+    return [down](std::exception_ptr e){
+      if(e) down->fail(e);
+      else down->close();
+    };
+  }
+
+public:
+  static sp create(std::size_t capacity = 64) {
+    return sp(new AsyncStream<T>(capacity));
+  }
+
+  std::size_t capacity() const { return ring_.size(); }
+
+  /** push without waiting, false if the buffer is full or the stream is closed */
+  template <typename U> bool try_push(U&& value) {
+    std::deque<reader> r;
+    {
+      guard lock(mtx_);
+      if(closed_ || error_) return false;
+      if(!readers_.empty()){
+        r.push_back(std::move(readers_.front()));
+        readers_.pop_front();
+      }
+      else if(count_ < ring_.size() && writers_.empty()){
+        ring_[(head_ + count_) % ring_.size()] = std::forward<U>(value);
+        count_++;
+        return true;
+      }
+      else return false;
+    }
+    r.front().r.resolve(batch_type{ std::forward<U>(value) });
+    return true;
+  }
+
+  /** fulfilled with true when accepted, false if the stream is already closed */
+  template <typename U> Promise<bool>::sp push(U&& value) {
+    std::deque<reader> r;
+    {
+      guard lock(mtx_);
+      if(closed_ || error_) return refused_;
+      if(!readers_.empty()){
+        r.push_back(std::move(readers_.front()));
+        readers_.pop_front();
+      }
+      else if(count_ < ring_.size() && writers_.empty()){
+        ring_[(head_ + count_) % ring_.size()] = std::forward<U>(value);
+        count_++;
+        return accepted_;
+      }
+      else{
+        auto w = pending<bool>();
+        writers_.push_back({ *w.second, std::forward<U>(value) });
+        return w.first;
+      }
+    }
+    r.front().r.resolve(batch_type{ std::forward<U>(value) });
+    return accepted_;
+  }
+
+  /** end of stream, buffered items are still delivered */
+  void close() {
+    std::deque<reader> r;
+    {
+      guard lock(mtx_);
+      if(closed_) return;
+      closed_ = true;
+      r.swap(readers_);
+    }
+    for(auto& x : r) x.r.resolve(batch_type{});
+  }
+
+  /** consumer side shutdown, buffered items are dropped and producers are refused */
+  void cancel() {
+    std::deque<reader> r;
+    std::deque<writer> w;
+    {
+      guard lock(mtx_);
+      closed_ = true;
+      for(; count_ > 0; count_--){
+        ring_[head_] = T{};
+        head_ = (head_ + 1) % ring_.size();
+      }
+      r.swap(readers_);
+      w.swap(writers_);
+    }
+    for(auto& x : r) x.r.resolve(batch_type{});
+    for(auto& x : w) x.r.resolve(false);
+  }
+
+  /** buffered items are still delivered, then next() is rejected with `err` */
+  void fail(std::exception_ptr err) {
+    std::deque<reader> r;
+    std::deque<writer> w;
+    {
+      guard lock(mtx_);
+      if(closed_ || error_) return;
+      error_ = err;
+      r.swap(readers_);
+      w.swap(writers_);
+    }
+    for(auto& x : r) x.r.reject(err);
+    for(auto& x : w) x.r.resolve(false);
+  }
+
+  typename Promise<batch_type>::sp next(std::size_t max = 1) {
+    batch_type items;
+    std::vector<typename Promise<bool>::resolver> admitted;
+    std::exception_ptr err = nullptr;
+    {
+      guard lock(mtx_);
+      if(count_ == 0){
+        if(error_) err = error_;
+        else if(!closed_){
+          auto rd = pending<batch_type>();
+          readers_.push_back({ *rd.second });
+          return rd.first;
+        }
+      }
+      else{
+        take_locked(items, max > 0 ? max : 1, admitted);
+      }
+    }
+    for(auto& r : admitted) r.resolve(true);
+    if(err) return Promise<>::reject<batch_type>(err);
+    return Promise<>::resolve(std::move(items));
+  }
+
+  template <typename F, typename U = typename std::remove_const<typename std::remove_reference<decltype(std::declval<F>()(std::declval<const T&>()))>::type>::type>
+  typename AsyncStream<U>::sp map(F func, std::size_t batch = 16) {
+    auto down = AsyncStream<U>::create(ring_.size());
+    pump(this->shared_from_this(), batch, [down, func](const batch_type& items){
+      Promise<bool>::sp last = down->accepted_;
+      for(auto& x : items) last = down->push(func(x));
+      return last;
+    }, close_or_fail<U>(down));
+    return down;
+  }
+
+  template <typename F> sp filter(F pred, std::size_t batch = 16) {
+    auto down = AsyncStream<T>::create(ring_.size());
+    pump(this->shared_from_this(), batch, [down, pred](const batch_type& items){
+      Promise<bool>::sp last = down->accepted_;
+      for(auto& x : items){
+        if(pred(x)) last = down->push(x);
+      }
+      return last;
+    }, close_or_fail<T>(down));
+    return down;
+  }
+
+  sp take(std::size_t n, std::size_t batch = 16) {
+    auto down = AsyncStream<T>::create(ring_.size());
+    if(n == 0){
+      down->close();
+      return down;
+    }
+    auto remain = std::make_shared<std::size_t>(n);
+    pump(this->shared_from_this(), std::min(batch, n), [down, remain](const batch_type& items){
+      Promise<bool>::sp last = down->accepted_;
+      for(auto it = items.begin(); it != items.end() && *remain > 0; it++, (*remain)--){
+        last = down->push(*it);
+      }
+      if(*remain == 0){
+        down->close();
+        return down->refused_;
+      }
+      return last;
+    }, close_or_fail<T>(down));
+    return down;
+  }
+
+  /** fulfilled with the number of consumed items when the stream ends */
+  template <typename F> Promise<std::size_t>::sp for_each(F func, std::size_t batch = 16) {
+    auto self = this->shared_from_this();
+    return Promise<>::create<std::size_t>([self, func, batch](auto resolver){
+      auto n = std::make_shared<std::size_t>(0);
+      auto accepted = self->accepted_;
+      pump(self, batch, [func, n, accepted](const batch_type& items){
+        for(auto& x : items) func(x);
+        *n += items.size();
+        return accepted;
+      }, [resolver, n](std::exception_ptr e){
+        if(e) resolver.reject(e);
+        else resolver.resolve(*n);
+      });
+    });
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_async_stream__) */
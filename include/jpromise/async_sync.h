@@ -0,0 +1,324 @@
+#if !defined(__h_async_sync__)
+#define __h_async_sync__
+
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * permit handed out by acquire(). copies share the permit, which is given back
+ * by release() on any copy or when the last copy is gone.
+ * the promise returned by acquire() holds a copy as well: release() explicitly,
+ * or use run(), rather than relying on the chain being dropped.
+ */
+class AsyncGuard {
+public:
+  using release_fn = std::function<void()>;
+
+private:
+  struct holder {
+    std::atomic<bool>  bReleased{false};
+    release_fn         fn;
+    void release() {
+      if(!bReleased.exchange(true) && fn) fn();
+    }
+    ~holder() { release(); }
+  };
+  std::shared_ptr<holder> h_;
+
+public:
+  AsyncGuard() = default;
+  explicit AsyncGuard(release_fn fn) : h_(std::make_shared<holder>()) {
+    h_->fn = std::move(fn);
+  }
+
+  void release() const {
+    if(h_) h_->release();
+  }
+
+  /** holds a permit that was not released yet */
+  explicit operator bool() const {
+    return h_ && !h_->bReleased;
+  }
+};
+
+namespace detail {
+  /**
+   * runs `task` after the task currently running on this thread, instead of inside it.
+   * a release() made by a resumed waiter would otherwise resume the next waiter
+   * recursively, one stack frame per waiter.
+   */
+  inline void trampoline(std::function<void()> task) {
+    static thread_local std::deque<std::function<void()>>* queue = nullptr;
+    if(queue){
+      queue->push_back(std::move(task));
+      return;
+    }
+    std::deque<std::function<void()>> local;
+    queue = &local;
+    struct reset { ~reset(){ queue = nullptr; } } r;
+    task();
+    while(!local.empty()){
+      auto t = std::move(local.front());
+      local.pop_front();
+      t();
+    }
+  }
+
+  template <typename F, typename R = decltype(std::declval<const F&>()())>
+  auto as_promise(const F& func) -> std::enable_if_t<is_promise_sp<R>::value, R> {
+    return func();
+  }
+  template <typename F, typename R = decltype(std::declval<const F&>()())>
+  auto as_promise(const F& func) -> std::enable_if_t<!is_promise_sp<R>::value && !std::is_void<R>::value, typename Promise<typename std::decay<R>::type>::sp> {
+    return Promise<>::resolve(func());
+  }
+  template <typename F, typename R = decltype(std::declval<const F&>()())>
+  auto as_promise(const F& func) -> std::enable_if_t<std::is_void<R>::value, Promise<bool>::sp> {
+    func();
+    return Promise<>::resolve(true);
+  }
+
+  /** acquire, run `func` (value, void or promise returning), release once its promise settled */
+  template <typename LOCK, typename F>
+  auto run_guarded(LOCK& lock, F func) {
+    return lock.acquire()->then([func](const AsyncGuard& g){
+      try{
+        return as_promise(func)->finally([g]{ g.release(); });
+      }
+      catch(...){
+        g.release();
+        throw;
+      }
+    });
+  }
+} /** namespace detail */
+
+/**
+ * counting semaphore for promise chains.
+ *  - acquire() never blocks a thread: it is fulfilled with a permit at once or
+ *    when one is released
+ *  - waiters are resumed strictly in FIFO order (no barging), as continuations
+ *    of the release() that freed the permits
+ */
+class AsyncSemaphore {
+public:
+  using Guard = AsyncGuard;
+
+private:
+  struct waiter {
+    std::size_t                       n;
+    typename Promise<Guard>::resolver r;
+  };
+  struct state : std::enable_shared_from_this<state> {
+    std::mutex          mtx;
+    std::size_t         available;
+    const std::size_t   permits;
+    std::deque<waiter>  waiters;
+
+    state(std::size_t n) : available(n), permits(n) {}
+
+    Guard guard(std::size_t n) {
+      std::weak_ptr<state> ws = shared_from_this();
+      return Guard([ws, n]{
+        auto s = ws.lock();
+        if(s) s->release(n);
+      });
+    }
+
+    void release(std::size_t n) {
+      std::vector<waiter> granted;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        available += n;
+        while(!waiters.empty() && waiters.front().n <= available){
+          available -= waiters.front().n;
+          granted.push_back(std::move(waiters.front()));
+          waiters.pop_front();
+        }
+      }
+      for(auto& w : granted){
+        auto g = guard(w.n);
+        auto r = std::move(w.r);
+        detail::trampoline([r, g]{ r.resolve(g); });
+      }
+    }
+  };
+
+  std::shared_ptr<state> state_;
+
+public:
+  explicit AsyncSemaphore(std::size_t permits) : state_(std::make_shared<state>(permits)) {}
+
+  /** rejected with std::invalid_argument if `n` exceeds the total number of permits */
+  Promise<Guard>::sp acquire(std::size_t n = 1) {
+    if(n > state_->permits){
+      return Promise<>::reject<Guard>(std::make_exception_ptr(std::invalid_argument("AsyncSemaphore: more permits than exist")));
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_->mtx);
+      if(state_->waiters.empty() && state_->available >= n){
+        state_->available -= n;
+      }
+      else{
+        return Promise<>::create<Guard>([&](auto resolver){
+          state_->waiters.push_back({ n, resolver });
+        });
+      }
+    }
+    return Promise<>::resolve(state_->guard(n));
+  }
+
+  /** the same as acquire() if it would be fulfilled at once, otherwise an empty guard */
+  Guard try_acquire(std::size_t n = 1) {
+    {
+      std::lock_guard<std::mutex> lock(state_->mtx);
+      if(!state_->waiters.empty() || state_->available < n) return Guard();
+      state_->available -= n;
+    }
+    return state_->guard(n);
+  }
+
+  /** run `func` holding one permit. its result (a promise, a value, or true for void) is passed on */
+  template <typename F> auto run(F func) {
+    return detail::run_guarded(*this, std::move(func));
+  }
+
+  std::size_t available() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->available;
+  }
+
+  std::size_t waiting() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->waiters.size();
+  }
+};
+
+/** AsyncSemaphore with a single permit */
+class AsyncMutex {
+public:
+  using Guard = AsyncGuard;
+
+private:
+  AsyncSemaphore sem_{1};
+
+public:
+  Promise<Guard>::sp acquire() { return sem_.acquire(); }
+  Guard try_acquire() { return sem_.try_acquire(); }
+  template <typename F> auto run(F func) { return detail::run_guarded(*this, std::move(func)); }
+  bool locked() const { return sem_.available() == 0; }
+  std::size_t waiting() const { return sem_.waiting(); }
+};
+
+/**
+ * token bucket: `rate` tokens per second, at most `burst` stored.
+ * waiters are fulfilled in FIFO order from the timer's thread as tokens accrue.
+ * tokens are consumed, the guard has nothing to release.
+ */
+class AsyncRateLimiter {
+public:
+  using Guard = AsyncGuard;
+  using clock = Timer::clock;
+
+private:
+  struct waiter {
+    double                            n;
+    typename Promise<Guard>::resolver r;
+  };
+  struct state {
+    std::mutex          mtx;
+    const double        rate;
+    const double        burst;
+    Timer&              timer;
+    double              tokens;
+    clock::time_point   last;
+    std::deque<waiter>  waiters;
+    bool                bArmed = false;
+
+    state(double r, double b, Timer& t) : rate(r), burst(b), timer(t), tokens(b), last(t.now()) {}
+
+    void refill_locked() {
+      const auto now = timer.now();
+      tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+      last = now;
+    }
+  };
+  using state_sp = std::shared_ptr<state>;
+
+  state_sp state_;
+
+  /** grant what can be granted, then sleep until the next waiter can be */
+  static void service(const state_sp& s) {
+    std::vector<waiter> granted;
+    {
+      std::lock_guard<std::mutex> lock(s->mtx);
+      s->bArmed = false;
+      s->refill_locked();
+      while(!s->waiters.empty() && s->waiters.front().n <= s->tokens){
+        s->tokens -= s->waiters.front().n;
+        granted.push_back(std::move(s->waiters.front()));
+        s->waiters.pop_front();
+      }
+      arm_locked(s);
+    }
+    for(auto& w : granted) w.r.resolve(Guard());
+  }
+
+  static void arm_locked(const state_sp& s) {
+    if(s->bArmed || s->waiters.empty()) return;
+    s->bArmed = true;
+    const auto deficit = s->waiters.front().n - s->tokens;
+    const auto delay = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(deficit / s->rate));
+    std::weak_ptr<state> ws = s;
+    s->timer.after(delay, [ws]{
+      auto sp = ws.lock();
+      if(sp) service(sp);
+    });
+  }
+
+public:
+  /** `timer` = nullptr uses Timer::shared(). throws std::invalid_argument unless `rate` > 0 */
+  AsyncRateLimiter(double rate, std::size_t burst, Timer* timer = nullptr) :
+    state_(std::make_shared<state>(rate, static_cast<double>(burst > 0 ? burst : 1), timer ? *timer : Timer::shared())) {
+    if(!(rate > 0)) throw std::invalid_argument("AsyncRateLimiter: rate must be positive");
+  }
+
+  /** rejected with std::invalid_argument if `n` exceeds `burst` */
+  Promise<Guard>::sp acquire(std::size_t n = 1) {
+    const auto need = static_cast<double>(n);
+    if(need > state_->burst){
+      return Promise<>::reject<Guard>(std::make_exception_ptr(std::invalid_argument("AsyncRateLimiter: more tokens than the burst size")));
+    }
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    state_->refill_locked();
+    if(state_->waiters.empty() && state_->tokens >= need){
+      state_->tokens -= need;
+      return Promise<>::resolve(Guard());
+    }
+    auto p = Promise<>::create<Guard>([&](auto resolver){
+      state_->waiters.push_back({ need, resolver });
+    });
+    arm_locked(state_);
+    return p;
+  }
+
+  /** run `func` once a token is available */
+  template <typename F> auto run(F func) {
+    return detail::run_guarded(*this, std::move(func));
+  }
+
+  std::size_t waiting() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->waiters.size();
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_async_sync__) */
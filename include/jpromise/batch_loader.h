@@ -0,0 +1,146 @@
+#if !defined(__h_batch_loader__)
+#define __h_batch_loader__
+
+#include <stdexcept>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * coalesces independent load(key) calls into one batch function call.
+ *  - keys queued until dispatch() (or `schedule`'d dispatch, or `max_batch` keys)
+ *  - the batch function returns one value per key, in key order
+ *  - the same key requested twice in one batch shares one promise
+ */
+template <typename K, typename V, typename HASH = std::hash<K>>
+class BatchLoader {
+public:
+  using promise_sp  = typename Promise<V>::sp;
+  using batch_fn    = std::function<typename Promise<std::vector<V>>::sp(const std::vector<K>&)>;
+  using schedule_fn = std::function<void(std::function<void()>)>;
+
+  struct options {
+    std::size_t max_batch = 100;
+    /** called once per batch with the dispatch function (e.g. post to the end of the tick / a timer) */
+    schedule_fn schedule  = {};
+  };
+
+private:
+  struct batch {
+    std::vector<K>                                  keys;
+    std::vector<typename Promise<V>::resolver>      resolvers;
+    std::vector<promise_sp>                         promises;
+    std::unordered_map<K, std::size_t, HASH>        index;
+  };
+
+  struct state {
+    std::mutex                mtx;
+    batch_fn                  fn;
+    options                   opt;
+    std::unique_ptr<batch>    queue;
+    std::size_t               nBatches = 0;
+  };
+  using state_sp = std::shared_ptr<state>;
+
+  state_sp state_;
+
+  static void run(state_sp s, std::unique_ptr<batch> b) {
+    if(!b || b->keys.empty()) return;
+    std::shared_ptr<batch> sb(std::move(b));
+    auto reject_all = [sb](std::exception_ptr e){
+      for(auto& r : sb->resolvers) r.reject(e);
+    };
+    try{
+      s->fn(sb->keys)->stand_alone({
+        .on_fulfilled = [sb, reject_all](const std::vector<V>& values){
+          if(values.size() != sb->keys.size()){
+            reject_all(std::make_exception_ptr(std::length_error("BatchLoader: batch function returned a wrong number of values")));
+            return;
+          }
+          Promise<>::resolve_all(sb->resolvers, values);
+        },
+        .on_rejected = reject_all
+      });
+    }
+    catch(...){
+      reject_all(std::current_exception());
+    }
+  }
+
+  static void dispatch(state_sp s) {
+    std::unique_ptr<batch> b;
+    {
+      std::lock_guard<std::mutex> lock(s->mtx);
+      b = std::move(s->queue);
+      if(b) s->nBatches++;
+    }
+    run(s, std::move(b));
+  }
+
+public:
+  BatchLoader(batch_fn fn, options opt = {}) : state_(std::make_shared<state>()) {
+    state_->fn = std::move(fn);
+    state_->opt = std::move(opt);
+    if(state_->opt.max_batch == 0) state_->opt.max_batch = 1;
+  }
+
+  promise_sp load(const K& key) {
+    promise_sp p;
+    std::unique_ptr<batch> full;
+    bool bSchedule = false;
+    {
+      std::lock_guard<std::mutex> lock(state_->mtx);
+      auto& q = state_->queue;
+      if(!q){
+        q.reset(new batch());
+        bSchedule = static_cast<bool>(state_->opt.schedule);
+      }
+      auto it = q->index.find(key);
+      if(it != q->index.end()) return q->promises[it->second];
+
+      p = Promise<>::create<V>([&](auto resolver){
+        q->resolvers.push_back(resolver);
+      });
+      q->index.emplace(key, q->keys.size());
+      q->keys.push_back(key);
+      q->promises.push_back(p);
+      if(q->keys.size() >= state_->opt.max_batch){
+        full = std::move(q);
+        state_->nBatches++;
+        bSchedule = false;
+      }
+    }
+    if(bSchedule){
+      std::weak_ptr<state> ws = state_;
+      state_->opt.schedule([ws](){
+        auto s = ws.lock();
+        if(s) dispatch(s);
+      });
+    }
+    run(state_, std::move(full));
+    return p;
+  }
+
+  typename Promise<std::vector<V>>::sp load_many(const std::vector<K>& keys) {
+    std::vector<promise_sp> ps;
+    ps.reserve(keys.size());
+    for(auto& k : keys) ps.push_back(load(k));
+    return Promise<>::all(ps.data(), ps.data() + ps.size());
+  }
+
+  /** send the queued keys now */
+  void dispatch() {
+    dispatch(state_);
+  }
+
+  /** number of batch function calls issued so far */
+  std::size_t batches() const {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    return state_->nBatches;
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_batch_loader__) */
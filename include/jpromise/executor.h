@@ -0,0 +1,372 @@
+#if !defined(__h_executor__)
+#define __h_executor__
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <queue>
+#include <cstdint>
+#include "jpromise.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/** something that runs tasks, somewhere, later */
+class Executor {
+public:
+  using task_fn = std::function<void()>;
+
+  virtual ~Executor() = default;
+  virtual void post(task_fn task) = 0;
+};
+
+/** fixed number of worker threads sharing one FIFO queue */
+class ThreadPool : public Executor {
+private:
+  std::mutex                mtx_;
+  std::condition_variable   cond_;
+  std::deque<task_fn>       tasks_;
+  bool                      stop_ = false;
+  std::vector<std::thread>  threads_;
+#if defined(JPROMISE_METRICS)
+  std::uint64_t             metrics_id_ = Metrics::shared().add_queue("ThreadPool", [this]{ return queued(); });
+#endif
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while(true){
+      cond_.wait(lock, [this]{ return stop_ || !tasks_.empty(); });
+      if(tasks_.empty()) return; /** stop_ and drained */
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+public:
+  explicit ThreadPool(std::size_t nThreads = std::thread::hardware_concurrency()) {
+    if(nThreads == 0) nThreads = 1;
+    for(std::size_t i = 0; i < nThreads; i++){
+      threads_.emplace_back([this]{ run(); });
+    }
+  }
+
+  /** queued tasks are still run before the workers exit */
+  virtual ~ThreadPool() {
+#if defined(JPROMISE_METRICS)
+    Metrics::shared().remove_queue(metrics_id_);
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for(auto& t : threads_) t.join();
+  }
+
+  virtual void post(task_fn task) override {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      tasks_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+  /** tasks posted and not yet started */
+  std::size_t queued() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return tasks_.size();
+  }
+};
+
+/**
+ * worker threads sharing one priority queue.
+ *  - highest Priority first, earliest deadline first within a priority, then FIFO
+ *  - scheduled chains yield at every continuation, so interactive work overtakes
+ *    queued background work there (a running callback is never interrupted)
+ */
+class PriorityScheduler : public Scheduler, public Executor {
+private:
+  struct item {
+    int                       priority;
+    Timer::clock::time_point  deadline;
+    std::uint64_t             seq;
+    mutable task_fn           task;
+  };
+  struct after {
+    bool operator()(const item& a, const item& b) const {
+      if(a.priority != b.priority) return a.priority < b.priority;
+      if(a.deadline != b.deadline) return a.deadline > b.deadline;
+      return a.seq > b.seq;
+    }
+  };
+
+  std::mutex                                          mtx_;
+  std::condition_variable                             cond_;
+  std::priority_queue<item, std::vector<item>, after> queue_;
+  std::uint64_t                                       seq_ = 0;
+  bool                                                stop_ = false;
+  std::vector<std::thread>                            threads_;
+#if defined(JPROMISE_METRICS)
+  std::uint64_t                                       metrics_id_ = Metrics::shared().add_queue("PriorityScheduler", [this]{ return queued(); });
+#endif
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while(true){
+      cond_.wait(lock, [this]{ return stop_ || !queue_.empty(); });
+      if(queue_.empty()) return; /** stop_ and drained */
+      auto task = std::move(queue_.top().task);
+      queue_.pop();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+public:
+  explicit PriorityScheduler(std::size_t nThreads = std::thread::hardware_concurrency()) {
+    if(nThreads == 0) nThreads = 1;
+    for(std::size_t i = 0; i < nThreads; i++){
+      threads_.emplace_back([this]{ run(); });
+    }
+  }
+
+  /** queued tasks are still run before the workers exit */
+  virtual ~PriorityScheduler() {
+#if defined(JPROMISE_METRICS)
+    Metrics::shared().remove_queue(metrics_id_);
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for(auto& t : threads_) t.join();
+  }
+
+  virtual void post(const Schedule& schedule, task_fn task) override {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      queue_.push({ static_cast<int>(schedule.priority), schedule.deadline, seq_++, std::move(task) });
+    }
+    cond_.notify_one();
+  }
+
+  /** Priority::normal, no deadline */
+  virtual void post(task_fn task) override {
+    post(Schedule{}, std::move(task));
+  }
+
+  /** Schedule for Promise<>::create() that runs on this scheduler */
+  Schedule schedule(Priority priority, Timer::clock::time_point deadline = Timer::clock::time_point::max()) {
+    return { .priority = priority, .deadline = deadline, .scheduler = this };
+  }
+
+  std::size_t size() const { return threads_.size(); }
+
+  /** tasks posted and not yet started */
+  std::size_t queued() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return queue_.size();
+  }
+};
+
+/**
+ * serial executor on top of another executor.
+ *  - tasks never run concurrently and run in the order they were posted
+ *  - producers push onto a lock-free MPSC queue
+ *  - a drain task occupies one thread of the underlying executor only while
+ *    the queue is not empty
+ */
+class Strand : public Executor {
+private:
+  struct node {
+    std::atomic<node*>  next{nullptr};
+    task_fn             task;
+  };
+
+  struct impl : std::enable_shared_from_this<impl> {
+    Executor&                 executor;
+    std::atomic<node*>        head;       /** producers */
+    node*                     tail;       /** consumer */
+    node                      stub;
+    std::atomic<std::size_t>  count{0};   /** posted and not yet run */
+    std::size_t               batch;
+
+#if defined(JPROMISE_METRICS)
+    std::uint64_t             metrics_id = Metrics::shared().add_queue("Strand", [this]{ return count.load(std::memory_order_relaxed); });
+#endif
+
+    impl(Executor& e, std::size_t b) : executor(e), head(&stub), tail(&stub), batch(b) {}
+
+    ~impl() {
+#if defined(JPROMISE_METRICS)
+      Metrics::shared().remove_queue(metrics_id);
+#endif
+      while(auto n = pop()){
+        if(n != &stub) delete n;
+      }
+    }
+
+    void push(node* n) {
+      n->next.store(nullptr, std::memory_order_relaxed);
+      auto prev = head.exchange(n, std::memory_order_acq_rel);
+      prev->next.store(n, std::memory_order_release);
+    }
+
+    /** nullptr if empty, or if a producer is between exchange() and next.store() */
+    node* pop() {
+      auto t = tail;
+      auto next = t->next.load(std::memory_order_acquire);
+      if(t == &stub){
+        if(!next) return nullptr;
+        tail = next;
+        t = next;
+        next = next->next.load(std::memory_order_acquire);
+      }
+      if(next){
+        tail = next;
+        return t;
+      }
+      if(t != head.load(std::memory_order_acquire)) return nullptr;
+      push(&stub);
+      next = t->next.load(std::memory_order_acquire);
+      if(next){
+        tail = next;
+        return t;
+      }
+      return nullptr;
+    }
+
+    void drain() {
+      auto self = shared_from_this();
+      for(std::size_t i = 0; i < batch; i++){
+        node* n;
+        while(!(n = pop())) std::this_thread::yield(); /** count says a push is in flight */
+        n->task();
+        delete n;
+        if(count.fetch_sub(1, std::memory_order_acq_rel) == 1) return;
+      }
+      /** give the thread back to the executor, keep our place in its queue */
+      executor.post([self]{ self->drain(); });
+    }
+
+    void post(task_fn task) {
+      auto n = new node();
+      n->task = std::move(task);
+      push(n);
+      if(count.fetch_add(1, std::memory_order_acq_rel) == 0){
+        auto self = shared_from_this();
+        executor.post([self]{ self->drain(); });
+      }
+    }
+  };
+
+  std::shared_ptr<impl> impl_;
+
+  template <typename F, typename... ARGS>
+  using result_t = decltype(std::declval<F>()(std::declval<const ARGS&>()...));
+
+  template <typename T> struct first_or_bool { using type = bool; };
+  template <typename T, typename... REST> struct first_or_bool<std::tuple<T, REST...>> {
+    using type = typename std::decay<T>::type;
+  };
+
+public:
+  /** `batch` = tasks run per turn before yielding the underlying thread */
+  explicit Strand(Executor& executor, std::size_t batch = 64) : impl_(std::make_shared<impl>(executor, batch > 0 ? batch : 1)) {}
+
+  virtual void post(task_fn task) override {
+    impl_->post(std::move(task));
+  }
+
+  /** tasks posted and not yet run */
+  std::size_t queued() const {
+    return impl_->count.load(std::memory_order_relaxed);
+  }
+
+  /** promise returning callback: run `func` on the strand, adopt its promise */
+  template <typename F, typename... ARGS, typename R = result_t<F, ARGS...>>
+  auto run(F func, const ARGS&... args) const -> std::enable_if_t<is_promise_sp<R>::value, R> {
+    using T = typename R::element_type::value_type;
+    auto s = impl_;
+    return Promise<>::create<T>([s, func, args...](auto resolver){
+      s->post([func, resolver, args...](){
+        try{
+          func(args...)->stand_alone({
+            .on_fulfilled = [resolver](const T& x){ resolver.resolve(x); },
+            .on_rejected = [resolver](std::exception_ptr e){ resolver.reject(e); }
+          });
+        }
+        catch(...){
+          resolver.reject(std::current_exception());
+        }
+      });
+    });
+  }
+
+  /** value returning callback: Promise<R> settled on the strand */
+  template <typename F, typename... ARGS, typename R = result_t<F, ARGS...>>
+  auto run(F func, const ARGS&... args) const -> std::enable_if_t<
+    !is_promise_sp<R>::value && !std::is_same<R, void>::value,
+    typename Promise<typename std::decay<R>::type>::sp
+  > {
+    auto s = impl_;
+    return Promise<>::create<typename std::decay<R>::type>([s, func, args...](auto resolver){
+      s->post([func, resolver, args...](){
+        try{
+          resolver.resolve(func(args...));
+        }
+        catch(...){
+          resolver.reject(std::current_exception());
+        }
+      });
+    });
+  }
+
+  /** void callback: passes the first argument through (true if there is none) */
+  template <typename F, typename... ARGS, typename R = result_t<F, ARGS...>>
+  auto run(F func, const ARGS&... args) const -> std::enable_if_t<
+    std::is_same<R, void>::value,
+    typename Promise<typename first_or_bool<std::tuple<ARGS...>>::type>::sp
+  > {
+    using T = typename first_or_bool<std::tuple<ARGS...>>::type;
+    auto s = impl_;
+    return Promise<>::create<T>([s, func, args...](auto resolver){
+      s->post([func, resolver, args...](){
+        try{
+          func(args...);
+          resolver.resolve(std::get<0>(std::forward_as_tuple(args..., true)));
+        }
+        catch(...){
+          resolver.reject(std::current_exception());
+        }
+      });
+    });
+  }
+
+  /**
+   * adapt a then() / error() / finally() callback to run on this strand.
+   * p->then(strand.wrap([](const auto& x){ ... }))
+   */
+  template <typename F> auto wrap(F func) const {
+    auto self = *this;
+    return [self, func](const auto&... args){
+      return self.run(func, args...);
+    };
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_executor__) */
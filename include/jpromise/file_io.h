@@ -0,0 +1,380 @@
+#if !defined(__h_file_io__)
+#define __h_file_io__
+
+#include <atomic>
+#include <cstring>
+#include <system_error>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "jpromise.h"
+#include "executor.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define JPROMISE_HAS_IO_URING 1
+#endif
+#endif
+
+#if defined(JPROMISE_HAS_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * positional file reads / writes returning Promise<std::size_t>::sp.
+ *  - io_uring backend when the kernel allows it, a blocking thread pool otherwise
+ *  - cork() / uncork() batch several requests into one submission
+ *  - register_buffers() + read_fixed() / write_fixed() use pre-registered buffers
+ *  - completions are reaped in bulk and resolved on the completion thread
+ */
+class FileIo {
+public:
+  struct options {
+    unsigned    queue_depth       = 256;   /** io_uring submission queue size */
+    std::size_t threads           = 4;     /** fallback pool size */
+    bool        force_thread_pool = false;
+  };
+
+private:
+  using resolver = Promise<std::size_t>::resolver;
+
+  enum class opcode { read, write, read_fixed, write_fixed };
+
+  struct request {
+    opcode      op;
+    int         fd;
+    void*       buf;
+    std::size_t len;
+    off_t       offset;
+    unsigned    buf_index;
+    resolver    r;
+  };
+
+  static std::exception_ptr system_error(int err, const char* what) {
+    return std::make_exception_ptr(std::system_error(err, std::generic_category(), what));
+  }
+
+  static void complete(const resolver& r, long res, const char* what) {
+    if(res < 0) r.reject(system_error(static_cast<int>(-res), what));
+    else r.resolve(static_cast<std::size_t>(res));
+  }
+
+  static void complete(CompletionBatch& batch, const resolver& r, long res, const char* what) {
+    if(res < 0) batch.reject(r, system_error(static_cast<int>(-res), what));
+    else batch.resolve(r, static_cast<std::size_t>(res));
+  }
+
+  std::vector<iovec>          buffers_;
+
+  /** thread pool backend */
+  std::unique_ptr<ThreadPool> pool_;
+
+  void run_blocking(request& q) {
+    long res;
+    switch(q.op){
+      case opcode::read:  res = ::pread(q.fd, q.buf, q.len, q.offset); break;
+      case opcode::write: res = ::pwrite(q.fd, q.buf, q.len, q.offset); break;
+      case opcode::read_fixed:
+        res = ::pread(q.fd, static_cast<char*>(buffers_[q.buf_index].iov_base) + reinterpret_cast<std::size_t>(q.buf), q.len, q.offset);
+        break;
+      case opcode::write_fixed:
+        res = ::pwrite(q.fd, static_cast<char*>(buffers_[q.buf_index].iov_base) + reinterpret_cast<std::size_t>(q.buf), q.len, q.offset);
+        break;
+    }
+    if(res < 0) res = -errno;
+    complete(q.r, res, "FileIo");
+  }
+
+#if defined(JPROMISE_HAS_IO_URING)
+  /** io_uring backend */
+  int                         ring_fd_ = -1;
+  io_uring_params             params_ = {};
+  void*                       sq_ptr_ = nullptr;
+  std::size_t                 sq_size_ = 0;
+  void*                       cq_ptr_ = nullptr;
+  std::size_t                 cq_size_ = 0;
+  io_uring_sqe*               sqes_ = nullptr;
+  unsigned*                   sq_head_ = nullptr;
+  unsigned*                   sq_tail_ = nullptr;
+  unsigned*                   sq_mask_ = nullptr;
+  unsigned*                   sq_array_ = nullptr;
+  unsigned*                   cq_head_ = nullptr;
+  unsigned*                   cq_tail_ = nullptr;
+  unsigned*                   cq_mask_ = nullptr;
+  io_uring_cqe*               cqes_ = nullptr;
+
+  std::mutex                  mtx_;             /** guards the SQ, backlog_ and in-flight count */
+  std::deque<request*>        backlog_;         /** waiting for CQ room */
+  unsigned                    inflight_ = 0;
+  unsigned                    unsubmitted_ = 0;
+  int                         corked_ = 0;
+  std::thread                 reaper_;
+  static constexpr __u64      stop_tag = ~__u64(0);
+
+  static int ring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+  }
+  int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0));
+  }
+
+  bool open_ring(unsigned entries) {
+    ring_fd_ = ring_setup(entries, &params_);
+    if(ring_fd_ < 0) return false;
+    sq_size_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+    cq_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+    const bool bSingle = params_.features & IORING_FEAT_SINGLE_MMAP;
+    if(bSingle) sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(sq_ptr_ == MAP_FAILED) { sq_ptr_ = nullptr; close_ring(); return false; }
+    if(bSingle) cq_ptr_ = sq_ptr_;
+    else{
+      cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+      if(cq_ptr_ == MAP_FAILED) { cq_ptr_ = nullptr; close_ring(); return false; }
+    }
+    auto sqes = ::mmap(nullptr, params_.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) { close_ring(); return false; }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto sq = static_cast<char*>(sq_ptr_);
+    sq_head_  = reinterpret_cast<unsigned*>(sq + params_.sq_off.head);
+    sq_tail_  = reinterpret_cast<unsigned*>(sq + params_.sq_off.tail);
+    sq_mask_  = reinterpret_cast<unsigned*>(sq + params_.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.array);
+    auto cq = static_cast<char*>(cq_ptr_);
+    cq_head_  = reinterpret_cast<unsigned*>(cq + params_.cq_off.head);
+    cq_tail_  = reinterpret_cast<unsigned*>(cq + params_.cq_off.tail);
+    cq_mask_  = reinterpret_cast<unsigned*>(cq + params_.cq_off.ring_mask);
+    cqes_     = reinterpret_cast<io_uring_cqe*>(cq + params_.cq_off.cqes);
+    return true;
+  }
+
+  void close_ring() {
+    if(sqes_) ::munmap(sqes_, params_.sq_entries * sizeof(io_uring_sqe));
+    if(cq_ptr_ && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_size_);
+    if(sq_ptr_) ::munmap(sq_ptr_, sq_size_);
+    if(ring_fd_ >= 0) ::close(ring_fd_);
+    sqes_ = nullptr;
+    sq_ptr_ = cq_ptr_ = nullptr;
+    ring_fd_ = -1;
+  }
+
+  /** lock held. false if the SQ is full */
+  bool push_sqe(request* q) {
+    const unsigned tail = *sq_tail_;
+    if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= params_.sq_entries) return false;
+    const unsigned index = tail & *sq_mask_;
+    auto& sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = q ? q->fd : -1;
+    sqe.user_data = q ? reinterpret_cast<__u64>(q) : stop_tag;
+    if(!q) sqe.opcode = IORING_OP_NOP;
+    else{
+      sqe.off = static_cast<__u64>(q->offset);
+      sqe.len = static_cast<__u32>(q->len);
+      switch(q->op){
+        case opcode::read:
+          sqe.opcode = IORING_OP_READ;
+          sqe.addr = reinterpret_cast<__u64>(q->buf);
+          break;
+        case opcode::write:
+          sqe.opcode = IORING_OP_WRITE;
+          sqe.addr = reinterpret_cast<__u64>(q->buf);
+          break;
+        case opcode::read_fixed:
+        case opcode::write_fixed:
+          sqe.opcode = q->op == opcode::read_fixed ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+          sqe.addr = reinterpret_cast<__u64>(static_cast<char*>(buffers_[q->buf_index].iov_base) + reinterpret_cast<std::size_t>(q->buf));
+          sqe.buf_index = static_cast<__u16>(q->buf_index);
+          break;
+      }
+    }
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_++;
+    return true;
+  }
+
+  /** lock held */
+  void submit_locked() {
+    while(unsubmitted_ > 0){
+      const int n = ring_enter(unsubmitted_, 0, 0);
+      if(n < 0){
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+        break;
+      }
+      unsubmitted_ -= static_cast<unsigned>(n);
+    }
+  }
+
+  /** lock held. move backlog into the SQ while the CQ has room */
+  void fill_locked() {
+    while(!backlog_.empty() && inflight_ < params_.cq_entries){
+      if(!push_sqe(backlog_.front())){
+        submit_locked();
+        if(!push_sqe(backlog_.front())) break;
+      }
+      backlog_.pop_front();
+      inflight_++;
+    }
+    if(corked_ == 0) submit_locked();
+  }
+
+  void enqueue(request* q) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    backlog_.push_back(q);
+    fill_locked();
+  }
+
+  /** runs until the stop NOP has been seen and every request has completed */
+  void reap() {
+    std::vector<std::pair<request*, int>> done;
+    bool bStop = false;
+    while(true){
+      if(bStop){
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(inflight_ == 0 && backlog_.empty()) break;
+      }
+      ring_enter(0, 1, IORING_ENTER_GETEVENTS);
+      unsigned head = *cq_head_;
+      const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for(; head != tail; head++){
+        auto& cqe = cqes_[head & *cq_mask_];
+        if(cqe.user_data == stop_tag) bStop = true;
+        else done.emplace_back(reinterpret_cast<request*>(cqe.user_data), cqe.res);
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      if(done.empty()) continue;
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        inflight_ -= static_cast<unsigned>(done.size());
+        fill_locked();
+      }
+      /** settle the whole batch outside the lock, then run the continuations */
+      CompletionBatch batch;
+      batch.reserve(done.size());
+      for(auto& d : done){
+        complete(batch, d.first->r, d.second, "io_uring");
+        delete d.first;
+      }
+      done.clear();
+      batch.flush();
+    }
+  }
+#endif
+
+  void start(request* q) {
+#if defined(JPROMISE_HAS_IO_URING)
+    if(ring_fd_ >= 0){
+      enqueue(q);
+      return;
+    }
+#endif
+    pool_->post([this, q](){
+      std::unique_ptr<request> hold(q);
+      run_blocking(*q);
+    });
+  }
+
+  Promise<std::size_t>::sp make(opcode op, int fd, void* buf, std::size_t len, off_t offset, unsigned buf_index) {
+    return Promise<>::create<std::size_t>([&](auto r){
+      start(new request{ op, fd, buf, len, offset, buf_index, r });
+    });
+  }
+
+public:
+  FileIo() : FileIo(options{}) {}
+
+  explicit FileIo(options opt) {
+#if defined(JPROMISE_HAS_IO_URING)
+    if(!opt.force_thread_pool && open_ring(opt.queue_depth > 0 ? opt.queue_depth : 1)){
+      reaper_ = std::thread([this]{ reap(); });
+      return;
+    }
+#endif
+    pool_.reset(new ThreadPool(opt.threads));
+  }
+
+  ~FileIo() {
+#if defined(JPROMISE_HAS_IO_URING)
+    if(ring_fd_ >= 0){
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        while(!push_sqe(nullptr)) submit_locked();
+        submit_locked();
+      }
+      reaper_.join();
+      close_ring();
+      return;
+    }
+#endif
+    pool_.reset();
+  }
+
+  FileIo(const FileIo&) = delete;
+  FileIo& operator=(const FileIo&) = delete;
+
+  bool uses_io_uring() const {
+#if defined(JPROMISE_HAS_IO_URING)
+    return ring_fd_ >= 0;
+#else
+    return false;
+#endif
+  }
+
+  /** hold submissions until the matching uncork(), then submit them with one system call */
+  void cork() {
+#if defined(JPROMISE_HAS_IO_URING)
+    std::lock_guard<std::mutex> lock(mtx_);
+    corked_++;
+#endif
+  }
+
+  void uncork() {
+#if defined(JPROMISE_HAS_IO_URING)
+    std::lock_guard<std::mutex> lock(mtx_);
+    if(corked_ > 0 && --corked_ == 0) submit_locked();
+#endif
+  }
+
+  /**
+   * register buffers for read_fixed() / write_fixed(). call before any fixed operation.
+   * with io_uring the pages are pinned once instead of on every request.
+   */
+  void register_buffers(std::vector<iovec> buffers) {
+#if defined(JPROMISE_HAS_IO_URING)
+    if(ring_fd_ >= 0){
+      if(!buffers_.empty()) ::syscall(__NR_io_uring_register, ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+      if(::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0){
+        throw std::system_error(errno, std::generic_category(), "io_uring_register");
+      }
+    }
+#endif
+    buffers_ = std::move(buffers);
+  }
+
+  Promise<std::size_t>::sp read(int fd, void* buf, std::size_t len, off_t offset) {
+    return make(opcode::read, fd, buf, len, offset, 0);
+  }
+
+  Promise<std::size_t>::sp write(int fd, const void* buf, std::size_t len, off_t offset) {
+    return make(opcode::write, fd, const_cast<void*>(buf), len, offset, 0);
+  }
+
+  /** read into registered buffer `index`, starting `buf_offset` bytes into it */
+  Promise<std::size_t>::sp read_fixed(int fd, unsigned index, std::size_t len, off_t offset, std::size_t buf_offset = 0) {
+    return make(opcode::read_fixed, fd, reinterpret_cast<void*>(buf_offset), len, offset, index);
+  }
+
+  Promise<std::size_t>::sp write_fixed(int fd, unsigned index, std::size_t len, off_t offset, std::size_t buf_offset = 0) {
+    return make(opcode::write_fixed, fd, reinterpret_cast<void*>(buf_offset), len, offset, index);
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_file_io__) */
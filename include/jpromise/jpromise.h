@@ -8,66 +8,319 @@
 #include <future>
 #include <type_traits>
 #include <queue>
+#include <atomic>
 #include <array>
 #include <vector>
+#include <iterator>
 #include <unordered_map>
+#include <cassert>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include "timer.h"
+#include "metrics.h"
+#include "threading.h"
 
 namespace JPromise {
+inline namespace JPROMISE_ABI {
 
 enum class PromiseState {pending, fulfilled, rejected};
 
 template <typename T = void> class Promise;
 
-class PromiseBase : public std::enable_shared_from_this<PromiseBase> {
+/** see Promise<>::retry() */
+struct RetryPolicy {
+  std::size_t                 max_attempts  = 3;
+  std::chrono::milliseconds   initial_delay = std::chrono::milliseconds(100);
+  double                      multiplier    = 2.0;
+  std::chrono::milliseconds   max_delay     = std::chrono::seconds(10);
+  /** 0.0 = fixed backoff, 1.0 = full jitter (uniform in [0, backoff]) */
+  double                      jitter        = 0.5;
+  /** empty = every error is retriable. `attempt` starts at 1 */
+  std::function<bool(std::exception_ptr, std::size_t attempt)> retriable = {};
+  /** nullptr = Timer::shared() */
+  Timer*                      timer         = nullptr;
+
+  std::chrono::milliseconds backoff(std::size_t attempt) const {
+    double d = static_cast<double>(initial_delay.count());
+    for(std::size_t i = 1; i < attempt; i++) d *= multiplier;
+    d = std::min(d, static_cast<double>(max_delay.count()));
+    if(jitter > 0){
+      static thread_local std::mt19937 rng(std::random_device{}());
+      d -= d * std::min(jitter, 1.0) * std::uniform_real_distribution<double>(0, 1)(rng);
+    }
+    return std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(d));
+  }
+};
+
+enum class Priority : int { background = 0, normal = 1, interactive = 2 };
+
+class Scheduler;
+class CompletionBatch;
+
+/**
+ * scheduling class of a chain, given to Promise<>::create() and inherited
+ * by every promise derived from it with then() / error() / finally().
+ */
+struct Schedule {
+  Priority                  priority  = Priority::normal;
+  /** earliest deadline first within a priority */
+  Timer::clock::time_point  deadline  = Timer::clock::time_point::max();
+  /** nullptr = continuations run inline on the settling thread. must outlive the chain */
+  Scheduler*                scheduler = nullptr;
+};
+
+/** runs the continuations of scheduled chains, see PriorityScheduler */
+class Scheduler {
 public:
-  using sp = std::shared_ptr<PromiseBase>;
+  virtual ~Scheduler() = default;
+  virtual void post(const Schedule& schedule, std::function<void()> task) = 0;
+};
 
-private:
-  const std::vector<PromiseBase::sp> upstream_;
-  std::vector<PromiseBase::sp> upstream() {
-    auto u = upstream_;
-    u.push_back(shared_base()); /** add self instance */
-    return std::move(u);
-  }
-  PromiseBase::sp above() { return upstream_.size() > 0 ? upstream_.back() : PromiseBase::sp(); }
+/**
+ * node layout, one allocation per promise (see Promise<T>::make()):
+ *  - the shared_ptr control block, then PromiseBase: state, lock, resolver count,
+ *    flags, the first continuation and a pointer to the cold part. with a value of
+ *    up to 16 bytes this is the first 64 bytes of the allocation
+ *  - the value
+ *  - the cold part: source, error, schedule, further continuations, waiters
+ */
+class PromiseBase {
+friend class CompletionBatch;
+public:
+  using sp = detail::shared_ptr<PromiseBase>;
 
 protected:
-  using mtx         = std::mutex;
+  /** type erased continuation, run or dropped once */
+  struct callback {
+    virtual ~callback() = default;
+    virtual void run(PromiseBase& p) = 0;
+  };
+  using callback_ptr = std::unique_ptr<callback>;
+
+#if !defined(JPROMISE_SINGLE_THREADED)
+  /** threads blocked in wait(). created by the first one */
+  struct waiters {
+    std::mutex              mtx;
+    std::condition_variable cond;
+  };
+#endif
+
+  struct cold {
+    /** the promise this one derives from. each node keeps the one above alive */
+    PromiseBase::sp           source;
+    /** held while resolvers are alive, see first_settler() */
+    PromiseBase::sp           self;
+    detail::weak_ptr<PromiseBase> weak_self;
+    std::exception_ptr        error = nullptr;
+    Schedule                  sched = {};
+    std::vector<callback_ptr> more;       /** continuations after the first, attachment order */
+#if !defined(JPROMISE_SINGLE_THREADED)
+    std::unique_ptr<waiters>  waiting;
+#endif
+#if defined(JPROMISE_METRICS)
+    Metrics::node             metrics;
+#endif
+
+    cold() = default;
+    explicit cold(PromiseBase::sp src) : source(std::move(src)), sched(source->cold_->sched) {}
+
+    /** releases the chain above iteratively, a long chain would recurse once per node */
+    ~cold() {
+      auto node = std::move(source);
+      while(node){
+        if(node.use_count() != 1) break;
+        auto next = std::move(node->cold_->source);
+        node.reset();
+        node = std::move(next);
+      }
+    }
+  };
+
+  using mtx         = detail::node_mutex;
   using guard       = std::lock_guard<mtx>;
-  using ulock       = std::unique_lock<mtx>;
 
+  /** written under mtx_ after the value / error, read lock free by the ready paths */
+  detail::node_atomic<PromiseState> state_{PromiseState::pending};
+  /**
+   * resolvers alive. they own the promise through cold_->self, so a chain is kept
+   * alive by whatever can still settle it, not by itself.
+   */
+  detail::node_atomic<int> settlers_{0};
   mtx                     mtx_;
-  std::condition_variable cond_;
-  PromiseState                   state_ = PromiseState::pending;
-  std::exception_ptr      error_ = nullptr;
+  /** guarded by mtx_, they spare settling and chaining a look at the cold part */
+  bool                    abandoned_ = false;   /** pending with no settler */
+  bool                    has_more_ = false;    /** cold_->more is not empty */
+  bool                    has_waiters_ = false; /** cold_->waiting exists */
+  bool                    scheduled_ = false;   /** cold_->sched has a scheduler, set before the node is shared */
+  callback_ptr            first_;               /** guarded by mtx_ */
+  cold* const             cold_;
 
-  sp shared_base() { return shared_from_this(); }
+  explicit PromiseBase(cold* c) : cold_(c) {}
+  ~PromiseBase() = default;
 
-  template <typename T> std::shared_ptr<Promise<T>> shared_this_as() {
-    return std::dynamic_pointer_cast<Promise<T>>(shared_from_this());
+private:
+  /** no settler left while pending: drop the handlers, iteratively along the chain below */
+  static void abandon(PromiseBase* p) {
+    static thread_local std::vector<PromiseBase*>* queue = nullptr;
+    if(queue){
+      queue->push_back(p);
+      return;
+    }
+    std::vector<PromiseBase*> local{ p };
+    queue = &local;
+    while(!local.empty()){
+      auto q = local.back();
+      local.pop_back();
+      auto self = std::move(q->cold_->self);
+      q->drop_handlers();
+    }
+    queue = nullptr;
+  }
+
+protected:
+  /** a settled state was just stored */
+  void note_settled() {
+#if defined(JPROMISE_METRICS)
+    Metrics::settled(cold_->metrics, state_.load(std::memory_order_relaxed) == PromiseState::fulfilled);
+#endif
+  }
+
+  /** the lock free paths' half of the JPROMISE_SINGLE_THREADED debug check, mtx_ does the rest */
+  void check_thread() const {
+#if defined(JPROMISE_SINGLE_THREADED)
+    mtx_.check();
+#endif
+  }
+
+  /** store the settled state. `s` is pending if the promise was already settled */
+  template <typename F> bool store_result(PromiseState s, F store) {
+#if !defined(JPROMISE_SINGLE_THREADED)
+    waiters* w = nullptr;
+#endif
+    {
+      guard lock(mtx_);
+      if(state_ != PromiseState::pending) return false;
+      store();
+      state_.store(s, std::memory_order_release);
+#if !defined(JPROMISE_SINGLE_THREADED)
+      if(has_waiters_) w = cold_->waiting.get();
+#endif
+    }
+#if !defined(JPROMISE_SINGLE_THREADED)
+    /** a waiter holds w->mtx from before it saw the promise pending until it sleeps */
+    if(w){
+      { std::lock_guard<std::mutex> lock(w->mtx); }
+      w->cond.notify_all();
+    }
+#endif
+    note_settled();
+    return true;
   }
 
-  virtual void remove_handler(PromiseBase*) = 0;
+#if !defined(JPROMISE_SINGLE_THREADED)
+  void block_until_settled() {
+    waiters* w;
+    std::unique_lock<std::mutex> lock;
+    {
+      guard g(mtx_);
+      if(state_ != PromiseState::pending) return;
+      if(!has_waiters_){
+        cold_->waiting.reset(new waiters());
+        has_waiters_ = true;
+      }
+      w = cold_->waiting.get();
+      lock = std::unique_lock<std::mutex>(w->mtx);
+    }
+    w->cond.wait(lock, [this]{ return state_.load(std::memory_order_acquire) != PromiseState::pending; });
+  }
+#endif
+
+  /** run now if settled, dropped (after the lock is released) if abandoned */
+  void add_callback(callback_ptr cb) {
+    const auto s = [&](){
+      guard lock(mtx_);
+      if(state_ == PromiseState::pending && !abandoned_){
+        if(!first_) first_ = std::move(cb);
+        else{
+          cold_->more.push_back(std::move(cb));
+          has_more_ = true;
+        }
+      }
+      return state_.load();
+    }();
+    if(s != PromiseState::pending) cb->run(*this);
+  }
+
+  /** continuations attached before the promise settled, run outside the lock */
+  void run_handlers() {
+    callback_ptr first;
+    std::vector<callback_ptr> more;
+    {
+      guard lock(mtx_);
+      first = std::move(first_);
+      if(has_more_) more.swap(cold_->more);
+      has_more_ = false;
+    }
+    Metrics::handlers_run((first ? 1 : 0) + more.size());
+    if(first) first->run(*this);
+    for(auto& cb : more) cb->run(*this);
+  }
+
+  /** the continuations, and the resolvers of the chain below they hold, are destroyed outside the lock */
+  void drop_handlers() {
+    callback_ptr first;
+    std::vector<callback_ptr> more;
+    guard lock(mtx_);
+    abandoned_ = true;
+    first = std::move(first_);
+    if(has_more_) more.swap(cold_->more);
+    has_more_ = false;
+  }
+
+  void set_schedule(const Schedule& schedule) {
+    cold_->sched = schedule;
+    scheduled_ = schedule.scheduler != nullptr;
+  }
+
+  sp shared_base() { return cold_->weak_self.lock(); }
+
+  template <typename T> detail::shared_ptr<Promise<T>> shared_this_as() {
+    return std::static_pointer_cast<Promise<T>>(shared_base());
+  }
+
+  /** the first resolver of a promise nobody else has seen yet */
+  void first_settler() {
+    settlers_.store(1, std::memory_order_relaxed);
+    cold_->self = shared_base();
+  }
+
+  void add_settler() {
+    check_thread();
+    settlers_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void release_settler() {
+    check_thread();
+    if(settlers_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    if(state_.load(std::memory_order_acquire) == PromiseState::pending){
+      abandon(this);
+      return;
+    }
+    auto self = std::move(cold_->self);
+  }
 
   template <typename SINK> typename Promise<SINK>::sp create_sink() {
-    return std::shared_ptr<Promise<SINK>>(new Promise<SINK>(shared_base()));
+    return Promise<SINK>::make(shared_base());
   }
 
   template<typename SINK> void execute_sink(typename Promise<SINK>::sp sink, typename Promise<SINK>::executor_fn executor){
     sink->execute(executor);
   }
 
-  PromiseBase() = default;
-  PromiseBase(PromiseBase::sp source) : upstream_(source->upstream()) {}
-
 public:
-  virtual ~PromiseBase(){
-    auto source = above();
-    if(source){
-      source->remove_handler(this);
-    }
-  }
   PromiseState state() const { return state_; }
+  const Schedule& schedule() const { return cold_->sched; }
 };
 
 template <> class Promise<void> {
@@ -81,16 +334,16 @@ private:
 
   /** fetch value type in Promise::sp */
   template<typename T> struct promise_sp_value_type {};
-  template<typename T> struct promise_sp_value_type<std::shared_ptr<Promise<T>>> {
+  template<typename T> struct promise_sp_value_type<detail::shared_ptr<Promise<T>>> {
     using type = typename strip_const_referece<T>::type;
   };
 
   /** fetch value type in Promise::sp* (for iterator) */
   template<typename T> struct promise_iter_value_type{};
-  template<typename T> struct promise_iter_value_type<std::shared_ptr<Promise<T>>*> {
+  template<typename T> struct promise_iter_value_type<detail::shared_ptr<Promise<T>>*> {
     using type = typename strip_const_referece<T>::type;
   };
-  template<typename T> struct promise_iter_value_type<const std::shared_ptr<Promise<T>>*> {
+  template<typename T> struct promise_iter_value_type<const detail::shared_ptr<Promise<T>>*> {
     using type = typename strip_const_referece<T>::type;
   };
 
@@ -129,22 +382,35 @@ private:
 
 public:
   template <typename T> static typename Promise<T>::sp create(typename Promise<T>::executor_fn executer) {
-    auto p = std::shared_ptr<Promise<T>>(new Promise<T>());
+    auto p = Promise<T>::make();
+    p->execute(executer);
+    return p;
+  }
+
+  /** continuations of the chain (and of everything derived from it) run through `schedule.scheduler` */
+  template <typename T> static typename Promise<T>::sp create(const Schedule& schedule, typename Promise<T>::executor_fn executer) {
+    auto p = Promise<T>::make();
+    p->set_schedule(schedule);
     p->execute(executer);
     return p;
   }
 
   template <typename T, typename TT = typename strip_const_referece<T>::type>
   static typename Promise<TT>::sp resolve(T&& value) {
-    auto p = std::shared_ptr<Promise<TT>>(new Promise<TT>());
-    p->on_fulfilled(std::forward<T>(value));
+    auto p = Promise<TT>::make();
+    /** not shared yet: no lock, no handlers */
+    p->value_ = std::forward<T>(value);
+    p->state_.store(PromiseState::fulfilled, std::memory_order_release);
+    p->note_settled();
     return p;
   }
 
   template <typename T = struct never>
   static typename Promise<T>::sp reject(std::exception_ptr err) {
-    auto p = std::shared_ptr<Promise<T>>(new Promise<T>());
-    p->on_rejected(err);
+    auto p = Promise<T>::make();
+    p->cold_->error = err;
+    p->state_.store(PromiseState::rejected, std::memory_order_release);
+    p->note_settled();
     return p;
   }
 
@@ -270,6 +536,126 @@ public:
     });
   }
 
+private:
+  /**
+   * folds results in arrival order without a lock: the thread whose arrival finds
+   * nothing queued folds its own value in place, later arrivals meanwhile push onto
+   * a lock-free stack that the folding thread drains before it returns.
+   * only the accumulator and the values in flight are kept.
+   */
+  template <typename ACC, typename T, typename OP>
+  struct fold_state {
+    struct item {
+      item*       next;
+      std::size_t index;
+      T           value;
+    };
+    std::atomic<item*>              head{nullptr};
+    std::atomic<std::size_t>        queued{0};    /** counted before pushed */
+    std::atomic<bool>               bDone{false};
+    std::size_t                     nLeft;        /** folding thread only */
+    ACC                             acc;
+    const OP                        op;
+    typename Promise<ACC>::resolver resolver;
+
+    fold_state(std::size_t n, ACC init, OP o, typename Promise<ACC>::resolver r) :
+      nLeft(n), acc(std::move(init)), op(std::move(o)), resolver(std::move(r)) {}
+
+    void fold(const T& value, std::size_t index) {
+      if(bDone.load(std::memory_order_relaxed)) return;
+      try{
+        acc = op(std::move(acc), value, index);
+      }
+      catch(...){
+        fail(std::current_exception());
+        return;
+      }
+      if(--nLeft == 0 && !bDone.exchange(true)) resolver.resolve(std::move(acc));
+    }
+
+    void fail(std::exception_ptr err) {
+      if(!bDone.exchange(true)) resolver.reject(err);
+    }
+
+    void arrive(const T& value, std::size_t index) {
+      if(bDone.load(std::memory_order_relaxed)) return;
+      if(queued.fetch_add(1, std::memory_order_acq_rel) != 0){
+        auto n = new item{ head.load(std::memory_order_relaxed), index, value };
+        while(!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed));
+        return;
+      }
+      fold(value, index);
+      std::size_t k = 1;
+      while(queued.fetch_sub(k, std::memory_order_acq_rel) != k){
+        item* list;
+        while(!(list = head.exchange(nullptr, std::memory_order_acquire))) std::this_thread::yield(); /** counted, not pushed yet */
+        item* ordered = nullptr;
+        for(k = 0; list; k++){
+          auto next = list->next;
+          list->next = ordered;
+          ordered = list;
+          list = next;
+        }
+        while(ordered){
+          auto next = ordered->next;
+          fold(ordered->value, ordered->index);
+          delete ordered;
+          ordered = next;
+        }
+      }
+    }
+  };
+
+  template <typename ACC, typename ITER, typename OP>
+  static auto fold(ITER it_begin, ITER it_end, ACC init, OP op) -> typename Promise<ACC>::sp {
+    using PROMISE_SP = typename std::iterator_traits<ITER>::value_type;
+    using VALUE_TYPE = typename promise_sp_value_type<PROMISE_SP>::type;
+    return Promise<>::create<ACC>([it_begin, it_end, &init, &op](auto resolver){
+      const auto n = static_cast<std::size_t>(std::distance(it_begin, it_end));
+      if(n == 0){
+        resolver.resolve(std::move(init));
+        return;
+      }
+      auto state = std::make_shared<fold_state<ACC, VALUE_TYPE, OP>>(n, std::move(init), std::move(op), resolver);
+      std::size_t i = 0;
+      for(auto it = it_begin; it != it_end; it++, i++){
+        (*it)->stand_alone({
+          .on_fulfilled = [state, i](const VALUE_TYPE& x){ state->arrive(x, i); },
+          .on_rejected = [state](std::exception_ptr e){ state->fail(e); }
+        });
+      }
+    });
+  }
+
+public:
+  /**
+   * fn(value, index) for each input as it is fulfilled, in arrival order. the calls
+   * never overlap, though they may come from different threads. nothing is buffered.
+   * the promise is fulfilled with the number of inputs once all are done, and rejected
+   * with the first rejection or exception from `fn` (fn is not called after that).
+   */
+  template <typename ITER, typename F, typename COUNT = std::size_t>
+  static auto as_completed(ITER it_begin, ITER it_end, F fn) -> typename Promise<COUNT>::sp {
+    using VALUE_TYPE = typename promise_sp_value_type<typename std::iterator_traits<ITER>::value_type>::type;
+    return fold<COUNT>(it_begin, it_end, COUNT(0), [fn = std::move(fn)](COUNT n, const VALUE_TYPE& x, std::size_t index){
+      fn(x, index);
+      return n + 1;
+    });
+  }
+
+  /**
+   * acc = op(std::move(acc), value) as each input is fulfilled, in arrival order and
+   * without overlapping calls. only `acc` is retained, not the results.
+   * rejected with the first rejection or exception from `op`.
+   */
+  template <typename ITER, typename ACC, typename OP>
+  static auto reduce(ITER it_begin, ITER it_end, ACC init, OP op) -> typename Promise<ACC>::sp {
+    using VALUE_TYPE = typename promise_sp_value_type<typename std::iterator_traits<ITER>::value_type>::type;
+    return fold<ACC>(it_begin, it_end, std::move(init), [op = std::move(op)](ACC acc, const VALUE_TYPE& x, std::size_t){
+      return op(std::move(acc), x);
+    });
+  }
+
 private:
   template <typename ARRAY, typename PROMISE_SP, typename ...ARGS>
   static void states_impl(ARRAY& results, const std::size_t n, PROMISE_SP p, ARGS ...args) {
@@ -374,36 +760,231 @@ public:
       all_settled_any_impl(resolver, arr, 0, args...);
     });
   }
+
+private:
+  template <typename T, typename F>
+  static void retry_impl(std::shared_ptr<const RetryPolicy> policy, F factory, typename Promise<T>::resolver r, std::size_t attempt) {
+    typename Promise<T>::sp p;
+    try{
+      p = factory();
+    }
+    catch(...){
+      p = reject<T>(std::current_exception());
+    }
+    p->stand_alone({
+      .on_fulfilled = [r](const T& x){
+        r.resolve(x);
+      },
+      .on_rejected = [policy, factory, r, attempt](std::exception_ptr e){
+        if(attempt >= policy->max_attempts || (policy->retriable && !policy->retriable(e, attempt))){
+          r.reject(e);
+          return;
+        }
+        auto& timer = policy->timer ? *policy->timer : Timer::shared();
+        timer.after(policy->backoff(attempt), [policy, factory, r, attempt](){
+          retry_impl<T>(policy, factory, r, attempt + 1);
+        });
+      }
+    });
+  }
+
+public:
+  /**
+   * call `factory` (returns Promise<T>::sp) until it is fulfilled or the policy gives up.
+   * each attempt is an independent promise and the backoff runs on the policy's timer,
+   * so neither the chain nor any thread is held while waiting.
+   */
+  template <typename F, typename PROMISE_SP = decltype(std::declval<F>()()), typename T = typename promise_sp_value_type<PROMISE_SP>::type>
+  static auto retry(RetryPolicy policy, F factory) -> typename Promise<T>::sp {
+    auto sp_policy = std::make_shared<const RetryPolicy>(std::move(policy));
+    return Promise<>::create<T>([sp_policy, factory](auto resolver){
+      retry_impl<T>(sp_policy, factory, resolver, 1);
+    });
+  }
+
+private:
+  template <typename T, typename F> struct hedge_state {
+    std::mutex                      mtx;
+    const F                         factory;
+    const typename Promise<T>::resolver r;
+    Timer&                          timer;
+    const Timer::clock::duration    delay;
+    const std::size_t               max_attempts;
+    std::size_t                     nLaunched = 0;
+    std::size_t                     nFailed = 0;
+    Timer::id_type                  backup = 0;   /** armed timer of the next attempt, 0 = none */
+    bool                            bDone = false;
+
+    hedge_state(F f, typename Promise<T>::resolver res, Timer& t, Timer::clock::duration d, std::size_t n) :
+      factory(std::move(f)), r(std::move(res)), timer(t), delay(d), max_attempts(n > 0 ? n : 1) {}
+
+    /** the timer of the next attempt, to cancel outside the lock */
+    Timer::id_type disarm_locked() {
+      const auto id = backup;
+      backup = 0;
+      return id;
+    }
+  };
+
+  /** start the next attempt, and arm the timer for the one after it */
+  template <typename T, typename F> static void hedge_launch(std::shared_ptr<hedge_state<T, F>> s) {
+    std::size_t n;
+    Timer::id_type stale;
+    {
+      std::lock_guard<std::mutex> lock(s->mtx);
+      if(s->bDone || s->nLaunched >= s->max_attempts) return;
+      n = ++s->nLaunched;
+      stale = s->disarm_locked();
+    }
+    if(stale) s->timer.cancel(stale);
+    if(n < s->max_attempts){
+      auto id = s->timer.after(s->delay, [s]{ hedge_launch<T, F>(s); });
+      {
+        std::lock_guard<std::mutex> lock(s->mtx);
+        /** a later attempt or the result got here first */
+        if(!s->bDone && s->nLaunched == n){
+          s->backup = id;
+          id = 0;
+        }
+      }
+      if(id) s->timer.cancel(id);
+    }
+    typename Promise<T>::sp p;
+    try{
+      p = s->factory();
+    }
+    catch(...){
+      p = reject<T>(std::current_exception());
+    }
+    p->stand_alone({
+      .on_fulfilled = [s](const T& x){
+        Timer::id_type stale;
+        {
+          std::lock_guard<std::mutex> lock(s->mtx);
+          if(s->bDone) return;
+          s->bDone = true;
+          stale = s->disarm_locked();
+        }
+        if(stale) s->timer.cancel(stale);
+        s->r.resolve(x);
+      },
+      .on_rejected = [s](std::exception_ptr e){
+        bool bNext = false, bLast = false;
+        {
+          std::lock_guard<std::mutex> lock(s->mtx);
+          if(s->bDone) return;
+          s->nFailed++;
+          if(s->nFailed == s->max_attempts) s->bDone = bLast = true;
+          else bNext = s->nFailed == s->nLaunched;
+        }
+        if(bNext) hedge_launch<T, F>(s);
+        if(bLast) s->r.reject(e);
+      }
+    });
+  }
+
+public:
+  /**
+   * hedged request: call `factory` (returns Promise<T>::sp), and again every `delay` while
+   * no attempt has been fulfilled, up to `max_attempts` calls.
+   *  - the first fulfillment wins. the losers are ignored, not cancelled, and the timer
+   *    of an attempt not yet started is cancelled
+   *  - an attempt that fails while no other is in flight starts the next one at once
+   *  - rejected with the last error once every attempt failed
+   * the delays run on `timer` (nullptr = Timer::shared()), no thread is started.
+   */
+  template <typename F, typename PROMISE_SP = decltype(std::declval<F>()()), typename T = typename promise_sp_value_type<PROMISE_SP>::type>
+  static auto hedge(F factory, Timer::clock::duration delay, std::size_t max_attempts = 2, Timer* timer = nullptr) -> typename Promise<T>::sp {
+    return Promise<>::create<T>([&](auto resolver){
+      auto s = std::make_shared<hedge_state<T, F>>(std::move(factory), resolver, timer ? *timer : Timer::shared(), delay, max_attempts);
+      hedge_launch<T, F>(s);
+    });
+  }
+
+  /** settle resolvers[i] with values[i], then run the continuations. see CompletionBatch */
+  template <typename T>
+  static void resolve_all(const std::vector<typename Promise<T>::resolver>& resolvers, const std::vector<T>& values);
 };
 
 template<typename T> struct is_promise_sp : std::false_type {};
-template<typename T> struct is_promise_sp<std::shared_ptr<Promise<T>>> : std::true_type {};
+template<typename T> struct is_promise_sp<detail::shared_ptr<Promise<T>>> : std::true_type {};
+
+/** value type of the promise then() / error() / finally() return for a callback returning R */
+template <typename R, typename PASS> struct chain_value { using type = R; };
+template <typename U, typename PASS> struct chain_value<detail::shared_ptr<Promise<U>>, PASS> { using type = U; };
+template <typename PASS> struct chain_value<void, PASS> { using type = PASS; };
+
+/**
+ * stages for Promise<T>::pipe().
+ * consecutive synchronous stages are fused into one callback at compile time.
+ */
+namespace stage {
+  template <typename F> struct map_t { F f; };
+  template <typename F> struct tap_t { F f; };
+
+  /** transform the value (a void returning `f` passes the value through, like then()) */
+  template <typename F> map_t<F> map(F f) { return { f }; }
+  /** observe the value */
+  template <typename F> tap_t<F> tap(F f) { return { f }; }
+
+  template <typename F, typename T>
+  auto invoke(const map_t<F>& s, const T& x) -> std::enable_if_t<
+    !std::is_same<decltype(s.f(x)), void>::value, decltype(s.f(x))
+  > {
+    return s.f(x);
+  }
+
+  template <typename F, typename T>
+  auto invoke(const map_t<F>& s, const T& x) -> std::enable_if_t<
+    std::is_same<decltype(s.f(x)), void>::value, T
+  > {
+    s.f(x);
+    return x;
+  }
+
+  template <typename F, typename T> T invoke(const tap_t<F>& s, const T& x) {
+    s.f(x);
+    return x;
+  }
+
+  template <typename S1, typename S2> auto fuse(S1 s1, S2 s2) {
+    return map([s1, s2](const auto& x){ return invoke(s2, invoke(s1, x)); });
+  }
+} /** namespace stage */
 
 template <typename T> class Promise : public PromiseBase {
-friend class Promise<>;
+template <typename> friend class Promise;
 friend class PromiseBase;
+friend class CompletionBatch;
 public:
   using value_type  = T;
-  using sp          = std::shared_ptr<Promise<value_type>>;
+  using sp          = detail::shared_ptr<Promise<value_type>>;
+  using wp          = detail::weak_ptr<Promise<value_type>>;
 
-  /** treat as mutable for use in lambda functions */
+  /**
+   * keeps the promise alive until the last copy is gone. a pending promise whose
+   * resolvers are all gone can never settle: it is abandoned and its handlers dropped.
+   */
   class resolver {
-  friend class Promise<T>;
+  template <typename> friend class Promise;
+  friend class CompletionBatch;
   private:
-    mutable std::weak_ptr<Promise<T>> p_;
-    resolver(sp p) : p_(p) {}
+    Promise<T>* p_;
+    explicit resolver(const sp& p) : p_(p.get()) { p_->first_settler(); }
   public:
+    resolver(const resolver& r) : p_(r.p_) { if(p_) p_->add_settler(); }
+    resolver(resolver&& r) noexcept : p_(r.p_) { r.p_ = nullptr; }
+    resolver& operator=(resolver r) noexcept {
+      std::swap(p_, r.p_);
+      return *this;
+    }
+    ~resolver() { if(p_) p_->release_settler(); }
+
     template <typename U> void resolve(U&& value) const {
-      auto p = p_.lock();
-      if(p){
-        p->on_fulfilled(std::forward<U>(value));
-      }
+      if(p_) p_->on_fulfilled(std::forward<U>(value));
     }
     void reject(std::exception_ptr err) const {
-      auto p = p_.lock();
-      if(p){
-        p->on_rejected(err);
-      }
+      if(p_) p_->on_rejected(err);
     }
   };
   friend struct resolver;
@@ -417,69 +998,168 @@ public:
 
 private:
   value_type              value_ = {};
-  std::unordered_map<PromiseBase*, handler>   handlers_;
 
   sp shared_this() {
     return shared_this_as<T>();
   }
 
-  void add_handler(PromiseBase* base, handler h){
-    const enum PromiseState s = [&](){
-      guard lock(mtx_);
-      if(state_ == PromiseState::pending){
-        handlers_.insert({base, h});
-      }
-      return state_;
-    }();
-    if(s == PromiseState::fulfilled){
-      if(h.on_fulfilled) h.on_fulfilled(value_);
-    }
-    else if(s == PromiseState::rejected){
-      if(h.on_rejected) h.on_rejected(error_);
-    }
+  /** node, reference count and cold part in one allocation */
+  template <typename ...ARGS> static sp make(ARGS&& ...args) {
+    struct node : Promise<T> {
+      cold c;
+      node(ARGS&& ...a) : Promise<T>(&c), c(std::forward<ARGS>(a)...) {}
+#if defined(JPROMISE_METRICS)
+      ~node() { Metrics::destroyed(c.metrics, this->state_.load(std::memory_order_relaxed) == PromiseState::pending); }
+#endif
+    };
+    static_assert(sizeof(PromiseBase) <= detail::node_hot_bytes, "PromiseBase outgrew its share of the first cache line");
+    static_assert(sizeof(cold) <= 2 * 64, "cold part of a promise node outgrew two cache lines");
+    auto p = detail::make_shared<node>(std::forward<ARGS>(args)...);
+    p->c.weak_self = p;
+    p->scheduled_ = p->c.sched.scheduler != nullptr;
+#if defined(JPROMISE_METRICS)
+    p->c.metrics = Metrics::created<T>();
+#endif
+    return p;
   }
 
-  bool consume_handler(handler& h) {
-    guard lock(mtx_);
-    if(handlers_.empty()) return false;
-    auto it = handlers_.begin();
-    h = it->second;
-    handlers_.erase(it);
-    return true;
+  template <typename F> struct callback_of : callback {
+    F f;
+    explicit callback_of(F&& fn) : f(std::move(fn)) {}
+    virtual void run(PromiseBase& p) override { f(static_cast<Promise<T>&>(p)); }
+  };
+
+  template <typename F> static callback_ptr make_callback(F f) {
+    return callback_ptr(new callback_of<F>(std::move(f)));
   }
 
   template<typename U>
   void on_fulfilled(U&& value) {
-    {
-      guard lock(mtx_);
-      assert(state_ == PromiseState::pending);
-      state_ = PromiseState::fulfilled;
-      value_ = std::forward<U>(value);
-      cond_.notify_all();
-    }
-    handler h;
-    while(consume_handler(h)){
-      if(h.on_fulfilled) h.on_fulfilled(value_);
-    }
+    if(set_value(std::forward<U>(value))) run_handlers();
   }
 
   void on_rejected(std::exception_ptr err) {
-    {
-      guard lock(mtx_);
-      assert(state_ == PromiseState::pending);
-      state_ = PromiseState::rejected;
-      error_ = err;
-      cond_.notify_all();
+    if(set_error(err)) run_handlers();
+  }
+
+  /** settles once, like JS: false if already settled. the handlers are left to run_handlers() */
+  template<typename U>
+  bool set_value(U&& value) {
+    return store_result(PromiseState::fulfilled, [&]{ value_ = std::forward<U>(value); });
+  }
+
+  bool set_error(std::exception_ptr err) {
+    return store_result(PromiseState::rejected, [&]{ cold_->error = err; });
+  }
+
+  /** forward the result of a promise returned from a callback without blocking the calling thread */
+  template <typename U>
+  static void adopt(typename Promise<U>::sp p, typename Promise<U>::resolver resolver) {
+    p->stand_alone({
+      .on_fulfilled = [resolver](const U& x){ resolver.resolve(x); },
+      .on_rejected = [resolver = std::move(resolver)](std::exception_ptr err){ resolver.reject(err); }
+    });
+  }
+
+  template <typename U> using resolver_of = typename Promise<U>::resolver;
+  template <typename U> using on_value_fn = std::function<void(const value_type&, const resolver_of<U>&)>;
+  template <typename U> using on_error_fn = std::function<void(std::exception_ptr, const resolver_of<U>&)>;
+  template <typename F, typename ...ARGS> using result_t = decltype(std::declval<const F&>()(std::declval<ARGS>()...));
+  template <typename R> using chain_t = typename chain_value<typename std::decay<R>::type, value_type>::type;
+
+  /**
+   * the one continuation implementation behind then() / error() / finally().
+   * templated on the result type only, callbacks arrive type erased.
+   */
+  template <typename U>
+  typename Promise<U>::sp chain(on_value_fn<U> on_value, on_error_fn<U> on_error) {
+    check_thread();
+    const auto s = state_.load(std::memory_order_acquire);
+    if(s != PromiseState::pending && !scheduled_){
+      /** ready: run the callback now. no handler, no lock, no link to this promise */
+      auto sink = Promise<U>::make();
+      sink->set_schedule(cold_->sched);
+      const resolver_of<U> r(sink);
+      try{
+        Metrics::callback_scope scope;
+        if(s == PromiseState::fulfilled) on_value(value_, r);
+        else on_error(cold_->error, r);
+      }
+      catch(...){
+        r.reject(std::current_exception());
+      }
+      return sink;
     }
-    handler h;
-    while(consume_handler(h)){
-      if(h.on_rejected) h.on_rejected(err);
+
+    auto sink = create_sink<U>();
+    auto settle_sink = [r = resolver_of<U>(sink), on_value = std::move(on_value), on_error = std::move(on_error)](Promise<T>& p){
+      try{
+        Metrics::callback_scope scope;
+        if(p.state_ == PromiseState::fulfilled) on_value(p.value_, r);
+        else on_error(p.cold_->error, r);
+      }
+      catch(...){
+        r.reject(std::current_exception());
+      }
+    };
+    if(!scheduled_){
+      add_callback(make_callback(std::move(settle_sink)));
+      return sink;
     }
+    /** yield to the scheduler at every continuation */
+    add_callback(make_callback([sched = cold_->sched, settle_sink = std::move(settle_sink)](Promise<T>& p) mutable {
+      sched.scheduler->post(sched, [self = p.shared_this(), settle_sink = std::move(settle_sink)]{ settle_sink(*self); });
+    }));
+    return sink;
   }
 
-  virtual void remove_handler(PromiseBase* inst){
-    guard lock(mtx_);
-    handlers_.erase(inst);
+  template <typename U> static void forward_value(const value_type& value, const resolver_of<U>& r) {
+    r.resolve(value);
+  }
+
+  template <typename U> static void forward_error(std::exception_ptr err, const resolver_of<U>& r) {
+    r.reject(err);
+  }
+
+  /** what a void callback settles with */
+  struct pass_value {
+    const value_type& value;
+    void operator()(const resolver& r) const { r.resolve(value); }
+  };
+  struct pass_error {
+    std::exception_ptr err;
+    void operator()(const resolver& r) const { r.reject(err); }
+  };
+
+  struct void_result {};
+  struct value_result {};
+  struct promise_result {};
+  template <typename R> using result_kind = typename std::conditional<
+    std::is_void<R>::value, void_result, typename std::conditional<
+      is_promise_sp<typename std::decay<R>::type>::value, promise_result, value_result
+    >::type
+  >::type;
+
+  /** settle `r` with `func(args...)` */
+  template <typename U, typename F, typename PASS, typename ...ARGS>
+  static void settle(const resolver_of<U>& r, const F& func, const PASS& pass, const ARGS& ...args) {
+    settle_as<U>(result_kind<decltype(func(args...))>{}, r, func, pass, args...);
+  }
+
+  template <typename U, typename F, typename PASS, typename ...ARGS>
+  static void settle_as(void_result, const resolver_of<U>& r, const F& func, const PASS& pass, const ARGS& ...args) {
+    func(args...);
+    pass(r);
+  }
+
+  template <typename U, typename F, typename PASS, typename ...ARGS>
+  static void settle_as(value_result, const resolver_of<U>& r, const F& func, const PASS&, const ARGS& ...args) {
+    r.resolve(func(args...));
+  }
+
+  template <typename U, typename F, typename PASS, typename ...ARGS>
+  static void settle_as(promise_result, const resolver_of<U>& r, const F& func, const PASS&, const ARGS& ...args) {
+    adopt<U>(func(args...), r);
   }
 
   void execute(executor_fn executor) {
@@ -491,263 +1171,205 @@ private:
     }
   }
 
-  Promise() = default;
-  Promise(PromiseBase::sp source) : PromiseBase(source){}
+  explicit Promise(cold* c) : PromiseBase(c) {}
 
 public:
   ~Promise() = default;
 
   const value_type& wait() {
-    std::mutex mtx;
-    std::unique_lock<std::mutex> lock(mtx);
-    auto THIS = shared_this();
-    cond_.wait(lock, [THIS]{ return THIS->state_ != PromiseState::pending; });
-    if(state_ == PromiseState::rejected) std::rethrow_exception(error_);
+    if(!is_ready()){
+#if defined(JPROMISE_SINGLE_THREADED)
+      /** nothing else could settle it while this thread blocks */
+      throw std::logic_error("Promise::wait() on a pending promise in JPROMISE_SINGLE_THREADED mode");
+#else
+      block_until_settled();
+#endif
+    }
+    if(state_ == PromiseState::rejected) std::rethrow_exception(cold_->error);
     return value_; 
   }
 
+  /** settled, wait() would not block */
+  bool is_ready() const {
+    check_thread();
+    return state_.load(std::memory_order_acquire) != PromiseState::pending;
+  }
+
+  /** nullptr while pending, rethrows the error of a rejected promise */
+  const value_type* try_get() const {
+    const auto s = state_.load(std::memory_order_acquire);
+    if(s == PromiseState::pending) return nullptr;
+    if(s == PromiseState::rejected) std::rethrow_exception(cold_->error);
+    return &value_;
+  }
+
+  /** moves the value out, false while pending. later readers see the moved-from value */
+  bool try_take(value_type& out) {
+    if(!try_get()) return false;
+    out = std::move(value_);
+    return true;
+  }
+
+  /** the handler lives as long as something can still settle this promise */
   void stand_alone(handler h = {}) {
-    auto THIS = shared_this();
-    auto sink = create_sink<value_type>();  /** dummy */
-    add_handler(sink.get(), {
-      .on_fulfilled = [THIS, sink, h](const value_type& value){
-        if(h.on_fulfilled){
-          h.on_fulfilled(value);
-        }
-      },
-      .on_rejected = [THIS, sink, h](std::exception_ptr err) {
-        if(h.on_rejected){
-          h.on_rejected(err);
-        }
+    if(!h.on_fulfilled && !h.on_rejected) return;
+    add_callback(make_callback([h = std::move(h)](Promise<T>& p){
+      if(p.state_ == PromiseState::fulfilled){
+        if(h.on_fulfilled) h.on_fulfilled(p.value_);
       }
-    });
+      else if(h.on_rejected){
+        h.on_rejected(p.cold_->error);
+      }
+    }));
   }
 
-  template <typename F>
-  auto then(F func) -> std::enable_if_t<
-    is_promise_sp<decltype(func(value_type{}))>::value
-    , decltype(func(value_type{}))
-  >
-  {
-    using PROMISE = typename decltype(func(value_type{}))::element_type;
-    using TYPE = typename PROMISE::value_type;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver){
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver, func](const value_type& value){
-          try{
-            resolver.resolve(func(value)->wait());
-          }
-          catch(...){
-            resolver.reject(std::current_exception());
-          }
-        },
-        .on_rejected = [resolver](std::exception_ptr err) {
-          resolver.reject(err);
-        }
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto then(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func(value_type{}))>::value &&
-    !std::is_same<decltype(func(value_type{})), void>::value
-    , std::shared_ptr<Promise<decltype(func(value_type{}))>>
-  >
-  {
-    using TYPE = decltype(func(value_type{}));
-    using PROMISE = Promise<TYPE>;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver) {
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver, func](const value_type& value) {
-          resolver.resolve(func(value));
-        },
-        .on_rejected = [resolver](std::exception_ptr err) {
-          resolver.reject(err);
-        }
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto then(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func(value_type{}))>::value &&
-    std::is_same<decltype(func(value_type{})), void>::value
-    , std::shared_ptr<Promise<value_type>>
-  >
-  {
-    auto THIS = shared_this();
-    auto sink = create_sink<value_type>();
-    execute_sink<value_type>(sink, [THIS, sink, func](resolver resolver){
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver, func](const value_type& value) {
-          func(value);
-          resolver.resolve(value);
-        },
-        .on_rejected = [resolver](std::exception_ptr err) {
-          resolver.reject(err);
-        }
-      });
-    });
-    return sink;
-  } 
+private:
+  template <typename S1, typename S2, typename ...REST>
+  auto pipe_step(std::true_type /* s1 is async */, S1 s1, S2 s2, REST ...rest) {
+    return pipe(s1)->pipe(s2, rest...);
+  }
 
-  template <typename F>
-  auto error(F func) -> std::enable_if_t<
-    is_promise_sp<decltype(func(std::exception_ptr{}))>::value
-    , decltype(func(std::exception_ptr{}))
-  >
-  {
-    using PROMISE = typename decltype(func(std::exception_ptr{}))::element_type;
-    using TYPE = typename PROMISE::value_type;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver){
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver](const value_type& value) {
-          resolver.resolve(value);
-        },
-        .on_rejected = [resolver, func](std::exception_ptr err){
-          try{
-            resolver.resolve(func(err)->wait());
-          }
-          catch(...){
-            resolver.reject(std::current_exception());
-          }
-        }
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto error(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func(std::exception_ptr{}))>::value &&
-    !std::is_same<decltype(func(std::exception_ptr{})), void>::value
-    , std::shared_ptr<Promise<decltype(func(std::exception_ptr{}))>>
-  >
-  {
-    using TYPE = decltype(func(std::exception_ptr{}));
-    using PROMISE = Promise<TYPE>;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver){
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver](const value_type& value){
-          resolver.resolve(value);
-        },
-        .on_rejected = [resolver, func](std::exception_ptr err){
-          resolver.resolve(func(err));
-        }
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto error(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func(std::exception_ptr{}))>::value &&
-    std::is_same<decltype(func(std::exception_ptr{})), void>::value
-    , std::shared_ptr<Promise<value_type>>
-  >
-  {
-    auto THIS = shared_this();
-    auto sink = create_sink<value_type>();
-    execute_sink<value_type>(sink, [THIS, sink, func](resolver resolver) {
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver](const value_type& value) {
-          resolver.resolve(value);
-        },
-        .on_rejected = [resolver, func](std::exception_ptr err) {
-          func(err);
-          resolver.reject(err);
-        }
-      });
-    });
-    return sink;
+  template <typename S1, typename S2, typename ...REST>
+  auto pipe_step(std::false_type, S1 s1, S2 s2, REST ...rest) {
+    return pipe(stage::fuse(s1, s2), rest...);
   }
 
-  template <typename F>
-  auto finally(F func) -> std::enable_if_t<
-    is_promise_sp<decltype(func())>::value
-    , decltype(func())
-  >
-  {
-    using PROMISE = typename decltype(func())::element_type;
-    using TYPE = typename PROMISE::value_type;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver){
-      auto fn = [resolver, func](){
-        try{
-          resolver.resolve(func()->wait());
-        }
-        catch(...){
-          resolver.reject(std::current_exception());
-        }
-      };
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [fn](const value_type&){ fn(); },
-        .on_rejected = [fn](std::exception_ptr){ fn(); },
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto finally(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func())>::value &&
-    !std::is_same<decltype(func()), void>::value
-    , std::shared_ptr<Promise<decltype(func())>>
-  >
-  {
-    using TYPE = decltype(func());
-    using PROMISE = Promise<TYPE>;
-    auto THIS = shared_this();
-    auto sink = create_sink<TYPE>();
-    execute_sink<TYPE>(sink, [THIS, sink, func](typename PROMISE::resolver resolver){
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver, func](const value_type&){
-          resolver.resolve(func());
-        },
-        .on_rejected = [resolver, func](std::exception_ptr){
-          resolver.resolve(func());
-        }
-      });
-    });
-    return sink;
-  } 
-
-  template <typename F>
-  auto finally(F func) -> std::enable_if_t<
-    !is_promise_sp<decltype(func())>::value &&
-    std::is_same<decltype(func()), void>::value
-    , std::shared_ptr<Promise<value_type>>
-  >
-  {
-    auto THIS = shared_this();
-    auto sink = create_sink<value_type>();
-    execute_sink<value_type>(sink, [THIS, sink, func](resolver resolver) {
-      THIS->add_handler(sink.get(), {
-        .on_fulfilled = [resolver, func](const value_type& value){
-          func();
-          resolver.resolve(value);
-        },
-        .on_rejected = [resolver, func](std::exception_ptr err){
-          func();
-          resolver.reject(err);
-        }
+public:
+  /**
+   * p->pipe(stage::map(f), stage::map(g), stage::tap(h))
+   * runs the stages as one then() callback with one result node.
+   * a stage that returns Promise::sp ends the fused run, the rest is piped on its result.
+   */
+  template <typename S>
+  auto pipe(S s) {
+    return then([s](const value_type& x){ return stage::invoke(s, x); });
+  }
+
+  template <typename S1, typename S2, typename ...REST>
+  auto pipe(S1 s1, S2 s2, REST ...rest) {
+    using R = decltype(stage::invoke(s1, std::declval<const value_type&>()));
+    return pipe_step(is_promise_sp<R>{}, s1, s2, rest...);
+  }
+
+  /**
+   * a callback may return a value, nothing (the settled value / error passes through)
+   * or Promise::sp (adopted without blocking). a thrown exception rejects the result.
+   */
+  template <typename F, typename R = result_t<F, const value_type&>>
+  auto then(F func) -> typename Promise<chain_t<R>>::sp {
+    using U = chain_t<R>;
+    return chain<U>(
+      [func = std::move(func)](const value_type& value, const resolver_of<U>& r){ settle<U>(r, func, pass_value{value}, value); },
+      &forward_error<U>
+    );
+  }
+
+  template <typename F, typename R = result_t<F, std::exception_ptr>>
+  auto error(F func) -> typename Promise<chain_t<R>>::sp {
+    using U = chain_t<R>;
+    return chain<U>(
+      &forward_value<U>,
+      [func = std::move(func)](std::exception_ptr err, const resolver_of<U>& r){ settle<U>(r, func, pass_error{err}, err); }
+    );
+  }
+
+  template <typename F, typename R = result_t<F>>
+  auto finally(F func) -> typename Promise<chain_t<R>>::sp {
+    using U = chain_t<R>;
+    return chain<U>(
+      [func](const value_type& value, const resolver_of<U>& r){ settle<U>(r, func, pass_value{value}); },
+      [func](std::exception_ptr err, const resolver_of<U>& r){ settle<U>(r, func, pass_error{err}); }
+    );
+  }
+};
+
+/**
+ * settles many promises in one pass and runs (or posts) their continuations afterwards.
+ *  - each promise is locked once, waiters are only woken if there are any
+ *  - continuations are collected, not run, until flush()
+ *  - flush(executor) submits them as one task (or one per `per_task` promises)
+ * unflushed continuations run on destruction.
+ */
+class CompletionBatch {
+private:
+  std::vector<PromiseBase::sp> settled_;
+
+public:
+  CompletionBatch() = default;
+  CompletionBatch(const CompletionBatch&) = delete;
+  CompletionBatch& operator=(const CompletionBatch&) = delete;
+  ~CompletionBatch() { flush(); }
+
+  void reserve(std::size_t n) { settled_.reserve(n); }
+
+  /** false if the resolver was moved from or the promise is already settled */
+  template <typename RESOLVER, typename U>
+  bool resolve(const RESOLVER& r, U&& value) {
+    auto p = r.p_;
+    if(!p || !p->set_value(std::forward<U>(value))) return false;
+    settled_.push_back(p->shared_base());
+    return true;
+  }
+
+  template <typename RESOLVER>
+  bool reject(const RESOLVER& r, std::exception_ptr err) {
+    auto p = r.p_;
+    if(!p || !p->set_error(err)) return false;
+    settled_.push_back(p->shared_base());
+    return true;
+  }
+
+  /** promises whose continuations wait for flush() */
+  std::size_t size() const { return settled_.size(); }
+
+  /** run the continuations on this thread */
+  void flush() {
+    auto ps = std::move(settled_);
+    settled_.clear();
+    for(auto& p : ps) p->run_handlers();
+  }
+
+  /** post the continuations to `executor` (anything with post(std::function<void()>)) */
+  template <typename EXECUTOR>
+  void flush(EXECUTOR& executor, std::size_t per_task = 0) {
+    auto ps = std::make_shared<std::vector<PromiseBase::sp>>(std::move(settled_));
+    settled_.clear();
+    const std::size_t n = ps->size();
+    if(n == 0) return;
+    if(per_task == 0) per_task = n;
+    for(std::size_t i = 0; i < n; i += per_task){
+      const std::size_t end = std::min(n, i + per_task);
+      executor.post([ps, i, end]{
+        for(std::size_t k = i; k < end; k++) (*ps)[k]->run_handlers();
       });
-    });
-    return sink;
+    }
   }
 };
 
+template <typename T>
+void Promise<>::resolve_all(const std::vector<typename Promise<T>::resolver>& resolvers, const std::vector<T>& values) {
+  assert(resolvers.size() == values.size());
+  CompletionBatch batch;
+  batch.reserve(resolvers.size());
+  for(std::size_t i = 0; i < resolvers.size(); i++){
+    batch.resolve(resolvers[i], values[i]);
+  }
+  batch.flush();
+}
+
+/**
+ * common value types are instantiated once in the jpromise_instances library.
+ * define JPROMISE_EXTERN_TEMPLATES (and link it) to skip them in every TU.
+ */
+#if defined(JPROMISE_EXTERN_TEMPLATES)
+extern template class Promise<int>;
+extern template class Promise<std::string>;
+extern template class Promise<std::vector<char>>;
+extern template Promise<int>::sp Promise<int>::chain<int>(Promise<int>::on_value_fn<int>, Promise<int>::on_error_fn<int>);
+extern template Promise<std::string>::sp Promise<std::string>::chain<std::string>(Promise<std::string>::on_value_fn<std::string>, Promise<std::string>::on_error_fn<std::string>);
+extern template Promise<std::vector<char>>::sp Promise<std::vector<char>>::chain<std::vector<char>>(Promise<std::vector<char>>::on_value_fn<std::vector<char>>, Promise<std::vector<char>>::on_error_fn<std::vector<char>>);
+#endif /* defined(JPROMISE_EXTERN_TEMPLATES) */
+
+} /** inline namespace JPROMISE_ABI */
 } /** namespace JPromise */
 #endif /* !defined(__h_promise__) */
\ No newline at end of file
@@ -0,0 +1,344 @@
+#if !defined(__h_metrics__)
+#define __h_metrics__
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <typeinfo>
+#include <cstdint>
+#include <cstdlib>
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+#include "threading.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * opt-in instrumentation, compiled in with JPROMISE_METRICS.
+ *  - counters are sharded per thread (a single writer each) and merged by snapshot()
+ *  - durations go to log-linear (HDR style) histograms. one event in
+ *    JPROMISE_METRICS_SAMPLE per thread is timed, the counters are exact
+ *  - executors register their queue depth, which is read at snapshot() time
+ * without JPROMISE_METRICS the hooks are empty and snapshot() reports nothing.
+ */
+class Metrics {
+public:
+#if defined(JPROMISE_METRICS_SAMPLE)
+  static constexpr std::uint32_t sample_every = JPROMISE_METRICS_SAMPLE;
+#else
+  static constexpr std::uint32_t sample_every = 16;
+#endif
+  /** value types beyond this are counted as "other" */
+  static constexpr std::size_t max_types = 64;
+
+  /** 16 buckets per power of two, ~6% relative error over the whole 64 bit range */
+  class Histogram {
+  public:
+    static constexpr int          sub_bits  = 4;
+    static constexpr std::size_t  nBuckets  = (64 - sub_bits + 1) << sub_bits;
+
+    static std::size_t bucket(std::uint64_t v) {
+      if(v < (1u << sub_bits)) return static_cast<std::size_t>(v);
+      const int e = 63 - __builtin_clzll(v);
+      return (static_cast<std::size_t>(e - sub_bits + 1) << sub_bits) + ((v >> (e - sub_bits)) & ((1u << sub_bits) - 1));
+    }
+
+    /** smallest value that falls into bucket `b` */
+    static std::uint64_t lower_bound(std::size_t b) {
+      if(b < (1u << sub_bits)) return b;
+      const int e = static_cast<int>(b >> sub_bits) + sub_bits - 1;
+      return (std::uint64_t(1) << e) | (static_cast<std::uint64_t>(b & ((1u << sub_bits) - 1)) << (e - sub_bits));
+    }
+
+    std::array<std::uint64_t, nBuckets> counts{};
+    std::uint64_t count = 0;
+    std::uint64_t sum   = 0;
+
+    double mean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+
+    /** lower bound of the bucket holding the `p` quantile */
+    std::uint64_t percentile(double p) const {
+      if(count == 0) return 0;
+      const auto rank = static_cast<std::uint64_t>(p * (count - 1)) + 1;
+      std::uint64_t seen = 0;
+      for(std::size_t b = 0; b < nBuckets; b++){
+        seen += counts[b];
+        if(seen >= rank) return lower_bound(b);
+      }
+      return lower_bound(nBuckets - 1);
+    }
+  };
+
+  struct TypeStats {
+    std::string   name;
+    std::uint64_t created   = 0;
+    std::uint64_t fulfilled = 0;
+    std::uint64_t rejected  = 0;
+    std::uint64_t destroyed = 0;
+    std::uint64_t abandoned = 0;   /** destroyed while pending */
+
+    std::uint64_t live() const { return created > destroyed ? created - destroyed : 0; }
+    std::uint64_t pending() const {
+      const auto done = fulfilled + rejected + abandoned;
+      return created > done ? created - done : 0;
+    }
+  };
+
+  struct QueueDepth {
+    std::string name;
+    std::size_t depth;
+  };
+
+  /** merged view of every thread's counters. counts racing with the snapshot may be off by a few */
+  struct Snapshot {
+    std::vector<TypeStats>  types;
+    Histogram               pending_ns;     /** creation to settlement (sampled) */
+    Histogram               callback_ns;    /** then() / error() / finally() callbacks (sampled) */
+    Histogram               handlers;       /** handlers run per settlement */
+    std::vector<QueueDepth> queues;
+
+    /** Prometheus text exposition format */
+    std::string to_text() const {
+      std::ostringstream os;
+      for(auto& t : types){
+        const auto label = "{type=\"" + t.name + "\"} ";
+        os << "jpromise_promises_created_total" << label << t.created << "\n"
+           << "jpromise_promises_fulfilled_total" << label << t.fulfilled << "\n"
+           << "jpromise_promises_rejected_total" << label << t.rejected << "\n"
+           << "jpromise_promises_abandoned_total" << label << t.abandoned << "\n"
+           << "jpromise_promises_live" << label << t.live() << "\n"
+           << "jpromise_promises_pending" << label << t.pending() << "\n";
+      }
+      summary(os, "jpromise_pending_seconds", pending_ns, 1e-9);
+      summary(os, "jpromise_callback_seconds", callback_ns, 1e-9);
+      summary(os, "jpromise_handlers_per_settle", handlers, 1.0);
+      for(auto& q : queues){
+        os << "jpromise_executor_queue_depth{executor=\"" << q.name << "\"} " << q.depth << "\n";
+      }
+      return os.str();
+    }
+
+  private:
+    static void summary(std::ostream& os, const char* name, const Histogram& h, double scale) {
+      for(double q : { 0.5, 0.9, 0.99, 0.999 }){
+        os << name << "{quantile=\"" << q << "\"} " << h.percentile(q) * scale << "\n";
+      }
+      os << name << "_sum " << h.sum * scale << "\n" << name << "_count " << h.count << "\n";
+    }
+  };
+
+  /** per promise node bookkeeping */
+  struct node {
+    std::uint32_t type        = 0;
+    std::int64_t  created_ns  = 0;    /** 0 = not sampled */
+  };
+
+private:
+  using counter = std::atomic<std::uint64_t>;
+
+  /** owner thread only writes, snapshot() only reads */
+  static void bump(counter& c, std::uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  struct shared_histogram {
+    std::array<counter, Histogram::nBuckets>  counts{};
+    counter                                   sum{0};
+
+    void record(std::uint64_t v) {
+      bump(counts[Histogram::bucket(v)]);
+      bump(sum, v);
+    }
+    void merge_into(Histogram& h) const {
+      for(std::size_t b = 0; b < Histogram::nBuckets; b++){
+        const auto n = counts[b].load(std::memory_order_relaxed);
+        h.counts[b] += n;
+        h.count += n;
+      }
+      h.sum += sum.load(std::memory_order_relaxed);
+    }
+  };
+
+  struct type_counters {
+    counter created{0}, fulfilled{0}, rejected{0}, destroyed{0}, abandoned{0};
+  };
+
+  struct shard {
+    std::array<type_counters, max_types>  types;
+    shared_histogram                      pending_ns;
+    shared_histogram                      callback_ns;
+    shared_histogram                      handlers;
+    std::uint32_t                         tick = 0;
+  };
+
+  std::mutex                                mtx_;
+  std::vector<std::unique_ptr<shard>>       shards_;    /** never freed, reused by later threads */
+  std::vector<shard*>                       free_;
+  std::array<std::string, max_types>        names_;
+  std::atomic<std::uint32_t>                nTypes_{1};
+  std::map<std::uint64_t, std::pair<std::string, std::function<std::size_t()>>> queues_;
+  std::uint64_t                             nextQueue_ = 1;
+
+  Metrics() { names_[0] = "other"; }
+
+  shard* checkout() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if(!free_.empty()){
+      auto s = free_.back();
+      free_.pop_back();
+      return s;
+    }
+    shards_.emplace_back(new shard());
+    return shards_.back().get();
+  }
+
+  void checkin(shard* s) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    free_.push_back(s);
+  }
+
+  /** this thread's shard, handed back for reuse when the thread exits */
+  static shard& local() {
+    struct holder {
+      shard* s = shared().checkout();
+      ~holder() { shared().checkin(s); }
+    };
+    static thread_local holder h;
+    return *h.s;
+  }
+
+  static std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /** true for one call in sample_every on this thread */
+  static bool sample(shard& s) {
+    return ++s.tick % sample_every == 0;
+  }
+
+  std::uint32_t register_type(const char* mangled) {
+    std::string name = mangled;
+#if defined(__GNUG__)
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+    if(status == 0 && demangled) name = demangled;
+    std::free(demangled);
+#endif
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto n = nTypes_.load(std::memory_order_relaxed);
+    if(n >= max_types) return 0;
+    names_[n] = name;
+    nTypes_.store(n + 1, std::memory_order_release);
+    return n;
+  }
+
+public:
+  static Metrics& shared() {
+    static Metrics* m = new Metrics();   /** never destroyed: threads may outlive static destruction */
+    return *m;
+  }
+
+  template <typename T> static std::uint32_t type_index() {
+    static const std::uint32_t index = shared().register_type(typeid(T).name());
+    return index;
+  }
+
+  /** hooks, called by Promise and the executors */
+#if defined(JPROMISE_METRICS)
+  template <typename T> static node created() {
+    auto& s = local();
+    const auto type = type_index<T>();
+    bump(s.types[type].created);
+    return { type, sample(s) ? now_ns() : 0 };
+  }
+
+  static void settled(const node& n, bool bFulfilled) {
+    auto& s = local();
+    bump(bFulfilled ? s.types[n.type].fulfilled : s.types[n.type].rejected);
+    if(n.created_ns != 0) s.pending_ns.record(static_cast<std::uint64_t>(now_ns() - n.created_ns));
+  }
+
+  static void destroyed(const node& n, bool bPending) {
+    auto& s = local();
+    bump(s.types[n.type].destroyed);
+    if(bPending) bump(s.types[n.type].abandoned);
+  }
+
+  static void handlers_run(std::size_t n) {
+    local().handlers.record(n);
+  }
+
+  /** times the callback run in its scope, nested callbacks included */
+  class callback_scope {
+    std::int64_t start_;
+  public:
+    callback_scope() : start_(sample(local()) ? now_ns() : 0) {}
+    ~callback_scope() {
+      if(start_ != 0) local().callback_ns.record(static_cast<std::uint64_t>(now_ns() - start_));
+    }
+  };
+#else
+  static void handlers_run(std::size_t) {}
+  class callback_scope {
+  public:
+    callback_scope() {}
+  };
+#endif
+
+  /** `depth` is called by snapshot(). returns an id for remove_queue() */
+  std::uint64_t add_queue(std::string name, std::function<std::size_t()> depth) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto id = nextQueue_++;
+    queues_[id] = { name + "/" + std::to_string(id), std::move(depth) };
+    return id;
+  }
+
+  void remove_queue(std::uint64_t id) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    queues_.erase(id);
+  }
+
+  Snapshot snapshot() {
+    Snapshot snap;
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto nTypes = nTypes_.load(std::memory_order_acquire);
+    snap.types.resize(nTypes);
+    for(std::uint32_t t = 0; t < nTypes; t++) snap.types[t].name = names_[t];
+    for(auto& s : shards_){
+      for(std::uint32_t t = 0; t < nTypes; t++){
+        auto& c = s->types[t];
+        auto& out = snap.types[t];
+        out.created   += c.created.load(std::memory_order_relaxed);
+        out.fulfilled += c.fulfilled.load(std::memory_order_relaxed);
+        out.rejected  += c.rejected.load(std::memory_order_relaxed);
+        out.destroyed += c.destroyed.load(std::memory_order_relaxed);
+        out.abandoned += c.abandoned.load(std::memory_order_relaxed);
+      }
+      s->pending_ns.merge_into(snap.pending_ns);
+      s->callback_ns.merge_into(snap.callback_ns);
+      s->handlers.merge_into(snap.handlers);
+    }
+    for(auto& q : queues_){
+      snap.queues.push_back({ q.second.first, q.second.second() });
+    }
+    return snap;
+  }
+
+  /** the counters of one value type */
+  template <typename T> TypeStats stats() {
+    return snapshot().types[type_index<T>()];
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_metrics__) */
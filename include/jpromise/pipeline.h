@@ -0,0 +1,473 @@
+#if !defined(__h_pipeline__)
+#define __h_pipeline__
+
+#include <deque>
+#include <map>
+#include <set>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include "jpromise.h"
+#include "async_stream.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+struct PipelineStageOptions {
+  std::size_t concurrency = 1;    /** calls of the stage function in flight at once */
+  std::size_t capacity    = 64;   /** items queued in front of the stage */
+};
+
+struct PipelineOptions {
+  /** emit in push() order (held back at most one pipeline's worth of items), otherwise as items finish */
+  bool        ordered         = true;
+  std::size_t output_capacity = 64;
+  /** a stage function threw or its promise was rejected. the item is dropped */
+  std::function<void(const std::string& stage, std::exception_ptr)> on_error = {};
+};
+
+struct PipelineStageStats {
+  std::string   name;
+  std::size_t   concurrency = 0;
+  std::size_t   capacity    = 0;
+  std::size_t   queued      = 0;    /** waiting in front of the stage */
+  std::size_t   max_queued  = 0;
+  std::size_t   running     = 0;    /** stage function called, promise pending */
+  std::size_t   blocked     = 0;    /** finished, waiting for room in the next stage */
+  std::uint64_t completed   = 0;
+  std::uint64_t failed      = 0;
+  double        seconds     = 0;    /** since the stage was added */
+
+  double throughput() const { return seconds > 0 ? completed / seconds : 0.0; }
+};
+
+template <typename IN, typename OUT> class Pipeline;
+template <typename IN, typename CUR> class PipelineBuilder;
+
+namespace detail {
+  /** what the stages of a pipeline see of it. one lock per pipeline, held only to move items */
+  struct pipeline_core : std::enable_shared_from_this<pipeline_core> {
+    mutable std::mutex mtx;
+    virtual ~pipeline_core() = default;
+    /** move items along and start stage functions until nothing changes */
+    virtual void pump() = 0;
+    /** lock held. the item numbered `seq` failed */
+    virtual void dropped_locked(std::size_t seq) = 0;
+    virtual void failed(const std::string& stage, std::exception_ptr e) = 0;
+  };
+
+  template <typename A> struct pipeline_inlet {
+    virtual ~pipeline_inlet() = default;
+    /** lock held. takes `value` and returns true if there is room for it */
+    virtual bool offer_locked(std::size_t seq, A& value) = 0;
+  };
+
+  template <typename B> struct pipeline_outlet {
+    pipeline_inlet<B>* next = nullptr;
+  };
+
+  struct pipeline_stage {
+    pipeline_core* core = nullptr;
+    virtual ~pipeline_stage() = default;
+    /** lock held: hand finished items on, then start queued ones. false if nothing moved */
+    virtual bool step_locked(std::vector<std::function<void()>>& starts) = 0;
+    virtual PipelineStageStats stats_locked() const = 0;
+    virtual std::size_t queued_locked() const = 0;
+  };
+
+  /** the first inlet of a pipeline: only set while no stage changed the type */
+  template <typename A> void pipeline_first(pipeline_inlet<A>*& first, pipeline_inlet<A>* in) { first = in; }
+  template <typename A, typename B> void pipeline_first(pipeline_inlet<A>*&, pipeline_inlet<B>*) {}
+
+  template <typename A, typename B>
+  struct pipeline_step : pipeline_stage, pipeline_inlet<A>, pipeline_outlet<B> {
+    using fn_type = std::function<typename Promise<B>::sp(const A&)>;
+
+    const std::string                       name;
+    const fn_type                           fn;
+    PipelineStageOptions                    opts;
+    std::deque<std::pair<std::size_t, A>>   queue;
+    std::deque<std::pair<std::size_t, B>>   finished;   /** waiting for room downstream, they keep their slot */
+    std::size_t                             running = 0;
+    std::size_t                             max_queued = 0;
+    std::uint64_t                           completed = 0;
+    std::uint64_t                           failed = 0;
+    std::chrono::steady_clock::time_point   built = std::chrono::steady_clock::now();
+
+    pipeline_step(std::string n, fn_type f, PipelineStageOptions o) : name(std::move(n)), fn(std::move(f)), opts(o) {
+      if(opts.concurrency == 0) opts.concurrency = 1;
+    }
+
+    virtual bool offer_locked(std::size_t seq, A& value) override {
+      if(queue.size() >= opts.capacity) return false;
+      queue.emplace_back(seq, std::move(value));
+      max_queued = std::max(max_queued, queue.size());
+      return true;
+    }
+
+    virtual bool step_locked(std::vector<std::function<void()>>& starts) override {
+      bool bMoved = false;
+      while(!finished.empty() && this->next->offer_locked(finished.front().first, finished.front().second)){
+        finished.pop_front();
+        bMoved = true;
+      }
+      while(!queue.empty() && running + finished.size() < opts.concurrency){
+        auto item = std::make_shared<std::pair<std::size_t, A>>(std::move(queue.front()));
+        queue.pop_front();
+        running++;
+        starts.push_back([this, item]{ start(item->first, item->second); });
+        bMoved = true;
+      }
+      return bMoved;
+    }
+
+    /** no lock held */
+    void start(std::size_t seq, const A& value) {
+      auto keep = core->shared_from_this();
+      typename Promise<B>::sp p;
+      try{
+        p = fn(value);
+      }
+      catch(...){
+        p = Promise<>::reject<B>(std::current_exception());
+      }
+      p->stand_alone({
+        .on_fulfilled = [this, keep, seq](const B& x){
+          {
+            std::lock_guard<std::mutex> lock(core->mtx);
+            running--;
+            completed++;
+            finished.emplace_back(seq, x);
+          }
+          core->pump();
+        },
+        .on_rejected = [this, keep, seq](std::exception_ptr e){
+          {
+            std::lock_guard<std::mutex> lock(core->mtx);
+            running--;
+            failed++;
+            core->dropped_locked(seq);
+          }
+          core->failed(name, e);
+          core->pump();
+        }
+      });
+    }
+
+    virtual PipelineStageStats stats_locked() const override {
+      PipelineStageStats s;
+      s.name        = name;
+      s.concurrency = opts.concurrency;
+      s.capacity    = opts.capacity;
+      s.queued      = queue.size();
+      s.max_queued  = max_queued;
+      s.running     = running;
+      s.blocked     = finished.size();
+      s.completed   = completed;
+      s.failed      = failed;
+      s.seconds     = std::chrono::duration<double>(std::chrono::steady_clock::now() - built).count();
+      return s;
+    }
+
+    virtual std::size_t queued_locked() const override { return queue.size(); }
+  };
+} /** namespace detail */
+
+/**
+ * stream of items through promise returning stages, e.g. parse -> enrich -> persist.
+ *  - each stage has its own concurrency limit and a bounded input queue
+ *  - a finished item keeps its stage slot until the next stage has room, so a slow
+ *    stage fills the queues in front of it and push() stops being fulfilled at once
+ *  - ordered output holds finished items back until the ones pushed before them
+ *    came out, unordered output emits them as they finish
+ *  - a failed item is dropped and reported to PipelineOptions::on_error
+ * stage functions run on the thread that made room for the item (a push(), or the
+ * thread that settled the previous promise). results come out of output().
+ */
+template <typename IN, typename OUT> class Pipeline : public detail::pipeline_core {
+template <typename, typename> friend class PipelineBuilder;
+public:
+  using sp = std::shared_ptr<Pipeline<IN, OUT>>;
+
+private:
+  using guard = std::lock_guard<std::mutex>;
+
+  struct writer {
+    typename Promise<bool>::resolver  r;
+    IN                                value;
+  };
+  struct sink : detail::pipeline_inlet<OUT> {
+    Pipeline* p;
+    explicit sink(Pipeline* pipeline) : p(pipeline) {}
+    virtual bool offer_locked(std::size_t seq, OUT& value) override { return p->offer_output_locked(seq, value); }
+  };
+
+  const PipelineOptions                                   options_;
+  std::vector<std::unique_ptr<detail::pipeline_stage>>    stages_;
+  sink                                                    sink_{this};
+  detail::pipeline_inlet<IN>*                             first_;
+  typename AsyncStream<OUT>::sp                           output_;
+  std::size_t                                             window_;    /** ordered: items between the oldest not emitted and the newest */
+  Promise<bool>::sp                                       accepted_;
+  Promise<bool>::sp                                       refused_;
+
+  /** guarded by mtx */
+  std::deque<writer>              writers_;   /** push()es waiting for room in the first stage */
+  std::size_t                     nextSeq_ = 0;
+  std::size_t                     nextOut_ = 0;   /** ordered: next item to emit */
+  std::size_t                     inside_ = 0;    /** admitted, not yet emitted or dropped */
+  std::map<std::size_t, OUT>      reorder_;
+  std::set<std::size_t>           dropped_;
+  std::deque<OUT>                 ready_;     /** unordered: finished, not yet emitted */
+  std::size_t                     nParked_ = 0;   /** output pushes not yet accepted */
+  bool                            bClosed_ = false;
+  bool                            bOutputClosed_ = false;
+  bool                            bPumping_ = false;
+  bool                            bDirty_ = false;
+#if defined(JPROMISE_METRICS)
+  std::vector<std::uint64_t>      metrics_ids_;
+#endif
+
+  Pipeline(std::vector<std::unique_ptr<detail::pipeline_stage>> stages, detail::pipeline_inlet<IN>* first,
+           detail::pipeline_outlet<OUT>* last, PipelineOptions options) :
+    options_(std::move(options)),
+    stages_(std::move(stages)),
+    first_(first),
+    output_(AsyncStream<OUT>::create(options_.output_capacity)),
+    window_(options_.output_capacity),
+    accepted_(Promise<>::resolve(true)),
+    refused_(Promise<>::resolve(false))
+  {
+    if(last) last->next = &sink_;
+    else detail::pipeline_first<IN>(first_, static_cast<detail::pipeline_inlet<OUT>*>(&sink_));
+    for(auto& s : stages_){
+      s->core = this;
+      const auto st = s->stats_locked();
+      window_ += st.capacity + st.concurrency;
+#if defined(JPROMISE_METRICS)
+      auto stage = s.get();
+      metrics_ids_.push_back(Metrics::shared().add_queue("Pipeline/" + st.name, [this, stage]{
+        guard lock(mtx);
+        return stage->queued_locked();
+      }));
+#endif
+    }
+  }
+
+  bool admit_locked(IN& value) {
+    if(options_.ordered && nextSeq_ - nextOut_ >= window_) return false;
+    if(!first_->offer_locked(nextSeq_, value)) return false;
+    nextSeq_++;
+    inside_++;
+    return true;
+  }
+
+  bool offer_output_locked(std::size_t seq, OUT& value) {
+    if(options_.ordered){
+      reorder_.emplace(seq, std::move(value));
+      return true;
+    }
+    if(ready_.size() >= options_.output_capacity) return false;
+    ready_.push_back(std::move(value));
+    return true;
+  }
+
+  virtual void dropped_locked(std::size_t seq) override {
+    if(options_.ordered) dropped_.insert(seq);
+    else inside_--;
+  }
+
+  virtual void failed(const std::string& stage, std::exception_ptr e) override {
+    if(options_.on_error) options_.on_error(stage, e);
+  }
+
+  /** items the output can take now, in emission order */
+  bool take_output_locked(std::vector<OUT>& out) {
+    if(nParked_ > 0) return false;
+    bool bMoved = false;
+    if(options_.ordered){
+      while(true){
+        auto d = dropped_.find(nextOut_);
+        if(d != dropped_.end()) dropped_.erase(d);
+        else if(!reorder_.empty() && reorder_.begin()->first == nextOut_){
+          out.push_back(std::move(reorder_.begin()->second));
+          reorder_.erase(reorder_.begin());
+        }
+        else break;
+        nextOut_++;
+        inside_--;
+        bMoved = true;
+      }
+    }
+    else{
+      for(auto& x : ready_) out.push_back(std::move(x));
+      inside_ -= ready_.size();
+      bMoved = !ready_.empty();
+      ready_.clear();
+    }
+    return bMoved;
+  }
+
+  /** no lock held */
+  void emit(std::vector<OUT>& out) {
+    for(auto& x : out){
+      auto p = output_->push(std::move(x));
+      if(p->state() != PromiseState::pending) continue;
+      {
+        guard lock(mtx);
+        nParked_++;
+      }
+      auto self = shared_from_this();
+      p->stand_alone({
+        .on_fulfilled = [this, self](bool){
+          {
+            guard lock(mtx);
+            nParked_--;
+          }
+          pump();
+        }
+      });
+    }
+  }
+
+public:
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  /** waiting producers get false */
+  ~Pipeline() {
+#if defined(JPROMISE_METRICS)
+    for(auto id : metrics_ids_) Metrics::shared().remove_queue(id);
+#endif
+    for(auto& w : writers_) w.r.resolve(false);
+  }
+
+  /** fulfilled with true once the first stage took the item, false if the pipeline is closed */
+  Promise<bool>::sp push(IN value) {
+    typename Promise<bool>::sp p = accepted_;
+    {
+      guard lock(mtx);
+      if(bClosed_) return refused_;
+      if(!writers_.empty() || !admit_locked(value)){
+        p = Promise<>::create<bool>([&](auto resolver){
+          writers_.push_back({ resolver, std::move(value) });
+        });
+      }
+    }
+    pump();
+    return p;
+  }
+
+  /** end of input. output() ends once the items already pushed came out */
+  void close() {
+    {
+      guard lock(mtx);
+      bClosed_ = true;
+    }
+    pump();
+  }
+
+  /** results, with the output's own backpressure: a consumer that falls behind stalls the last stage */
+  typename AsyncStream<OUT>::sp output() const { return output_; }
+
+  /** items pushed and not yet out of the pipeline */
+  std::size_t size() const {
+    guard lock(mtx);
+    return inside_ + writers_.size();
+  }
+
+  std::vector<PipelineStageStats> stats() const {
+    std::vector<PipelineStageStats> s;
+    guard lock(mtx);
+    for(auto& x : stages_) s.push_back(x->stats_locked());
+    return s;
+  }
+
+  virtual void pump() override {
+    {
+      guard lock(mtx);
+      if(bPumping_){
+        bDirty_ = true;
+        return;
+      }
+      bPumping_ = true;
+    }
+    while(true){
+      std::vector<std::function<void()>> starts;
+      std::vector<typename Promise<bool>::resolver> admitted;
+      std::vector<OUT> out;
+      bool bMoved = false;
+      bool bClose = false;
+      {
+        guard lock(mtx);
+        bDirty_ = false;
+        bMoved = take_output_locked(out);
+        /** later stages first, so each stage sees the room the one after it just made */
+        for(auto it = stages_.rbegin(); it != stages_.rend(); it++){
+          if((*it)->step_locked(starts)) bMoved = true;
+        }
+        while(!writers_.empty() && admit_locked(writers_.front().value)){
+          admitted.push_back(std::move(writers_.front().r));
+          writers_.pop_front();
+          bMoved = true;
+        }
+        if(bClosed_ && !bOutputClosed_ && inside_ == 0 && writers_.empty() && nParked_ == 0){
+          bOutputClosed_ = bClose = true;
+        }
+      }
+      emit(out);
+      for(auto& r : admitted) r.resolve(true);
+      for(auto& s : starts) s();
+      if(bClose) output_->close();
+      guard lock(mtx);
+      if(!bMoved && !bDirty_){
+        bPumping_ = false;
+        return;
+      }
+    }
+  }
+};
+
+/**
+ * typed builder: each stage() turns the item type into the value type of the
+ * promise its function returns. build() consumes the builder.
+ *
+ *   auto p = PipelineBuilder<std::string>()
+ *     .stage("parse", parse, { .concurrency = 2 })
+ *     .stage("enrich", enrich, { .concurrency = 16, .capacity = 256 })
+ *     .build();
+ */
+template <typename IN, typename CUR = IN> class PipelineBuilder {
+template <typename, typename> friend class PipelineBuilder;
+private:
+  std::vector<std::unique_ptr<detail::pipeline_stage>>  stages_;
+  detail::pipeline_inlet<IN>*                           first_ = nullptr;
+  detail::pipeline_outlet<CUR>*                         last_ = nullptr;
+
+public:
+  PipelineBuilder() = default;
+
+  /** `func` takes const CUR& and returns Promise<U>::sp */
+  template <typename F, typename R = typename std::decay<decltype(std::declval<const F&>()(std::declval<const CUR&>()))>::type>
+  PipelineBuilder<IN, typename chain_value<R, void>::type> stage(std::string name, F func, PipelineStageOptions options = {}) {
+    static_assert(is_promise_sp<R>::value, "a pipeline stage returns Promise<U>::sp");
+    using U = typename chain_value<R, void>::type;
+    auto step = new detail::pipeline_step<CUR, U>(std::move(name), std::move(func), options);
+    PipelineBuilder<IN, U> b;
+    b.stages_ = std::move(stages_);
+    b.stages_.emplace_back(step);
+    b.first_ = first_;
+    if(last_) last_->next = step;
+    else detail::pipeline_first<IN>(b.first_, static_cast<detail::pipeline_inlet<CUR>*>(step));
+    b.last_ = step;
+    return b;
+  }
+
+  typename Pipeline<IN, CUR>::sp build(PipelineOptions options = {}) {
+    return typename Pipeline<IN, CUR>::sp(new Pipeline<IN, CUR>(std::move(stages_), first_, last_, std::move(options)));
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_pipeline__) */
@@ -0,0 +1,370 @@
+#if !defined(__h_reactor__)
+#define __h_reactor__
+
+#if !defined(__linux__)
+#error "jpromise/reactor.h requires Linux (epoll / eventfd)"
+#endif
+
+#include <deque>
+#include <atomic>
+#include <array>
+#include <system_error>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "jpromise.h"
+#include "executor.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * epoll based event loop.
+ *  - every promise returned by async_*() is settled on the loop thread,
+ *    so continuations attached to it run there too
+ *  - the fd is switched to non-blocking mode on first use
+ *  - also a Timer and an Executor whose tasks run on the loop thread
+ */
+class Reactor : public Timer, public Executor {
+public:
+  using task_fn = std::function<void()>;
+
+private:
+  /**
+   * returns an empty task while the operation would block, otherwise the task that settles
+   * its promise. `cancelled` != 0 rejects it with that errno. the task runs once the reactor
+   * is done with the fd: a continuation may close it.
+   */
+  using io_fn = std::function<task_fn(int cancelled)>;
+
+  struct fd_state {
+    std::deque<io_fn>   readers;
+    std::deque<io_fn>   writers;
+    uint32_t            events = 0;   /** registered interest */
+  };
+
+  using timer_key = std::pair<clock::time_point, id_type>;
+
+  int                                             epfd_ = -1;
+  int                                             evfd_ = -1;
+  std::atomic<bool>                               stop_{false};
+  std::atomic<std::thread::id>                    loop_thread_{};
+
+  std::mutex                                      mtx_;       /** guards posted_ and timers */
+  std::vector<task_fn>                            posted_;
+  std::map<timer_key, task_fn>                    timers_;
+  std::unordered_map<id_type, clock::time_point>  deadlines_;
+  id_type                                         next_id_ = 1;
+
+  std::unordered_map<int, fd_state>               fds_;       /** loop thread only */
+
+  static std::exception_ptr system_error(int err, const char* what) {
+    return std::make_exception_ptr(std::system_error(err, std::generic_category(), what));
+  }
+
+  void wakeup() {
+    uint64_t one = 1;
+    auto r = ::write(evfd_, &one, sizeof(one));
+    (void)r;
+  }
+
+  void update_interest(int fd, fd_state& st) {
+    uint32_t events = 0;
+    if(!st.readers.empty()) events |= EPOLLIN;
+    if(!st.writers.empty()) events |= EPOLLOUT;
+    if(events == st.events) return;
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if(st.events == 0) ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    else if(events == 0) ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    else ::epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
+    st.events = events;
+  }
+
+  /** run queued operations of one direction until one would block */
+  static void drain(std::deque<io_fn>& q, std::vector<task_fn>& done) {
+    while(!q.empty()){
+      auto settle = q.front()(0);
+      if(!settle) break;
+      done.push_back(std::move(settle));
+      q.pop_front();
+    }
+  }
+
+  static void cancel_all(fd_state& st, int err) {
+    std::deque<io_fn> r, w;
+    r.swap(st.readers);
+    w.swap(st.writers);
+    for(auto& op : r) op(err)();
+    for(auto& op : w) op(err)();
+  }
+
+  /** loop thread: try `op` now, queue it until the fd is ready if it would block */
+  void submit(int fd, bool bWrite, io_fn op, bool bTryNow = true) {
+    auto& st = fds_[fd];
+    auto& q = bWrite ? st.writers : st.readers;
+    if(bTryNow && q.empty()){
+      if(auto settle = op(0)){
+        if(st.readers.empty() && st.writers.empty() && st.events == 0) fds_.erase(fd);
+        settle();
+        return;
+      }
+    }
+    q.push_back(std::move(op));
+    update_interest(fd, st);
+  }
+
+  void handle_event(int fd, uint32_t e) {
+    auto it = fds_.find(fd);
+    if(it == fds_.end()) return;
+    std::vector<task_fn> done;
+    if(e & (EPOLLIN | EPOLLERR | EPOLLHUP)) drain(it->second.readers, done);
+    if(e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) drain(it->second.writers, done);
+    update_interest(fd, it->second);
+    if(it->second.readers.empty() && it->second.writers.empty()) fds_.erase(it);
+    /** continuations may submit more operations on the fd, or close it */
+    for(auto& settle : done) settle();
+  }
+
+  static void set_nonblocking(int fd) {
+    const int flags = ::fcntl(fd, F_GETFL, 0);
+    if(flags >= 0 && !(flags & O_NONBLOCK)) ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  void run_posted() {
+    std::vector<task_fn> tasks;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      tasks.swap(posted_);
+    }
+    for(auto& t : tasks) t();
+  }
+
+  /** runs due timers, returns epoll timeout in ms */
+  int run_timers() {
+    while(true){
+      task_fn task;
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(!posted_.empty()) return 0;
+        if(timers_.empty()) return -1;
+        auto it = timers_.begin();
+        const auto now = clock::now();
+        if(now < it->first.first){
+          auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(it->first.first - now).count();
+          return static_cast<int>(ms + 1);
+        }
+        task = std::move(it->second);
+        deadlines_.erase(it->first.second);
+        timers_.erase(it);
+      }
+      task();
+    }
+  }
+
+public:
+  Reactor() {
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epfd_ < 0 || evfd_ < 0){
+      const int err = errno;
+      if(epfd_ >= 0) ::close(epfd_);
+      if(evfd_ >= 0) ::close(evfd_);
+      throw std::system_error(err, std::generic_category(), "Reactor");
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = evfd_;
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev);
+  }
+
+  virtual ~Reactor() {
+    for(auto& it : fds_) cancel_all(it.second, ECANCELED);
+    fds_.clear();
+    ::close(evfd_);
+    ::close(epfd_);
+  }
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  bool in_loop_thread() const {
+    return loop_thread_.load() == std::this_thread::get_id();
+  }
+
+  /** run `task` on the loop thread */
+  virtual void post(task_fn task) override {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      posted_.push_back(std::move(task));
+    }
+    wakeup();
+  }
+
+  /** run now if already on the loop thread, otherwise post() */
+  void dispatch(task_fn task) {
+    if(in_loop_thread()) task();
+    else post(std::move(task));
+  }
+
+  virtual id_type at(clock::time_point when, Timer::task_fn task) override {
+    id_type id;
+    bool bEarliest;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      id = next_id_++;
+      bEarliest = timers_.empty() || when < timers_.begin()->first.first;
+      timers_.emplace(timer_key(when, id), std::move(task));
+      deadlines_.emplace(id, when);
+    }
+    if(bEarliest && !in_loop_thread()) wakeup();
+    return id;
+  }
+
+  virtual bool cancel(id_type id) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = deadlines_.find(id);
+    if(it == deadlines_.end()) return false;
+    timers_.erase(timer_key(it->second, id));
+    deadlines_.erase(it);
+    return true;
+  }
+
+  /** process events until stop() */
+  void run() {
+    loop_thread_ = std::this_thread::get_id();
+    std::array<epoll_event, 128> events;
+    while(!stop_){
+      const int timeout = run_timers();
+      if(stop_) break;
+      const int n = ::epoll_wait(epfd_, events.data(), static_cast<int>(events.size()), timeout);
+      if(n < 0 && errno != EINTR) break;
+      for(int i = 0; i < n; i++){
+        const int fd = events[i].data.fd;
+        if(fd == evfd_){
+          uint64_t v;
+          while(::read(evfd_, &v, sizeof(v)) > 0){}
+          continue;
+        }
+        handle_event(fd, events[i].events);
+      }
+      run_posted();
+    }
+    run_posted();
+    loop_thread_ = std::thread::id();
+    stop_ = false;
+  }
+
+  void stop() {
+    stop_ = true;
+    wakeup();
+  }
+
+  /** reject every pending operation on `fd` with ECANCELED and stop watching it (the fd is not closed) */
+  void cancel_fd(int fd) {
+    post([this, fd](){
+      auto it = fds_.find(fd);
+      if(it == fds_.end()) return;
+      fd_state st;
+      st.readers.swap(it->second.readers);
+      st.writers.swap(it->second.writers);
+      update_interest(fd, it->second);
+      fds_.erase(it);
+      cancel_all(st, ECANCELED);
+    });
+  }
+
+  /** fulfilled with the number of bytes read (0 = end of file) */
+  Promise<std::size_t>::sp async_read(int fd, void* buf, std::size_t len) {
+    return Promise<>::create<std::size_t>([this, fd, buf, len](auto resolver){
+      dispatch([this, fd, buf, len, resolver](){
+        set_nonblocking(fd);
+        submit(fd, false, [fd, buf, len, resolver](int cancelled) -> task_fn {
+          if(cancelled) return [resolver, cancelled]{ resolver.reject(system_error(cancelled, "read")); };
+          const auto n = ::read(fd, buf, len);
+          if(n >= 0) return [resolver, n]{ resolver.resolve(static_cast<std::size_t>(n)); };
+          if(errno == EAGAIN || errno == EWOULDBLOCK) return nullptr;
+          if(errno == EINTR) return nullptr;
+          const int err = errno;
+          return [resolver, err]{ resolver.reject(system_error(err, "read")); };
+        });
+      });
+    });
+  }
+
+  /** fulfilled when all `len` bytes are written */
+  Promise<std::size_t>::sp async_write(int fd, const void* buf, std::size_t len) {
+    return Promise<>::create<std::size_t>([this, fd, buf, len](auto resolver){
+      dispatch([this, fd, buf, len, resolver](){
+        set_nonblocking(fd);
+        auto written = std::make_shared<std::size_t>(0);
+        submit(fd, true, [fd, buf, len, resolver, written](int cancelled) -> task_fn {
+          if(cancelled) return [resolver, cancelled]{ resolver.reject(system_error(cancelled, "write")); };
+          while(*written < len){
+            const auto n = ::send(fd, static_cast<const char*>(buf) + *written, len - *written, MSG_NOSIGNAL);
+            if(n < 0 && errno == ENOTSOCK){
+              const auto m = ::write(fd, static_cast<const char*>(buf) + *written, len - *written);
+              if(m >= 0) { *written += m; continue; }
+            }
+            else if(n >= 0) { *written += n; continue; }
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return nullptr;
+            const int err = errno;
+            return [resolver, err]{ resolver.reject(system_error(err, "write")); };
+          }
+          return [resolver, len]{ resolver.resolve(len); };
+        });
+      });
+    });
+  }
+
+  /** fulfilled with the accepted (non-blocking) socket */
+  Promise<int>::sp async_accept(int listen_fd) {
+    return Promise<>::create<int>([this, listen_fd](auto resolver){
+      dispatch([this, listen_fd, resolver](){
+        set_nonblocking(listen_fd);
+        submit(listen_fd, false, [listen_fd, resolver](int cancelled) -> task_fn {
+          if(cancelled) return [resolver, cancelled]{ resolver.reject(system_error(cancelled, "accept")); };
+          const int s = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if(s >= 0) return [resolver, s]{ resolver.resolve(s); };
+          if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) return nullptr;
+          const int err = errno;
+          return [resolver, err]{ resolver.reject(system_error(err, "accept")); };
+        });
+      });
+    });
+  }
+
+  /** fulfilled with `fd` once connected */
+  Promise<int>::sp async_connect(int fd, const sockaddr* addr, socklen_t addrlen) {
+    std::vector<char> sa(reinterpret_cast<const char*>(addr), reinterpret_cast<const char*>(addr) + addrlen);
+    return Promise<>::create<int>([this, fd, sa](auto resolver){
+      dispatch([this, fd, sa, resolver](){
+        set_nonblocking(fd);
+        if(::connect(fd, reinterpret_cast<const sockaddr*>(sa.data()), static_cast<socklen_t>(sa.size())) == 0){
+          resolver.resolve(fd);
+          return;
+        }
+        if(errno != EINPROGRESS){
+          resolver.reject(system_error(errno, "connect"));
+          return;
+        }
+        /** writable = connected or failed, so do not probe before epoll reports it */
+        submit(fd, true, [fd, resolver](int cancelled) -> task_fn {
+          if(cancelled) return [resolver, cancelled]{ resolver.reject(system_error(cancelled, "connect")); };
+          int err = 0;
+          socklen_t len = sizeof(err);
+          if(::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+          if(err == 0) return [resolver, fd]{ resolver.resolve(fd); };
+          return [resolver, err]{ resolver.reject(system_error(err, "connect")); };
+        }, false);
+      });
+    });
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_reactor__) */
@@ -0,0 +1,267 @@
+#if !defined(__h_shared_memory__)
+#define __h_shared_memory__
+
+#if !defined(__linux__)
+#error "jpromise/shared_memory.h requires Linux (memfd / futex / eventfd)"
+#endif
+
+#include <atomic>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include "jpromise.h"
+#include "reactor.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared slots need address free atomics");
+
+/** rejection of a SharedSlot, carries the producer's message */
+struct SharedSlotError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+/** bytes written into a SharedArena, see SharedArena::write() */
+struct SharedBytes {
+  std::uint64_t offset = 0;
+  std::uint64_t size   = 0;
+};
+
+/**
+ * a promise's state in shared memory, settled once by one process and awaited by another.
+ * the state word doubles as the futex. T is copied in and out, so it is trivially copyable
+ * (SharedBytes for variable sized results).
+ */
+template <typename T> struct SharedSlot {
+  static_assert(std::is_trivially_copyable<T>::value, "SharedSlot<T> needs a trivially copyable T");
+  /** settling: claimed by a producer that is writing the payload */
+  enum : std::uint32_t { pending = 0, fulfilled = 1, rejected = 2, settling = 3 };
+
+  std::atomic<std::uint32_t>  state{pending};
+  std::atomic<std::uint32_t>  sleepers{0};    /** threads in futex wait */
+  std::atomic<std::uint32_t>  watchers{0};    /** reactor promises, woken through the arena's eventfd */
+  T                           value;
+  char                        error[116];
+
+  bool is_ready() const {
+    const auto s = state.load(std::memory_order_acquire);
+    return s == fulfilled || s == rejected;
+  }
+
+  /** make a settled slot pending again. only while no other process uses it */
+  void reset() { state.store(pending, std::memory_order_relaxed); }
+};
+
+/**
+ * shared memory for SharedSlots: a memfd mapping and an eventfd.
+ *  - both are inherited by fork(), or sent to an unrelated process (SCM_RIGHTS) which
+ *    attach()es them. pass slots to it as offset()s, the mapping address differs
+ *  - make() / write() allocate from a bump pointer in the mapping, from any process.
+ *    nothing is freed before the arena is unmapped
+ *  - resolve() / reject() wake futex waiters and, if the slot is watched, the eventfd
+ *  - one process consumes an arena through promise(): readers of the eventfd take
+ *    each other's wakeups
+ */
+class SharedArena {
+private:
+  struct header {
+    std::atomic<std::uint64_t>  used;
+    std::uint64_t               capacity;
+  };
+  using watch_fn = std::function<bool()>;
+
+  int                     memfd_ = -1;
+  int                     evfd_ = -1;
+  std::size_t             bytes_ = 0;
+  char*                   base_ = nullptr;
+  /** loop thread of the consuming reactor only */
+  std::vector<watch_fn>   watches_;
+  bool                    bReading_ = false;
+  std::uint64_t           counter_ = 0;
+
+  static header* head(char* base) { return reinterpret_cast<header*>(base); }
+
+  static long futex(std::atomic<std::uint32_t>* word, int op, std::uint32_t v) {
+    return ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), op, v, nullptr, nullptr, 0);
+  }
+
+  void map() {
+    void* p = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+    if(p == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "SharedArena mmap");
+    base_ = static_cast<char*>(p);
+  }
+
+  /** claim the slot, write the payload, then publish `s` */
+  template <typename T, typename W> void settle(SharedSlot<T>* slot, std::uint32_t s, W write) {
+    std::uint32_t expected = SharedSlot<T>::pending;
+    if(!slot->state.compare_exchange_strong(expected, SharedSlot<T>::settling, std::memory_order_acquire)){
+      throw std::logic_error("SharedSlot settled twice");
+    }
+    write();
+    /** seq_cst against the watcher's increment, see promise() */
+    slot->state.store(s, std::memory_order_seq_cst);
+    if(slot->sleepers.load(std::memory_order_seq_cst) > 0) futex(&slot->state, FUTEX_WAKE, INT_MAX);
+    if(slot->watchers.load(std::memory_order_seq_cst) > 0){
+      std::uint64_t one = 1;
+      auto r = ::write(evfd_, &one, sizeof(one));
+      (void)r;
+    }
+  }
+
+  /** loop thread: settle the watched promises whose slot is ready, then wait for the eventfd again */
+  void poll(Reactor& reactor) {
+    /** settling runs continuations, which may watch more slots */
+    std::vector<watch_fn> ws;
+    ws.swap(watches_);
+    for(auto& w : ws){
+      if(!w()) watches_.push_back(std::move(w));
+    }
+    if(watches_.empty() || bReading_) return;
+    bReading_ = true;
+    reactor.async_read(evfd_, &counter_, sizeof(counter_))->stand_alone({
+      .on_fulfilled = [this, &reactor](const std::size_t&){
+        bReading_ = false;
+        poll(reactor);
+      },
+      .on_rejected = [this](std::exception_ptr){ bReading_ = false; }
+    });
+  }
+
+public:
+  /** a new arena of `bytes` */
+  explicit SharedArena(std::size_t bytes) : bytes_(bytes + sizeof(header)) {
+    memfd_ = ::memfd_create("jpromise-arena", MFD_CLOEXEC);
+    evfd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(memfd_ < 0 || evfd_ < 0 || ::ftruncate(memfd_, static_cast<off_t>(bytes_)) < 0){
+      const int err = errno;
+      if(memfd_ >= 0) ::close(memfd_);
+      if(evfd_ >= 0) ::close(evfd_);
+      throw std::system_error(err, std::generic_category(), "SharedArena");
+    }
+    map();
+    auto h = new (base_) header();
+    h->used.store(sizeof(header), std::memory_order_relaxed);
+    h->capacity = bytes_;
+  }
+
+  /** the arena another process created, from its memfd() and eventfd(). takes ownership of both */
+  static std::unique_ptr<SharedArena> attach(int memfd, int eventfd) {
+    std::unique_ptr<SharedArena> a(new SharedArena());
+    a->memfd_ = memfd;
+    a->evfd_ = eventfd;
+    struct stat st;
+    if(::fstat(memfd, &st) < 0) throw std::system_error(errno, std::generic_category(), "SharedArena attach");
+    a->bytes_ = static_cast<std::size_t>(st.st_size);
+    a->map();
+    return a;
+  }
+
+  ~SharedArena() {
+    if(base_) ::munmap(base_, bytes_);
+    if(memfd_ >= 0) ::close(memfd_);
+    if(evfd_ >= 0) ::close(evfd_);
+  }
+
+  SharedArena(const SharedArena&) = delete;
+  SharedArena& operator=(const SharedArena&) = delete;
+
+  int memfd() const { return memfd_; }
+  int eventfd() const { return evfd_; }
+
+  /** `n` bytes aligned to `align`, throws std::bad_alloc when the arena is full */
+  void* allocate(std::size_t n, std::size_t align = alignof(std::max_align_t)) {
+    auto h = head(base_);
+    auto used = h->used.load(std::memory_order_relaxed);
+    std::uint64_t at;
+    do{
+      at = (used + align - 1) / align * align;
+      if(at + n > h->capacity) throw std::bad_alloc();
+    }while(!h->used.compare_exchange_weak(used, at + n, std::memory_order_relaxed));
+    return base_ + at;
+  }
+
+  /** a pending slot, cache line aligned */
+  template <typename T> SharedSlot<T>* make() {
+    return new (allocate(sizeof(SharedSlot<T>), 64)) SharedSlot<T>();
+  }
+
+  /** copy `n` bytes into the arena, e.g. for a SharedSlot<SharedBytes> */
+  SharedBytes write(const void* data, std::size_t n) {
+    auto p = static_cast<char*>(allocate(n, 1));
+    std::memcpy(p, data, n);
+    return { static_cast<std::uint64_t>(p - base_), n };
+  }
+
+  const char* data(const SharedBytes& b) const { return base_ + b.offset; }
+
+  std::uint64_t offset(const void* p) const { return static_cast<const char*>(p) - base_; }
+  template <typename T> SharedSlot<T>* at(std::uint64_t off) const { return reinterpret_cast<SharedSlot<T>*>(base_ + off); }
+
+  /** throws std::logic_error if the slot was settled already, the first value stays */
+  template <typename T> void resolve(SharedSlot<T>* slot, const T& value) {
+    settle(slot, SharedSlot<T>::fulfilled, [&]{ slot->value = value; });
+  }
+
+  /** `message` is cut to fit the slot */
+  template <typename T> void reject(SharedSlot<T>* slot, const std::string& message) {
+    settle(slot, SharedSlot<T>::rejected, [&]{
+      const auto n = std::min(message.size(), sizeof(slot->error) - 1);
+      std::memcpy(slot->error, message.data(), n);
+      slot->error[n] = 0;
+    });
+  }
+
+  /** block the calling thread until the slot is settled. returns the value or throws SharedSlotError */
+  template <typename T> T wait(SharedSlot<T>* slot) {
+    if(!slot->is_ready()){
+      slot->sleepers.fetch_add(1, std::memory_order_seq_cst);
+      std::uint32_t s;
+      while((s = slot->state.load(std::memory_order_seq_cst)) == SharedSlot<T>::pending || s == SharedSlot<T>::settling){
+        futex(&slot->state, FUTEX_WAIT, s);
+      }
+      slot->sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if(slot->state.load(std::memory_order_acquire) == SharedSlot<T>::rejected) throw SharedSlotError(slot->error);
+    return slot->value;
+  }
+
+  /**
+   * the slot as a promise, settled on `reactor`'s loop thread when the producer settles
+   * the slot. the reactor must run in this process
+   */
+  template <typename T> typename Promise<T>::sp promise(Reactor& reactor, SharedSlot<T>* slot) {
+    return Promise<>::create<T>([this, &reactor, slot](auto resolver){
+      /** the producer stores the state before it reads watchers: one of us sees the other */
+      slot->watchers.fetch_add(1, std::memory_order_seq_cst);
+      reactor.dispatch([this, &reactor, slot, resolver]{
+        watches_.push_back([slot, resolver]{
+          const auto s = slot->state.load(std::memory_order_seq_cst);
+          if(s == SharedSlot<T>::pending || s == SharedSlot<T>::settling) return false;
+          slot->watchers.fetch_sub(1, std::memory_order_relaxed);
+          if(s == SharedSlot<T>::fulfilled) resolver.resolve(slot->value);
+          else resolver.reject(std::make_exception_ptr(SharedSlotError(slot->error)));
+          return true;
+        });
+        poll(reactor);
+      });
+    });
+  }
+
+private:
+  SharedArena() = default;
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_shared_memory__) */
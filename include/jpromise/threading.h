@@ -0,0 +1,130 @@
+#if !defined(__h_threading__)
+#define __h_threading__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cassert>
+#include <cstddef>
+
+/**
+ * JPROMISE_SINGLE_THREADED and JPROMISE_METRICS change what a node is built from, so each
+ * combination declares everything in its own inline namespace: objects built in different
+ * modes fail to link together instead of mixing two layouts of Promise<T>
+ */
+#if defined(JPROMISE_SINGLE_THREADED) && defined(JPROMISE_METRICS)
+#define JPROMISE_ABI st_metrics_v1
+#elif defined(JPROMISE_SINGLE_THREADED)
+#define JPROMISE_ABI st_v1
+#elif defined(JPROMISE_METRICS)
+#define JPROMISE_ABI metrics_v1
+#else
+#define JPROMISE_ABI v1
+#endif
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * what a promise node is built from.
+ * with JPROMISE_SINGLE_THREADED every promise is created, settled and chained on
+ * one thread (an event loop):
+ *  - nodes are reference counted without atomic instructions (libstdc++, other
+ *    standard libraries keep std::shared_ptr)
+ *  - state and resolver counts are plain integers, the node has no mutex and no
+ *    condition variable
+ *  - without NDEBUG, taking a node's lock from another thread than the one that
+ *    created it asserts
+ */
+namespace detail {
+
+  /** std::atomic's interface over a plain value */
+  template <typename T> class plain_atomic {
+    T v_;
+  public:
+    constexpr plain_atomic(T v = T()) : v_(v) {}
+    T load(std::memory_order = std::memory_order_seq_cst) const { return v_; }
+    void store(T v, std::memory_order = std::memory_order_seq_cst) { v_ = v; }
+    T fetch_add(T n, std::memory_order = std::memory_order_seq_cst) { const T v = v_; v_ += n; return v; }
+    T fetch_sub(T n, std::memory_order = std::memory_order_seq_cst) { const T v = v_; v_ -= n; return v; }
+    operator T() const { return v_; }
+    plain_atomic& operator=(T v) { v_ = v; return *this; }
+  };
+
+  /**
+   * one byte test-and-test-and-set lock for the few instructions a node holds its lock.
+   * yields after a while: the holder may have been preempted.
+   */
+  class spin_mutex {
+    std::atomic<bool> locked_{false};
+  public:
+    void lock() {
+      for(int n = 0; locked_.exchange(true, std::memory_order_acquire); n++){
+        while(locked_.load(std::memory_order_relaxed)){
+          if(n++ >= 64) std::this_thread::yield();
+#if defined(__x86_64__) || defined(__i386__)
+          else __builtin_ia32_pause();
+#endif
+        }
+      }
+    }
+    bool try_lock() { return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire); }
+    void unlock() { locked_.store(false, std::memory_order_release); }
+  };
+
+  /** Lockable that does not lock. checks the owning thread in debug builds */
+  class thread_check_mutex {
+#if !defined(NDEBUG)
+    const std::thread::id owner_ = std::this_thread::get_id();
+#endif
+  public:
+    void check() const {
+#if !defined(NDEBUG)
+      assert(owner_ == std::this_thread::get_id() && "JPROMISE_SINGLE_THREADED: promise used from another thread");
+#endif
+    }
+    void lock() { check(); }
+    bool try_lock() { check(); return true; }
+    void unlock() {}
+  };
+
+#if defined(JPROMISE_SINGLE_THREADED)
+  template <typename T> using node_atomic = plain_atomic<T>;
+  using node_mutex = thread_check_mutex;
+#else
+  template <typename T> using node_atomic = std::atomic<T>;
+  using node_mutex = spin_mutex;
+#endif
+
+  /**
+   * size budget of PromiseBase: after a 16 byte shared_ptr control block and before
+   * a value of up to 16 bytes, it fits the first cache line of the node
+   */
+#if defined(JPROMISE_SINGLE_THREADED) && !defined(NDEBUG)
+  constexpr std::size_t node_hot_bytes = 40;   /** the owner thread id of the debug check */
+#else
+  constexpr std::size_t node_hot_bytes = 32;
+#endif
+
+#if defined(JPROMISE_SINGLE_THREADED) && defined(__GLIBCXX__)
+  template <typename T> using shared_ptr = std::__shared_ptr<T, __gnu_cxx::_S_single>;
+  template <typename T> using weak_ptr = std::__weak_ptr<T, __gnu_cxx::_S_single>;
+  template <typename T> using enable_shared_from_this = std::__enable_shared_from_this<T, __gnu_cxx::_S_single>;
+  template <typename T, typename ...ARGS> shared_ptr<T> make_shared(ARGS&& ...args) {
+    return std::__make_shared<T, __gnu_cxx::_S_single>(std::forward<ARGS>(args)...);
+  }
+#else
+  template <typename T> using shared_ptr = std::shared_ptr<T>;
+  template <typename T> using weak_ptr = std::weak_ptr<T>;
+  template <typename T> using enable_shared_from_this = std::enable_shared_from_this<T>;
+  template <typename T, typename ...ARGS> shared_ptr<T> make_shared(ARGS&& ...args) {
+    return std::make_shared<T>(std::forward<ARGS>(args)...);
+  }
+#endif
+
+} /** namespace detail */
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_threading__) */
@@ -0,0 +1,123 @@
+#if !defined(__h_timer__)
+#define __h_timer__
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include "threading.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * deadline scheduler used by the time based combinators.
+ * callbacks run on the timer's own thread(s), never on the caller's.
+ */
+class Timer {
+public:
+  using clock     = std::chrono::steady_clock;
+  using id_type   = std::uint64_t;
+  using task_fn   = std::function<void()>;
+
+  virtual ~Timer() = default;
+
+  virtual clock::time_point now() const { return clock::now(); }
+
+  /** run `task` at `when`, returns an id for cancel() */
+  virtual id_type at(clock::time_point when, task_fn task) = 0;
+
+  /** false if the task already ran or was never scheduled */
+  virtual bool cancel(id_type id) = 0;
+
+  id_type after(clock::duration delay, task_fn task) {
+    return at(now() + delay, std::move(task));
+  }
+
+  /** process wide timer backed by a single thread */
+  static Timer& shared();
+};
+
+/** all timers are serviced by one thread, whatever their number */
+class TimerThread : public Timer {
+private:
+  using key = std::pair<clock::time_point, id_type>;
+
+  std::mutex                                  mtx_;
+  std::condition_variable                     cond_;
+  std::map<key, task_fn>                      tasks_;
+  std::unordered_map<id_type, clock::time_point> deadlines_;
+  id_type                                     next_id_ = 1;
+  bool                                        stop_ = false;
+  std::thread                                 thread_;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while(!stop_){
+      if(tasks_.empty()){
+        cond_.wait(lock);
+        continue;
+      }
+      auto it = tasks_.begin();
+      if(clock::now() < it->first.first){
+        cond_.wait_until(lock, it->first.first);
+        continue;
+      }
+      auto task = std::move(it->second);
+      deadlines_.erase(it->first.second);
+      tasks_.erase(it);
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+public:
+  TimerThread() : thread_([this]{ run(); }) {}
+
+  ~TimerThread() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+      cond_.notify_all();
+    }
+    thread_.join();
+  }
+
+  virtual id_type at(clock::time_point when, task_fn task) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto id = next_id_++;
+    const bool bEarliest = tasks_.empty() || when < tasks_.begin()->first.first;
+    tasks_.emplace(key(when, id), std::move(task));
+    deadlines_.emplace(id, when);
+    if(bEarliest) cond_.notify_all();
+    return id;
+  }
+
+  virtual bool cancel(id_type id) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = deadlines_.find(id);
+    if(it == deadlines_.end()) return false;
+    tasks_.erase(key(it->second, id));
+    deadlines_.erase(it);
+    return true;
+  }
+
+  std::size_t size() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return tasks_.size();
+  }
+};
+
+inline Timer& Timer::shared() {
+  static TimerThread timer;
+  return timer;
+}
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_timer__) */
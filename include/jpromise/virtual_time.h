@@ -0,0 +1,147 @@
+#if !defined(__h_virtual_time__)
+#define __h_virtual_time__
+
+#include <map>
+#include <deque>
+#include <random>
+#include <limits>
+#include "jpromise.h"
+#include "executor.h"
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+/**
+ * manually driven clock, timer and executor for tests.
+ *  - now() only moves in advance() / advance_to() / run_all(), time passes instantly
+ *  - timer callbacks and posted tasks run on the thread that drives the clock
+ *  - tasks that are ready together run in FIFO order with seed 0, otherwise in
+ *    an order drawn from the seed: the same seed gives the same order every run
+ * tasks may be posted from any thread.
+ */
+class VirtualTimer : public Timer, public Executor, public Scheduler {
+private:
+  using key = std::pair<clock::time_point, id_type>;
+
+  mutable std::mutex                              mtx_;
+  clock::time_point                               now_;
+  std::map<key, Timer::task_fn>                   timers_;
+  std::unordered_map<id_type, clock::time_point>  deadlines_;
+  std::deque<Timer::task_fn>                      ready_;
+  id_type                                         next_id_ = 1;
+  const std::uint64_t                             seed_;
+  std::mt19937_64                                 rng_;
+
+  /** next ready task, empty if there is none */
+  Timer::task_fn pop_ready() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if(ready_.empty()) return {};
+    if(seed_ != 0 && ready_.size() > 1){
+      const auto i = std::uniform_int_distribution<std::size_t>(0, ready_.size() - 1)(rng_);
+      std::swap(ready_.front(), ready_[i]);
+    }
+    auto task = std::move(ready_.front());
+    ready_.pop_front();
+    return task;
+  }
+
+  /** move the timers due at the earliest deadline <= `limit` to the ready queue */
+  bool fire_next(clock::time_point limit) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if(timers_.empty() || timers_.begin()->first.first > limit) return false;
+    const auto when = timers_.begin()->first.first;
+    now_ = std::max(now_, when);
+    while(!timers_.empty() && timers_.begin()->first.first == when){
+      auto it = timers_.begin();
+      ready_.push_back(std::move(it->second));
+      deadlines_.erase(it->first.second);
+      timers_.erase(it);
+    }
+    return true;
+  }
+
+public:
+  /** `seed` = 0 runs simultaneous tasks in FIFO order */
+  explicit VirtualTimer(std::uint64_t seed = 0, clock::time_point start = clock::time_point()) :
+    now_(start), seed_(seed), rng_(seed) {}
+
+  virtual clock::time_point now() const override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return now_;
+  }
+
+  virtual id_type at(clock::time_point when, Timer::task_fn task) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const auto id = next_id_++;
+    timers_.emplace(key(when, id), std::move(task));
+    deadlines_.emplace(id, when);
+    return id;
+  }
+
+  virtual bool cancel(id_type id) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = deadlines_.find(id);
+    if(it == deadlines_.end()) return false;
+    timers_.erase(key(it->second, id));
+    deadlines_.erase(it);
+    return true;
+  }
+
+  /** runs at the current virtual time, from the next run_ready() */
+  virtual void post(Executor::task_fn task) override {
+    std::lock_guard<std::mutex> lock(mtx_);
+    ready_.push_back(std::move(task));
+  }
+
+  /** priority and deadline are not simulated, scheduled continuations are plain tasks */
+  virtual void post(const Schedule&, std::function<void()> task) override {
+    post(Executor::task_fn(std::move(task)));
+  }
+
+  /** Schedule for Promise<>::create() whose continuations run on this timer */
+  Schedule schedule(Priority priority = Priority::normal) {
+    return { .priority = priority, .deadline = clock::time_point::max(), .scheduler = this };
+  }
+
+  /** run tasks (and the tasks they post) until none is ready. returns the number run */
+  std::size_t run_ready() {
+    std::size_t n = 0;
+    while(auto task = pop_ready()){
+      task();
+      n++;
+    }
+    return n;
+  }
+
+  /** move the clock to `when`, firing every timer due on the way in deadline order */
+  std::size_t advance_to(clock::time_point when) {
+    auto n = run_ready();
+    while(fire_next(when)) n += run_ready();
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      now_ = std::max(now_, when);
+    }
+    return n;
+  }
+
+  std::size_t advance(clock::duration d) {
+    return advance_to(now() + d);
+  }
+
+  /** jump from timer to timer until nothing is left, at most `max_tasks` tasks */
+  std::size_t run_all(std::size_t max_tasks = std::numeric_limits<std::size_t>::max()) {
+    std::size_t n = run_ready();
+    while(n < max_tasks && fire_next(clock::time_point::max())) n += run_ready();
+    return n;
+  }
+
+  /** timers not yet fired plus ready tasks */
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return timers_.size() + ready_.size();
+  }
+};
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
+#endif /* !defined(__h_virtual_time__) */
@@ -0,0 +1,15 @@
+/** explicit instantiations declared extern by JPROMISE_EXTERN_TEMPLATES */
+#include <jpromise/jpromise.h>
+
+namespace JPromise {
+inline namespace JPROMISE_ABI {
+
+template class Promise<int>;
+template class Promise<std::string>;
+template class Promise<std::vector<char>>;
+template Promise<int>::sp Promise<int>::chain<int>(Promise<int>::on_value_fn<int>, Promise<int>::on_error_fn<int>);
+template Promise<std::string>::sp Promise<std::string>::chain<std::string>(Promise<std::string>::on_value_fn<std::string>, Promise<std::string>::on_error_fn<std::string>);
+template Promise<std::vector<char>>::sp Promise<std::vector<char>>::chain<std::vector<char>>(Promise<std::vector<char>>::on_value_fn<std::vector<char>>, Promise<std::vector<char>>::on_error_fn<std::vector<char>>);
+
+} /** inline namespace JPROMISE_ABI */
+} /** namespace JPromise */
@@ -1,7 +1,29 @@
 #include <iostream>
 #include <sstream>
 #include <array>
+#include <thread>
+#include <cassert>
+#include <fstream>
+#include <cmath>
 #include <jpromise/jpromise.h>
+#include <jpromise/async_cache.h>
+#include <jpromise/async_stream.h>
+#include <jpromise/batch_loader.h>
+#include <jpromise/reactor.h>
+#include <jpromise/file_io.h>
+#include <jpromise/executor.h>
+#include <jpromise/async_queue.h>
+#include <jpromise/async_sync.h>
+#include <jpromise/virtual_time.h>
+#include <jpromise/pipeline.h>
+#include <jpromise/shared_memory.h>
+#include <jpromise/async_scope.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 using namespace JPromise;
 
@@ -9,7 +31,24 @@ std::ostream& log() {
   return std::cout << std::this_thread::get_id() << " : ";
 }
 
+/** while set, setTimeout() schedules on this timer instead of sleeping in a thread */
+VirtualTimer* test_clock = nullptr;
+
+struct virtual_time {
+  VirtualTimer timer;
+  virtual_time(std::uint64_t seed = 0) : timer(seed) { test_clock = &timer; }
+  ~virtual_time() { test_clock = nullptr; }
+  void advance(std::chrono::milliseconds d) {
+    log() << "advance " << d.count() << " ms" << std::endl;
+    timer.advance(d);
+  }
+};
+
 void setTimeout(std::function<void()> f, int x) {
+  if(test_clock){
+    test_clock->after(std::chrono::milliseconds(x), f);
+    return;
+  }
   auto t = std::thread([f, x]{
     std::this_thread::sleep_for(std::chrono::milliseconds(x));
     f();
@@ -185,6 +224,8 @@ void test_5() {
     std::this_thread::sleep_for(std::chrono::seconds(2));
     log() << "wait 2sec" << std::endl;
 
+    /** dropping p would not stop the chain: it runs for as long as it can settle */
+    p->wait();
     log() << "#1 end" << std::endl;
   }
 
@@ -319,6 +360,7 @@ void test_9() {
 }
 
 void test_10() {
+  virtual_time vt;
   {
     auto p1 = pvalue(1, 900);
     auto p2 = pvalue<double>(1.23, 1200);
@@ -334,8 +376,10 @@ void test_10() {
       assert(std::get<2>(x) == "abc");
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::milliseconds(1199));
+    assert(p->state() == PromiseState::pending);
+    vt.advance(std::chrono::milliseconds(1));
+    assert(p->state() == PromiseState::fulfilled);
   }
   {
     auto p1 = pvalue(1, 1000);
@@ -349,8 +393,8 @@ void test_10() {
       }
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::seconds(2));
+    assert((p->wait() == std::vector<int>{ 1, 2, 3 }));
   }
 
   {
@@ -365,13 +409,14 @@ void test_10() {
       }
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::seconds(2));
+    assert(p->wait().size() == 10 && p->wait()[9] == 9);
   }
 }
 
 void test_11() {
   {
+    virtual_time vt;
     auto p1 = pvalue<std::string>("#1", 1000);
     auto p2 = pvalue<std::string>("#2", 600);
     auto p3 = pvalue<std::string>("#3", 400);
@@ -381,11 +426,13 @@ void test_11() {
       log() << x << std::endl;  /* x = "#3" */
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::seconds(2));
+    assert(p->wait() == "#3");
   }
 
-  {
+  /** all due at once: the winner is drawn from the seed, the same for the same seed */
+  auto race = [](std::uint64_t seed){
+    virtual_time vt(seed);
     std::array<Promise<int>::sp, 10> arr;
     for(int i = 0; i < arr.size(); i++){
       arr[i] = pvalue(i, 1000);
@@ -395,12 +442,15 @@ void test_11() {
       log() << x << std::endl; /* x = random */
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
-  }
+    vt.advance(std::chrono::seconds(2));
+    return p->wait();
+  };
+  assert(race(0) == 0);
+  assert(race(42) == race(42));
 }
 
 void test_12() {
+  virtual_time vt;
   auto p1 = pvalue<std::string>("#1", 100);
   auto p2 = pvalue<std::string>("#2", 600);
   auto p3 = pvalue<std::string>("#3", 300);
@@ -412,13 +462,16 @@ void test_12() {
       std::cout << state_to_string(*it) << ", ";
     }
     std::cout << std::endl;
+    assert(x[0] == (i >= 1 ? PromiseState::fulfilled : PromiseState::pending));
+    assert(x[1] == (i >= 6 ? PromiseState::fulfilled : PromiseState::pending));
+    assert(x[2] == (i >= 3 ? PromiseState::fulfilled : PromiseState::pending));
 
-    log() << "wait 100 ms" << std::endl;
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    vt.advance(std::chrono::milliseconds(100));
   }
 }
 
 void test_13() {
+  virtual_time vt;
   {
     std::array<Promise<int>::sp, 10> arr;
     for(int i = 0; i < arr.size(); i++){
@@ -433,9 +486,9 @@ void test_13() {
       }
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::seconds(2));
     log() << ss.str() << std::endl;
+    assert(ss.str() == "fulfilled, rejected, rejected, fulfilled, rejected, rejected, fulfilled, rejected, rejected, fulfilled, ");
   }
   {
     auto p1 = pvalue<std::string>("abc", 100);
@@ -452,14 +505,1398 @@ void test_13() {
       }
     });
 
-    log() << "wait 2 sec" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    vt.advance(std::chrono::seconds(2));
     log() << ss.str();
+    assert(ss.str() == "fulfilled, fulfilled, fulfilled, rejected, fulfilled, ");
+  }
+}
+
+void test_14() {
+  auto nCalls = std::make_shared<std::atomic<int>>(0);
+  AsyncCache<int, std::string> cache([nCalls](const int& key) -> Promise<std::string>::sp {
+    (*nCalls)++;
+    if(key < 0) return perror<std::string>("negative", 50);
+    return pvalue(std::to_string(key), 50);
+  }, { .capacity = 2, .ttl = std::chrono::milliseconds(200), .shards = 1 });
+
+  /** concurrent requests share one pending promise */
+  auto p1 = cache.get(1);
+  auto p2 = cache.get(1);
+  assert(p1 == p2);
+  assert(p1->wait() == "1");
+  assert(*nCalls == 1);
+
+  /** fulfilled value is served from the cache */
+  assert(cache.get(1)->wait() == "1");
+  assert(*nCalls == 1);
+
+  /** rejected entries are evicted immediately */
+  try{ cache.get(-1)->wait(); assert(false); } catch(test_error&){}
+  assert(cache.size() == 1);
+  try{ cache.get(-1)->wait(); assert(false); } catch(test_error&){}
+  assert(*nCalls == 3);
+
+  /** size bound */
+  cache.get(2)->wait();
+  cache.get(3)->wait();
+  assert(cache.size() == 2);
+
+  /** ttl */
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  const auto n = nCalls->load();
+  cache.get(3)->wait();
+  assert(*nCalls == n + 1);
+
+  auto st = cache.get_stats();
+  log() << "hits " << st.hits << ", coalesced " << st.coalesced << ", misses " << st.misses << std::endl;
+  assert(st.hits == 1 && st.coalesced == 1);
+
+  /** a factory that throws rejects the entry instead of leaving it pending */
+  int nThrown = 0;
+  AsyncCache<int, int> throwing([&nThrown](const int& key) -> Promise<int>::sp {
+    if(nThrown++ == 0) throw test_error("thrown");
+    return Promise<>::resolve(key);
+  });
+  try{ throwing.get(1)->wait(); assert(false); } catch(test_error&){}
+  assert(throwing.size() == 0);
+  assert(throwing.get(1)->wait() == 1 && nThrown == 2);
+}
+
+void test_15() {
+  /** producer is throttled by the bounded buffer */
+  auto s = AsyncStream<int>::create(4);
+  for(int i = 0; i < 4; i++){
+    assert(s->try_push(i));
+  }
+  assert(!s->try_push(4));
+  auto blocked = s->push(4);
+  assert(blocked->state() == PromiseState::pending);
+  auto b = s->next(2)->wait();
+  assert(b.size() == 2 && b[0] == 0 && b[1] == 1);
+  assert(blocked->wait());
+  s->close();
+  assert(!s->push(5)->wait());
+  assert(s->next(10)->wait().size() == 3);
+  assert(s->next()->wait().empty());
+
+  /** operators */
+  auto src = AsyncStream<int>::create(8);
+  auto sum = std::make_shared<int>(0);
+  auto done = src
+  ->filter([](const int& x){ return x % 2 == 0; })
+  ->map([](const int& x){ return std::to_string(x * 10); })
+  ->take(5)
+  ->for_each([sum](const std::string& x){
+    *sum += std::stoi(x);
+  });
+
+  std::thread producer([src]{
+    for(int i = 0; i < 100; i++){
+      if(!src->push(i)->wait()) break;
+    }
+    src->close();
+  });
+  assert(done->wait() == 5);
+  assert(*sum == (0 + 2 + 4 + 6 + 8) * 10);
+  producer.join();
+  log() << "sum " << *sum << std::endl;
+
+  /** errors propagate to for_each() */
+  auto e = AsyncStream<int>::create();
+  auto p = e->map([](const int& x){ return x; })->for_each([](const int&){});
+  e->push(1);
+  e->fail(std::make_exception_ptr(test_error("stream")));
+  try{ p->wait(); assert(false); } catch(test_error& err){ log() << err.what() << std::endl; }
+}
+
+void test_16() {
+  auto calls = std::make_shared<std::vector<std::vector<int>>>();
+  auto fn = [calls](const std::vector<int>& keys) -> Promise<std::vector<std::string>>::sp {
+    calls->push_back(keys);
+    std::vector<std::string> values;
+    for(auto k : keys){
+      if(k < 0) return perror<std::vector<std::string>>("negative", 10);
+      values.push_back(std::to_string(k));
+    }
+    return pvalue(values, 10);
+  };
+
+  {
+    /** keys requested before dispatch() go to one batch call */
+    BatchLoader<int, std::string> loader(fn);
+    auto p1 = loader.load(1);
+    auto p2 = loader.load(2);
+    auto p3 = loader.load(1);
+    assert(p1 == p3);
+    auto pm = loader.load_many({3, 4});
+    assert(calls->empty());
+    loader.dispatch();
+    assert(calls->size() == 1 && calls->back().size() == 4);
+    assert(p1->wait() == "1");
+    assert(p2->wait() == "2");
+    assert(pm->wait()[1] == "4");
+  }
+
+  {
+    /** max_batch flushes immediately */
+    calls->clear();
+    BatchLoader<int, std::string> loader(fn, { .max_batch = 2 });
+    auto p1 = loader.load(1);
+    auto p2 = loader.load(2);
+    auto p3 = loader.load(3);
+    assert(calls->size() == 1);
+    loader.dispatch();
+    assert(calls->size() == 2);
+    assert(p3->wait() == "3");
+    assert(loader.batches() == 2);
+  }
+
+  {
+    /** scheduled dispatch, rejection is fanned out to every key of the batch */
+    calls->clear();
+    BatchLoader<int, std::string> loader(fn, {
+      .max_batch = 100,
+      .schedule = [](std::function<void()> f){ setTimeout(f, 20); }
+    });
+    auto p1 = loader.load(1);
+    auto p2 = loader.load(-1);
+    try{ p1->wait(); assert(false); } catch(test_error& e){ log() << e.what() << std::endl; }
+    try{ p2->wait(); assert(false); } catch(test_error&){}
+    assert(calls->size() == 1);
+  }
+}
+
+void test_17() {
+  {
+    /** fulfilled on the 3rd attempt */
+    auto n = std::make_shared<std::atomic<int>>(0);
+    const auto t0 = std::chrono::steady_clock::now();
+    auto p = Promise<>::retry({ .max_attempts = 5, .initial_delay = std::chrono::milliseconds(50), .jitter = 0 }, [n](){
+      const int x = ++(*n);
+      return x < 3 ? perror<int>("retry", 10) : pvalue(x, 10);
+    });
+    /** the caller is not blocked by the backoff */
+    assert(p->state() == PromiseState::pending);
+    assert(p->wait() == 3);
+    const auto elapsed = std::chrono::steady_clock::now() - t0;
+    log() << "attempts " << *n << ", " << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms" << std::endl;
+    assert(elapsed >= std::chrono::milliseconds(150)); /* 50ms + 100ms backoff */
+  }
+  {
+    /** gives up after max_attempts */
+    auto n = std::make_shared<std::atomic<int>>(0);
+    auto p = Promise<>::retry({ .max_attempts = 4, .initial_delay = std::chrono::milliseconds(1) }, [n](){
+      (*n)++;
+      return perror<std::string>("always");
+    });
+    try{ p->wait(); assert(false); } catch(test_error& e){ log() << e.what() << std::endl; }
+    assert(*n == 4);
+  }
+  {
+    /** non retriable errors are not retried, thrown errors are retriable */
+    auto n = std::make_shared<std::atomic<int>>(0);
+    RetryPolicy policy;
+    policy.initial_delay = std::chrono::milliseconds(1);
+    policy.retriable = [](std::exception_ptr e, std::size_t){ return error_to_string(e) != "fatal"; };
+    auto p = Promise<>::retry(policy, [n]() -> Promise<int>::sp {
+      if(++(*n) == 1) throw test_error("transient");
+      return perror<int>("fatal");
+    });
+    try{ p->wait(); assert(false); } catch(test_error& e){ assert(std::string(e.what()) == "fatal"); }
+    assert(*n == 2);
+  }
+}
+
+void test_18() {
+  Reactor reactor;
+  std::thread loop([&]{ reactor.run(); });
+
+  {
+    /** pipe: the read is parked until the write arrives, and settled on the loop thread */
+    int fds[2];
+    assert(::pipe(fds) == 0);
+    char buf[16] = {};
+    auto r = reactor.async_read(fds[0], buf, sizeof(buf))
+    ->then([&](const std::size_t& n){
+      assert(reactor.in_loop_thread());
+      return n;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(r->state() == PromiseState::pending);
+    assert(reactor.async_write(fds[1], "hello", 5)->wait() == 5);
+    assert(r->wait() == 5 && std::string(buf, 5) == "hello");
+    ::close(fds[1]);
+    assert(reactor.async_read(fds[0], buf, sizeof(buf))->wait() == 0); /* EOF */
+    ::close(fds[0]);
+  }
+
+  {
+    /** socketpair: large write completes across several writability events */
+    int sv[2];
+    assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    std::vector<char> out(1 << 20, 'x'), in(out.size());
+    auto w = reactor.async_write(sv[0], out.data(), out.size());
+    std::size_t got = 0;
+    while(got < in.size()){
+      const auto n = reactor.async_read(sv[1], in.data() + got, in.size() - got)->wait();
+      assert(n > 0);
+      got += n;
+    }
+    assert(w->wait() == out.size() && in == out);
+
+    /** cancel_fd() rejects parked operations */
+    auto pending = reactor.async_read(sv[1], in.data(), in.size());
+    reactor.cancel_fd(sv[1]);
+    try{ pending->wait(); assert(false); } catch(std::system_error& e){ assert(e.code().value() == ECANCELED); }
+    ::close(sv[0]);
+    ::close(sv[1]);
+  }
+
+  {
+    /** loopback TCP echo */
+    const int ls = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(::bind(ls, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    ::getsockname(ls, reinterpret_cast<sockaddr*>(&addr), &len);
+    assert(::listen(ls, 16) == 0);
+
+    char sbuf[64], cbuf[64] = {};
+    auto server = reactor.async_accept(ls)
+    ->then([&](const int& s){
+      return reactor.async_read(s, sbuf, sizeof(sbuf))
+      ->then([&, s](const std::size_t& n){
+        return reactor.async_write(s, sbuf, n);
+      })
+      ->finally([s](){ ::close(s); });
+    });
+
+    const int cs = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto client = reactor.async_connect(cs, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+    ->then([&](const int& s){
+      return reactor.async_write(s, "ping", 4);
+    })
+    ->then([&](const std::size_t&){
+      return reactor.async_read(cs, cbuf, sizeof(cbuf));
+    });
+    assert(client->wait() == 4 && std::string(cbuf, 4) == "ping");
+    server->wait();
+    ::close(cs);
+
+    /** connect to a closed port is rejected */
+    ::close(ls);
+    const int bad = ::socket(AF_INET, SOCK_STREAM, 0);
+    try{
+      reactor.async_connect(bad, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))->wait();
+      assert(false);
+    }
+    catch(std::system_error& e){ log() << e.what() << std::endl; }
+    ::close(bad);
+  }
+
+  {
+    /** timers run on the loop thread */
+    const auto t0 = std::chrono::steady_clock::now();
+    auto p = Promise<>::create<bool>([&](auto resolver){
+      reactor.after(std::chrono::milliseconds(30), [&, resolver](){
+        resolver.resolve(reactor.in_loop_thread());
+      });
+    });
+    assert(p->wait());
+    assert(std::chrono::steady_clock::now() - t0 >= std::chrono::milliseconds(30));
+  }
+
+  reactor.stop();
+  loop.join();
+}
+
+void test_19() {
+  char path[] = "/tmp/jpromise_test_XXXXXX";
+  const int fd = ::mkstemp(path);
+  assert(fd >= 0);
+  ::unlink(path);
+
+  for(auto force : {false, true}){
+    FileIo io({ .queue_depth = 8, .threads = 2, .force_thread_pool = force });
+    log() << (io.uses_io_uring() ? "io_uring" : "thread pool") << std::endl;
+
+    /** batched writes, more than the queue depth */
+    std::vector<std::string> blocks;
+    std::vector<Promise<std::size_t>::sp> ws;
+    io.cork();
+    for(int i = 0; i < 32; i++){
+      blocks.push_back(std::string(100, static_cast<char>('a' + i % 26)));
+    }
+    for(int i = 0; i < 32; i++){
+      ws.push_back(io.write(fd, blocks[i].data(), blocks[i].size(), i * 100));
+    }
+    io.uncork();
+    for(auto& w : ws) assert(w->wait() == 100);
+
+    char buf[100];
+    assert(io.read(fd, buf, sizeof(buf), 300)->wait() == 100);
+    assert(std::string(buf, 100) == blocks[3]);
+    assert(io.read(fd, buf, sizeof(buf), 3200)->wait() == 0); /* EOF */
+
+    /** registered buffers */
+    std::vector<char> fixed(4096);
+    io.register_buffers({ iovec{ fixed.data(), fixed.size() } });
+    assert(io.read_fixed(fd, 0, 200, 500, 1000)->wait() == 200);
+    assert(std::string(fixed.data() + 1000, 100) == blocks[5]);
+    std::memcpy(fixed.data(), "fixed", 5);
+    assert(io.write_fixed(fd, 0, 5, 3200)->wait() == 5);
+    assert(io.read(fd, buf, sizeof(buf), 3200)->wait() == 5);
+
+    /** errors are rejected with the errno */
+    try{ io.read(-1, buf, sizeof(buf), 0)->wait(); assert(false); }
+    catch(std::system_error& e){ assert(e.code().value() == EBADF); }
+    ::ftruncate(fd, 0);
+  }
+  ::close(fd);
+}
+
+void test_20() {
+  ThreadPool pool(4);
+  {
+    /** tasks from several producers never overlap and keep per-producer order */
+    Strand strand(pool, 16);
+    const int nProducers = 4;
+    const int nTasks = 10000;
+    auto active = std::make_shared<std::atomic<bool>>(false);
+    auto last = std::make_shared<std::array<int, nProducers>>();
+    last->fill(-1);
+    auto remain = std::make_shared<std::atomic<int>>(nProducers * nTasks);
+    auto done = Promise<>::create<bool>([&](auto resolver){
+      std::vector<std::thread> producers;
+      for(int p = 0; p < nProducers; p++){
+        producers.emplace_back([&, p, resolver]{
+          for(int i = 0; i < nTasks; i++){
+            strand.post([active, last, remain, p, i, resolver]{
+              assert(!active->exchange(true));
+              assert((*last)[p] == i - 1);
+              (*last)[p] = i;
+              active->store(false);
+              if(--(*remain) == 0) resolver.resolve(true);
+            });
+          }
+        });
+      }
+      for(auto& t : producers) t.join();
+    });
+    assert(done->wait());
+  }
+
+  {
+    /** then / error / finally callbacks on a strand */
+    Strand strand(pool);
+    auto counter = std::make_shared<int>(0);  /* only touched on the strand, no lock */
+    std::vector<Promise<int>::sp> ps;
+    for(int i = 0; i < 100; i++){
+      ps.push_back(
+        pvalue(i, i % 3)
+        ->then(strand.wrap([counter](const int& x){
+          (*counter)++;
+          return x * 2;
+        }))
+        ->then(strand.wrap([counter](const int& x){
+          (*counter)++;
+          if(x == 20) throw test_error("20");
+        }))
+        ->error(strand.wrap([counter](std::exception_ptr){
+          (*counter)++;
+          return -1;
+        }))
+        ->finally(strand.wrap([counter](){
+          (*counter)++;
+          return Promise<>::resolve(*counter);
+        }))
+      );
+    }
+    for(auto& p : ps) p->wait();
+    auto total = strand.run([counter](){ return *counter; })->wait();
+    log() << "counter " << total << std::endl;
+    assert(total == 100 * 3 + 1);
+  }
+}
+
+void test_21() {
+  auto seen = std::make_shared<std::vector<int>>();
+  auto r = pvalue(1, 10)
+  ->pipe(
+    stage::map([](const int& x){ return x + 1; }),
+    stage::tap([seen](const int& x){ seen->push_back(x); }),
+    stage::map([](const int& x){ return std::to_string(x); }),
+    stage::map([](const std::string& x){ return x + "!"; })
+  )
+  ->wait();
+  assert(r == "2!");
+  assert(seen->size() == 1 && seen->front() == 2);
+
+  /** async boundary in the middle */
+  auto r2 = pvalue(1)
+  ->pipe(
+    stage::map([](const int& x){ return x * 10; }),
+    stage::map([](const int& x){ return pvalue(x + 1, 10); }),
+    stage::map([](const int& x){ return x * 2; }),
+    stage::map([seen](const int& x){ seen->push_back(x); })
+  )
+  ->wait();
+  assert(r2 == 22);
+  assert(seen->back() == 22);
+
+  /** errors skip the remaining stages */
+  pvalue(1)
+  ->pipe(
+    stage::map([](const int&) -> int { throw test_error("pipe"); }),
+    stage::tap([](const int&){ assert(false); })
+  )
+  ->error([](std::exception_ptr e){
+    log() << error_to_string(e) << std::endl;
+  });
+}
+
+void test_22() {
+  /** a throwing value callback rejects, also when the source settles later */
+  auto r = pvalue(1, 10)
+  ->then([](const int&) -> int { throw test_error("then"); })
+  ->then([](const int&){ assert(false); })
+  ->error([](std::exception_ptr e){ return error_to_string(e).size() > 0 ? 2 : 0; })
+  ->wait();
+  assert(r == 2);
+
+  /** every callback kind through the shared core */
+  auto s = pvalue(1)
+  ->then([](const int& x){ return std::to_string(x); })
+  ->then([](const std::string&){})
+  ->then([](const std::string& x){ return pvalue(x + "2", 10); })
+  ->finally([](){})
+  ->error([](std::exception_ptr){})
+  ->wait();
+  assert(s == "12");
+
+  auto f = perror<int>("finally", 10)
+  ->finally([](){ return pvalue(std::string("recovered"), 10); })
+  ->wait();
+  assert(f == "recovered");
+
+  /** resolving twice is ignored */
+  auto twice = Promise<>::create<int>([](auto resolver){
+    resolver.resolve(1);
+    resolver.resolve(2);
+    resolver.reject(std::make_exception_ptr(test_error("late")));
+  });
+  assert(twice->wait() == 1);
+}
+
+void test_23() {
+  PriorityScheduler sched(1);
+  std::promise<void> gate;
+  auto opened = gate.get_future().share();
+  sched.post([opened]{ opened.wait(); }); /** hold the only worker */
+
+  auto order = std::make_shared<std::vector<std::string>>();
+  auto mtx = std::make_shared<std::mutex>();
+  auto chain = [&](const char* name, Schedule s){
+    return Promise<>::create<std::string>(s, [name](auto resolver){ resolver.resolve(std::string(name)); })
+    ->then([order, mtx](const std::string& x){
+      std::lock_guard<std::mutex> lock(*mtx);
+      order->push_back(x);
+      return x;
+    })
+    ->then([](const std::string& x){ return x + "!"; });
+  };
+  const auto now = Timer::clock::now();
+  auto bg   = chain("bg",   sched.schedule(Priority::background));
+  auto late = chain("late", sched.schedule(Priority::normal, now + std::chrono::seconds(2)));
+  auto soon = chain("soon", sched.schedule(Priority::normal, now + std::chrono::seconds(1)));
+  auto ui   = chain("ui",   sched.schedule(Priority::interactive));
+  assert(bg->schedule().priority == Priority::background);
+  assert(ui->schedule().scheduler == &sched);
+  assert(bg->state() == PromiseState::pending);
+
+  gate.set_value();
+  assert(ui->wait() == "ui!");
+  assert(bg->wait() == "bg!");
+  assert(late->wait() == "late!" && soon->wait() == "soon!");
+  assert((*order == std::vector<std::string>{ "ui", "soon", "late", "bg" }));
+
+  /** errors travel through the scheduler too */
+  auto e = Promise<>::create<int>(sched.schedule(Priority::interactive), [](auto resolver){
+    resolver.reject(std::make_exception_ptr(test_error("scheduled")));
+  })
+  ->error([](std::exception_ptr){ return 1; })
+  ->wait();
+  assert(e == 1);
+}
+
+void test_24() {
+  /** a long chain is released without recursing once per node */
+  {
+    auto tail = Promise<>::create<int>([](auto){});
+    for(int i = 0; i < 500000; i++){
+      tail = tail->then([](const int& x){ return x + 1; });
+    }
+  }
+  {
+    std::shared_ptr<Promise<int>::resolver> r;
+    auto p = Promise<>::create<int>([&](auto resolver){ r = std::make_shared<Promise<int>::resolver>(resolver); });
+    auto tail = p;
+    for(int i = 0; i < 1000; i++){
+      tail = tail->then([](const int& x){ return x + 1; });
+    }
+    p.reset();
+    r->resolve(0);
+    assert(tail->wait() == 1000);
+  }
+
+  /** the tail keeps the chain alive, dropping it detaches the chain */
+  Promise<int>::wp head;
+  {
+    auto p = Promise<>::create<int>([](auto){});
+    head = p;
+    auto tail = p->then([](const int& x){ return x; })->then([](const int& x){ return x; });
+    p.reset();
+    assert(!head.expired());
+  }
+  assert(head.expired());
+
+  /** stand_alone keeps a pending promise alive until it settles */
+  auto hit = std::make_shared<std::atomic<int>>(0);
+  pvalue(1, 10)->then([hit](const int& x){ *hit = x; })->stand_alone();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  assert(*hit == 1);
+}
+
+void test_25() {
+  /** polling */
+  auto p = pvalue(std::string("ready"), 20);
+  assert(!p->is_ready());
+  assert(p->try_get() == nullptr);
+  std::string out;
+  assert(!p->try_take(out));
+  while(!p->is_ready()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  assert(*p->try_get() == "ready");
+  assert(p->try_take(out) && out == "ready");
+
+  auto e = Promise<>::reject<int>(std::make_exception_ptr(test_error("polled")));
+  assert(e->is_ready());
+  try{
+    e->try_get();
+    assert(false);
+  }
+  catch(const test_error&){}
+
+  /** ready fast path: settled synchronously, same results as the pending path */
+  auto ready = Promise<>::resolve(1);
+  auto t = ready->then([](const int& x){ return x + 1; });
+  assert(t->is_ready() && *t->try_get() == 2);
+  auto v = ready->then([](const int&){});
+  assert(*v->try_get() == 1);
+  auto thrown = ready->then([](const int&) -> int { throw test_error("ready"); });
+  assert(thrown->state() == PromiseState::rejected);
+  auto recovered = e->error([](std::exception_ptr){ return 5; });
+  assert(*recovered->try_get() == 5);
+  auto passed = e->then([](const int&){ assert(false); return 0; });
+  assert(passed->state() == PromiseState::rejected);
+  auto adopted = ready->then([](const int& x){ return pvalue(x + 10, 10); });
+  assert(!adopted->is_ready());
+  assert(adopted->wait() == 11);
+}
+
+void test_26() {
+  const int n = 100;
+  auto sum = std::make_shared<std::atomic<int>>(0);
+  std::vector<Promise<int>::resolver> rs;
+  std::vector<Promise<int>::sp> tails;
+  for(int i = 0; i < n; i++){
+    auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+    tails.push_back(p->then([sum](const int& x){ *sum += x; return x; }));
+  }
+
+  {
+    CompletionBatch batch;
+    for(int i = 0; i < n; i++) assert(batch.resolve(rs[i], i));
+    assert(!batch.resolve(rs[0], 1));   /** settled already */
+    assert(batch.size() == static_cast<std::size_t>(n));
+    assert(*sum == 0);                  /** continuations wait for flush() */
+    batch.flush();
+  }
+  assert(*sum == n * (n - 1) / 2);
+  for(int i = 0; i < n; i++) assert(tails[i]->wait() == i);
+
+  /** flushed to an executor in chunks, rejections included */
+  rs.clear();
+  tails.clear();
+  auto nRejected = std::make_shared<std::atomic<int>>(0);
+  for(int i = 0; i < n; i++){
+    auto p = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+    tails.push_back(p->error([nRejected](std::exception_ptr) -> int { (*nRejected)++; return -1; }));
+  }
+  {
+    ThreadPool pool(2);
+    CompletionBatch batch;
+    for(int i = 0; i < n; i++){
+      if(i % 2) batch.reject(rs[i], std::make_exception_ptr(test_error("batch")));
+      else batch.resolve(rs[i], i);
+    }
+    batch.flush(pool, 10);
+  }
+  assert(*nRejected == n / 2);
+  assert(tails[1]->wait() == -1 && tails[2]->wait() == 2);
+
+  /** Promise<>::resolve_all */
+  rs.clear();
+  std::vector<Promise<std::string>::resolver> srs;
+  auto a = Promise<>::create<std::string>([&](auto resolver){ srs.push_back(resolver); });
+  auto b = Promise<>::create<std::string>([&](auto resolver){ srs.push_back(resolver); });
+  Promise<>::resolve_all(srs, std::vector<std::string>{ "a", "b" });
+  assert(a->wait() == "a" && b->wait() == "b");
+}
+
+void test_27() {
+  AsyncQueue<int> q(3);
+  assert(q.capacity() == 4);
+
+  /** ready item: fulfilled at once */
+  assert(q.try_push(1));
+  auto a = q.pop();
+  assert(a->is_ready() && a->wait() == 1);
+
+  /** waiting consumer gets the next push */
+  auto b = q.pop();
+  assert(!b->is_ready());
+  assert(q.push(2)->wait());
+  assert(b->wait() == 2);
+
+  /** backpressure */
+  for(int i = 0; i < 4; i++) assert(q.try_push(10 + i));
+  assert(!q.try_push(99));
+  auto full = q.push(14);
+  assert(!full->is_ready());
+  assert(q.pop()->wait() == 10);
+  assert(full->wait());
+  for(int i = 11; i <= 14; i++) assert(q.pop()->wait() == i);
+
+  /** close: producers refused, consumers rejected once drained */
+  auto c = q.pop();
+  assert(q.try_push(20));
+  assert(c->wait() == 20);
+  auto d = q.pop();
+  q.close();
+  assert(!q.push(21)->wait());
+  try{
+    d->wait();
+    assert(false);
+  }
+  catch(const AsyncQueue<int>::closed_error&){}
+
+  /** many producers / consumers */
+  AsyncQueue<int> mq(16);
+  const int nThreads = 4, nItems = 20000;
+  std::atomic<long long> sum{0};
+  std::vector<std::thread> ts;
+  for(int t = 0; t < nThreads; t++){
+    ts.emplace_back([&, t]{
+      for(int i = t; i < nItems; i += nThreads) mq.push(i)->wait();
+    });
+    ts.emplace_back([&]{
+      for(int i = 0; i < nItems / nThreads; i++) sum += mq.pop()->wait();
+    });
+  }
+  for(auto& t : ts) t.join();
+  assert(sum == static_cast<long long>(nItems) * (nItems - 1) / 2);
+  assert(mq.size() == 0);
+}
+
+void test_28() {
+  /** FIFO hand-over, no barging */
+  AsyncMutex m;
+  auto g1 = m.acquire();
+  assert(g1->is_ready() && m.locked());
+  std::vector<int> order;
+  std::vector<Promise<AsyncMutex::Guard>::sp> waiting;
+  for(int i = 0; i < 5; i++){
+    waiting.push_back(m.acquire()->then([&order, i](const AsyncMutex::Guard& g){
+      order.push_back(i);
+      g.release();
+    }));
+  }
+  assert(!m.try_acquire());
+  assert(m.waiting() == 5);
+  g1->wait().release();
+  assert((order == std::vector<int>{ 0, 1, 2, 3, 4 }));
+  assert(!m.locked());
+
+  /** the last copy of a guard gives the permit back */
+  {
+    auto g = m.try_acquire();
+    assert(g && m.locked());
+  }
+  assert(!m.locked());
+
+  /** a long queue of waiters resumed by releases inside continuations does not recurse */
+  AsyncMutex deep;
+  auto first = deep.try_acquire();
+  int nRun = 0;
+  for(int i = 0; i < 200000; i++){
+    deep.acquire()->then([&nRun](const AsyncMutex::Guard& g){ nRun++; g.release(); })->stand_alone();
+  }
+  first.release();
+  assert(nRun == 200000);
+
+  /** semaphore: at most N concurrent, run() releases when the promise settles */
+  AsyncSemaphore sem(3);
+  ThreadPool pool(4);
+  std::atomic<int> nActive{0}, nMax{0};
+  std::vector<Promise<int>::sp> ps;
+  for(int i = 0; i < 40; i++){
+    ps.push_back(sem.run([&, i]{
+      return Promise<>::create<int>([&, i](auto resolver){
+        pool.post([&, i, resolver]{
+          const auto n = ++nActive;
+          auto m = nMax.load();
+          while(n > m && !nMax.compare_exchange_weak(m, n));
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          nActive--;
+          resolver.resolve(i);
+        });
+      });
+    }));
+  }
+  for(int i = 0; i < 40; i++) assert(ps[i]->wait() == i);
+  assert(nMax <= 3 && sem.available() == 3);
+
+  /** a throwing callback releases too */
+  try{
+    sem.run([]() -> int { throw test_error("boom"); })->wait();
+    assert(false);
+  }
+  catch(const test_error&){}
+  assert(sem.available() == 3);
+  try{
+    sem.acquire(4)->wait();
+    assert(false);
+  }
+  catch(const std::invalid_argument&){}
+
+  /** rate limiter: the burst at once, then `rate` per second, in FIFO order */
+  AsyncRateLimiter rl(200.0, 5);
+  const auto t0 = std::chrono::steady_clock::now();
+  std::vector<int> rorder;
+  std::mutex rmtx;
+  std::vector<Promise<bool>::sp> rs;
+  for(int i = 0; i < 25; i++){
+    rs.push_back(rl.run([&, i]{
+      std::lock_guard<std::mutex> lock(rmtx);
+      rorder.push_back(i);
+    }));
+  }
+  for(auto& r : rs) r->wait();
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+  log() << "rate limiter: 25 acquisitions in " << ms << " ms" << std::endl;
+  assert(ms >= 90); /** 20 tokens beyond the burst at 200/s */
+  for(int i = 0; i < 25; i++) assert(rorder[i] == i);
+
+  /** no tokens would ever accrue */
+  for(double rate : { 0.0, -1.0, std::nan("") }){
+    try{ AsyncRateLimiter bad(rate, 1); assert(false); } catch(const std::invalid_argument&){}
+  }
+}
+
+struct metrics_tag {
+  int x;
+};
+
+void test_29() {
+  /** bucket bounds: monotone, within 1/16 of the value */
+  using H = Metrics::Histogram;
+  std::size_t last = 0;
+  for(std::uint64_t v = 1; v < (std::uint64_t(1) << 40); v = v * 3 / 2 + 1){
+    const auto b = H::bucket(v);
+    assert(b >= last && b < H::nBuckets);
+    assert(H::lower_bound(b) <= v && v - H::lower_bound(b) <= v / 16);
+    last = b;
+  }
+  assert(H::bucket(~std::uint64_t(0)) == H::nBuckets - 1);
+
+#if defined(JPROMISE_METRICS)
+  auto& m = Metrics::shared();
+  {
+    std::vector<Promise<metrics_tag>::resolver> rs;
+    auto a = Promise<>::create<metrics_tag>([&](auto resolver){ rs.push_back(resolver); });
+    auto b = a->then([](const metrics_tag& t){ return metrics_tag{ t.x + 1 }; });
+    auto c = Promise<>::resolve(metrics_tag{ 1 });
+    auto s = m.stats<metrics_tag>();
+    assert(s.created == 3 && s.fulfilled == 1 && s.pending() == 2 && s.live() == 3);
+    rs[0].resolve(metrics_tag{ 1 });
+    assert(b->wait().x == 2);
+    s = m.stats<metrics_tag>();
+    assert(s.fulfilled == 3 && s.pending() == 0);
+    Promise<>::create<metrics_tag>([](auto){});
+    s = m.stats<metrics_tag>();
+    assert(s.abandoned == 1 && s.live() == 3);
+  }
+  assert(m.stats<metrics_tag>().live() == 0);
+
+  /** one event in sample_every is timed */
+  for(std::uint32_t i = 0; i < Metrics::sample_every * 4; i++){
+    Promise<>::resolve(metrics_tag{ 0 })->then([](const metrics_tag&){});
+  }
+  auto snap = m.snapshot();
+  assert(snap.pending_ns.count > 0 && snap.callback_ns.count > 0 && snap.handlers.count > 0);
+
+  /** queue depth of a blocked pool */
+  {
+    ThreadPool pool(1);
+    std::promise<void> gate;
+    auto opened = gate.get_future().share();
+    pool.post([opened]{ opened.wait(); });
+    while(pool.queued() > 0) std::this_thread::yield();
+    for(int i = 0; i < 3; i++) pool.post([]{});
+    snap = m.snapshot();
+    auto it = std::find_if(snap.queues.begin(), snap.queues.end(), [](const Metrics::QueueDepth& q){
+      return q.name.compare(0, 11, "ThreadPool/") == 0 && q.depth == 3;
+    });
+    assert(it != snap.queues.end());
+    gate.set_value();
+  }
+  const auto text = m.snapshot().to_text();
+  assert(text.find("jpromise_promises_created_total{type=\"metrics_tag\"}") != std::string::npos);
+  log() << "metrics:\n" << text.substr(0, text.find("jpromise_pending_seconds_sum")) << std::endl;
+#else
+  assert(Metrics::shared().snapshot().queues.empty());
+#endif
+}
+
+void test_30() {
+  using ms = std::chrono::milliseconds;
+
+  /** timers fire in deadline order, cancel() removes them, time jumps */
+  VirtualTimer vt;
+  const auto t0 = vt.now();
+  std::vector<int> fired;
+  vt.after(ms(30), [&]{ fired.push_back(30); });
+  const auto id = vt.after(ms(20), [&]{ fired.push_back(20); });
+  vt.after(ms(10), [&]{
+    fired.push_back(10);
+    vt.after(ms(5), [&]{ fired.push_back(15); });
+  });
+  assert(vt.cancel(id) && !vt.cancel(id));
+  vt.advance(ms(16));
+  assert((fired == std::vector<int>{ 10, 15 }) && vt.now() - t0 == ms(16));
+  assert(vt.run_all() == 1 && fired.back() == 30 && vt.now() - t0 == ms(30));
+
+  /** retry backoff on virtual time */
+  int nAttempts = 0;
+  RetryPolicy policy;
+  policy.max_attempts = 4;
+  policy.initial_delay = ms(100);
+  policy.jitter = 0;
+  policy.timer = &vt;
+  auto r = Promise<>::retry(policy, [&]{
+    return ++nAttempts < 4 ? perror<int>("again") : pvalue(nAttempts);
+  });
+  vt.advance(ms(299));
+  assert(nAttempts == 2);     /** 100 ms, then 200 ms */
+  vt.advance(ms(1 + 400));
+  assert(nAttempts == 4 && r->wait() == 4);
+
+  /** rate limiter on virtual time */
+  AsyncRateLimiter rl(10.0, 1, &vt);
+  std::vector<Promise<AsyncRateLimiter::Guard>::sp> gs;
+  for(int i = 0; i < 5; i++) gs.push_back(rl.acquire());
+  assert(gs[0]->is_ready() && !gs[1]->is_ready());
+  vt.advance(ms(100));
+  assert(gs[1]->is_ready() && !gs[2]->is_ready());
+  vt.advance(ms(300));
+  assert(gs[4]->is_ready());
+
+  /** scheduled continuations are tasks on the virtual timer, ordered by the seed */
+  auto order = [](std::uint64_t seed){
+    VirtualTimer v(seed);
+    std::vector<int> out;
+    std::vector<Promise<int>::sp> ps;
+    for(int i = 0; i < 8; i++){
+      ps.push_back(Promise<>::create<int>(v.schedule(), [i](auto resolver){ resolver.resolve(i); })
+        ->then([&out](const int& x){ out.push_back(x); }));
+    }
+    assert(out.empty());
+    v.run_ready();
+    return out;
+  };
+  assert((order(0) == std::vector<int>{ 0, 1, 2, 3, 4, 5, 6, 7 }));
+  assert(order(7) == order(7));
+  bool bShuffled = false;
+  for(std::uint64_t seed = 1; seed < 10 && !bShuffled; seed++) bShuffled = order(seed) != order(0);
+  assert(bShuffled);
+}
+
+void test_31() {
+  /** arrival order, not input order */
+  {
+    virtual_time vt;
+    std::vector<Promise<int>::sp> ps = { pvalue(1, 300), pvalue(2, 100), pvalue(3, 200) };
+    std::vector<std::pair<int, std::size_t>> seen;
+    auto done = Promise<>::as_completed(ps.begin(), ps.end(), [&](const int& x, std::size_t i){
+      seen.push_back({ x, i });
+    });
+    vt.advance(std::chrono::milliseconds(150));
+    assert(seen.size() == 1 && seen[0].first == 2 && seen[0].second == 1);
+    assert(!done->is_ready());
+    auto folded = Promise<>::reduce(ps.begin(), ps.end(), std::string(), [](std::string acc, const int& x){
+      return acc + std::to_string(x);
+    });
+    vt.advance(std::chrono::milliseconds(200));
+    assert(done->wait() == 3 && seen[1].first == 3 && seen[2].first == 1);
+    assert(folded->wait() == "231");   /** 2 was already settled when reduce() attached */
+  }
+
+  /** empty input, rejection stops the fold */
+  std::vector<Promise<int>::sp> none;
+  assert(Promise<>::reduce(none.begin(), none.end(), 7, [](int a, const int& b){ return a + b; })->wait() == 7);
+  assert(Promise<>::as_completed(none.begin(), none.end(), [](const int&, std::size_t){})->wait() == 0);
+  {
+    virtual_time vt;
+    std::vector<Promise<int>::sp> ps = { pvalue(1, 100), perror<int>("bad", 200), pvalue(3, 300) };
+    int nCalls = 0;
+    auto done = Promise<>::as_completed(ps.begin(), ps.end(), [&](const int&, std::size_t){ nCalls++; });
+    vt.advance(std::chrono::seconds(1));
+    assert(done->state() == PromiseState::rejected && nCalls == 1);
+    auto thrown = Promise<>::reduce(ps.begin(), ps.begin() + 1, 0, [](int, const int&) -> int { throw test_error("op"); });
+    assert(thrown->state() == PromiseState::rejected);
+  }
+
+  /** many threads settling at once: every value folded exactly once, no overlapping calls */
+  const int n = 100000;
+  std::vector<Promise<int>::resolver> rs;
+  std::vector<Promise<int>::sp> ps;
+  for(int i = 0; i < n; i++) ps.push_back(Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); }));
+  std::atomic<int> nInside{0};
+  bool bOverlap = false;
+  auto sum = Promise<>::reduce(ps.begin(), ps.end(), 0LL, [&](long long acc, const int& x){
+    if(nInside++ != 0) bOverlap = true;
+    nInside--;
+    return acc + x;
+  });
+  ps.clear();
+  std::vector<std::thread> ts;
+  for(int t = 0; t < 4; t++){
+    ts.emplace_back([&, t]{
+      for(int i = t; i < n; i += 4) rs[i].resolve(i);
+    });
+  }
+  for(auto& t : ts) t.join();
+  assert(sum->wait() == static_cast<long long>(n) * (n - 1) / 2);
+  assert(!bOverlap);
+}
+
+/** counts the promise nodes holding one: each node owns its value */
+struct soak_node {
+  static std::atomic<long> live;
+  soak_node() { live++; }
+  soak_node(const soak_node&) { live++; }
+  soak_node& operator=(const soak_node&) = default;
+  ~soak_node() { live--; }
+};
+std::atomic<long> soak_node::live{0};
+
+/** resident set size in bytes, 0 where /proc is not available */
+std::size_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  std::size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void test_32() {
+  const auto rss = resident_bytes();
+  long nPeak = 0;
+
+  /** never settled: the chain goes away with its last resolver */
+  for(int i = 0; i < 1000000; i++){
+    Promise<>::create<soak_node>([](auto){})
+      ->then([](const soak_node& x){ return x; })
+      ->then([](const soak_node& x){ return x; })
+      ->stand_alone();
+    nPeak = std::max(nPeak, soak_node::live.load());
+  }
+  assert(soak_node::live == 0 && nPeak <= 3);
+
+  /** resolvers parked in a ring and dropped when their slot is reused, every third one settled first */
+  {
+    const std::size_t nSlots = 1000;
+    std::vector<std::unique_ptr<Promise<soak_node>::resolver>> ring(nSlots);
+    std::size_t nSettled = 0, nHits = 0;
+    for(std::size_t i = 0; i < 1000000; i++){
+      auto& slot = ring[i % nSlots];
+      if(slot && i % 3 == 0){
+        slot->resolve(soak_node());
+        nSettled++;
+      }
+      auto tail = Promise<>::create<soak_node>([&](auto resolver){
+        slot.reset(new Promise<soak_node>::resolver(resolver));
+      });
+      tail->then([](const soak_node& x){ return x; })
+        ->then([&](const soak_node&){ nHits++; })
+        ->stand_alone();
+      nPeak = std::max(nPeak, soak_node::live.load());
+    }
+    assert(nHits == nSettled && nSettled > 300000);
+    assert(nPeak <= static_cast<long>(nSlots) * 3 + 3);
+  }
+  assert(soak_node::live == 0);
+
+  const auto growth = resident_bytes() - std::min(rss, resident_bytes());
+  log() << "peak nodes " << nPeak << ", rss growth " << growth / 1024 << " KiB" << std::endl;
+  assert(growth < 64 * 1024 * 1024);
+}
+
+void test_33() {
+  /** one thread creates, settles and chains: the only use JPROMISE_SINGLE_THREADED allows */
+  {
+    std::vector<Promise<int>::resolver> rs;
+    auto head = Promise<>::create<int>([&](auto resolver){ rs.push_back(resolver); });
+    auto tail = head;
+    for(int i = 0; i < 1000; i++){
+      tail = tail->then([](const int& x){ return x + 1; });
+    }
+    assert(tail->try_get() == nullptr);
+    rs[0].resolve(1);
+    assert(*tail->try_get() == 1001);
+  }
+  {
+    virtual_time vt;
+    auto p = Promise<>::all({ pvalue(1, 100), pvalue(2, 200) })
+    ->then([](const std::vector<int>& xs){ return xs[0] + xs[1]; });
+    vt.advance(std::chrono::milliseconds(200));
+    assert(p->wait() == 3);
+  }
+
+#if defined(JPROMISE_SINGLE_THREADED)
+  /** nothing else could settle a pending promise while wait() blocks */
+  auto pending = Promise<>::create<int>([](auto resolver){});
+  try{ pending->wait(); assert(false); } catch(std::logic_error&){}
+  log() << "sizeof(Promise<int>) " << sizeof(Promise<int>) << std::endl;
+
+#if !defined(NDEBUG)
+  /** a promise used from another thread asserts */
+  const pid_t pid = fork();
+  if(pid == 0){
+    std::freopen("/dev/null", "w", stderr);
+    auto p = Promise<>::resolve(1);
+    std::thread([p]{ p->then([](const int&){}); }).join();
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+#endif
+#endif
+}
+
+void test_34() {
+  /** a stalled stage fills the queues in front of it, then push() waits */
+  std::deque<std::pair<Promise<int>::resolver, int>> held;
+  auto p = PipelineBuilder<int>()
+    .stage("double", [](const int& x){ return Promise<>::resolve(x * 2); }, { .concurrency = 1, .capacity = 2 })
+    .stage("hold", [&held](const int& x){
+      return Promise<>::create<int>([&held, x](auto resolver){ held.push_back({ resolver, x }); });
+    }, { .concurrency = 2, .capacity = 2 })
+    .build({ .ordered = true, .output_capacity = 2 });
+  std::vector<Promise<bool>::sp> pushed;
+  for(int i = 0; i < 8; i++) pushed.push_back(p->push(i));
+  for(int i = 0; i < 7; i++) assert(pushed[i]->is_ready());
+  assert(!pushed[7]->is_ready());
+  auto stats = p->stats();
+  assert(stats[0].name == "double" && stats[0].queued == 2 && stats[0].blocked == 1);
+  assert(stats[1].running == 2 && stats[1].queued == 2);
+  p->close();
+  assert(!p->push(99)->wait());
+
+  /** finish the held items newest first, they still come out in push() order */
+  std::vector<int> out;
+  while(true){
+    while(!held.empty()){
+      auto h = held.back();
+      held.pop_back();
+      h.first.resolve(h.second);
+    }
+    auto batch = p->output()->next(64);
+    assert(batch->is_ready());
+    if(batch->wait().empty()) break;
+    for(auto x : batch->wait()) out.push_back(x);
+  }
+  assert(pushed[7]->wait());
+  assert((out == std::vector<int>{ 0, 2, 4, 6, 8, 10, 12, 14 }));
+  assert(p->size() == 0 && p->stats()[1].completed == 8);
+
+  /** stages change the type, run on other threads and fail some items */
+  for(bool bOrdered : { true, false }){
+    ThreadPool pool(4);
+    std::atomic<int> nErrors{0};
+    auto q = PipelineBuilder<int>()
+      .stage("parse", [](const int& x){ return Promise<>::resolve(std::to_string(x)); }, { .concurrency = 2, .capacity = 8 })
+      .stage("enrich", [&pool](const std::string& s){
+        return Promise<>::create<std::string>([&pool, s](auto resolver){
+          pool.post([resolver, s]{
+            std::this_thread::sleep_for(std::chrono::microseconds(std::hash<std::string>()(s) % 50));
+            if(s.back() == '3') resolver.reject(std::make_exception_ptr(std::runtime_error(s)));
+            else resolver.resolve(s + "!");
+          });
+        });
+      }, { .concurrency = 8, .capacity = 16 })
+      .stage("persist", [](const std::string& s){ return Promise<>::resolve(s.size()); }, { .concurrency = 4 })
+      .build({ .ordered = bOrdered, .output_capacity = 4, .on_error = [&nErrors](const std::string& stage, std::exception_ptr){
+        assert(stage == "enrich");
+        nErrors++;
+      }});
+    std::vector<std::size_t> sizes;
+    auto done = q->output()->for_each([&sizes](const std::size_t& n){ sizes.push_back(n); });
+    std::thread producer([q]{
+      for(int i = 0; i < 2000; i++) assert(q->push(i)->wait());
+      q->close();
+    });
+    assert(done->wait() == 1800);
+    producer.join();
+    assert(nErrors == 200);
+    std::vector<std::size_t> expected;
+    for(int i = 0; i < 2000; i++){
+      if(i % 10 != 3) expected.push_back(std::to_string(i).size() + 1);
+    }
+    if(!bOrdered){
+      std::sort(sizes.begin(), sizes.end());
+      std::sort(expected.begin(), expected.end());
+    }
+    assert(sizes == expected);
+    for(auto& s : q->stats()) assert(s.queued <= s.capacity && s.max_queued <= s.capacity);
+  }
+}
+
+void test_35() {
+  using ms = std::chrono::milliseconds;
+  virtual_time vt;
+  int nCalls = 0;
+
+  /** answered within the delay: no backup */
+  auto a = Promise<>::hedge([&]{ return pvalue(++nCalls, 5); }, ms(10), 3, &vt.timer);
+  vt.advance(ms(100));
+  assert(a->wait() == 1 && nCalls == 1 && vt.timer.size() == 0);
+
+  /** slow first attempt: the backup wins, the third attempt is never started */
+  nCalls = 0;
+  auto b = Promise<>::hedge([&]{
+    const int n = ++nCalls;
+    return pvalue(n, n == 1 ? 100 : 5);
+  }, ms(10), 3, &vt.timer);
+  vt.advance(ms(14));
+  assert(nCalls == 2 && !b->is_ready());
+  vt.advance(ms(1));
+  assert(b->wait() == 2);
+  vt.advance(ms(200));
+  assert(nCalls == 2);
+
+  /** a failure with nothing else in flight starts the next attempt at once */
+  nCalls = 0;
+  auto c = Promise<>::hedge([&]{
+    return ++nCalls == 1 ? perror<int>("first", 1) : pvalue(nCalls, 1);
+  }, ms(50), 2, &vt.timer);
+  vt.advance(ms(2));
+  assert(c->wait() == 2 && nCalls == 2);
+
+  /** every attempt failed: the last error */
+  nCalls = 0;
+  auto d = Promise<>::hedge([&]() -> Promise<int>::sp {
+    if(++nCalls == 1) throw test_error("thrown");
+    return perror<int>("attempt " + std::to_string(nCalls), 30);
+  }, ms(10), 3, &vt.timer);
+  vt.advance(ms(100));
+  try{ d->wait(); assert(false); } catch(test_error& e){ assert(std::string(e.what()) == "attempt 3"); }
+  assert(nCalls == 3);
+}
+
+void test_36() {
+  SharedArena arena(1 << 20);
+  auto go = arena.make<int>();
+  auto a = arena.make<int>();
+  auto b = arena.make<double>();
+  auto c = arena.make<int>();
+  auto d = arena.make<SharedBytes>();
+  Reactor reactor;
+  std::thread loop([&]{ reactor.run(); });
+  auto pb = arena.promise(reactor, b);
+  auto pc = arena.promise(reactor, c);
+  auto pd = arena.promise(reactor, d)->then([&](const SharedBytes& x){ return std::string(arena.data(x), x.size); });
+
+  /** a worker process settles the slots, one blocking wait each way, the rest wakes the reactor */
+  const pid_t pid = fork();
+  if(pid == 0){
+    const int n = arena.wait(go);
+    arena.resolve(a, n + 1);
+    arena.resolve(b, 2.5);
+    arena.reject(c, "failed in the worker");
+    const char text[] = "bytes from the worker";
+    arena.resolve(d, arena.write(text, sizeof(text) - 1));
+    _exit(0);
+  }
+  assert(!pb->is_ready());
+  arena.resolve(go, 41);
+  assert(arena.wait(a) == 42);
+  assert(pb->wait() == 2.5);
+  try{ pc->wait(); assert(false); } catch(SharedSlotError& e){ assert(std::string(e.what()) == "failed in the worker"); }
+  assert(pd->wait() == "bytes from the worker");
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  /** settled before it was watched, and addressed by offset as an attach()ed process would */
+  auto e = arena.make<int>();
+  arena.resolve(e, 7);
+  assert(arena.promise(reactor, arena.at<int>(arena.offset(e)))->wait() == 7);
+  try{ arena.resolve(e, 8); assert(false); } catch(std::logic_error&){}
+  try{ arena.reject(e, "late"); assert(false); } catch(std::logic_error&){}
+  assert(arena.wait(e) == 7);
+
+  /** producers racing for one slot: exactly one settles it, the value is never overwritten */
+  for(int round = 0; round < 100; round++){
+    auto f = arena.make<int>();
+    std::atomic<int> nWon{0};
+    std::vector<std::thread> producers;
+    for(int i = 1; i <= 4; i++){
+      producers.emplace_back([&, i]{
+        try{ arena.resolve(f, i); nWon++; } catch(std::logic_error&){}
+      });
+    }
+    const int v = arena.wait(f);
+    for(auto& t : producers) t.join();
+    assert(nWon == 1 && v >= 1 && v <= 4 && arena.wait(f) == v);
+  }
+
+  reactor.stop();
+  loop.join();
+}
+
+void test_37() {
+  /** children beyond the cap wait, in FIFO order, and spawn() is only fulfilled once they start */
+  {
+    AsyncScope scope({ .max_outstanding = 2 });
+    std::deque<Promise<int>::resolver> held;
+    std::vector<int> started;
+    std::vector<Promise<bool>::sp> spawned;
+    for(int i = 0; i < 5; i++){
+      spawned.push_back(scope.spawn([&, i]{
+        started.push_back(i);
+        return Promise<>::create<int>([&](auto r){ held.push_back(r); });
+      }));
+    }
+    assert(spawned[1]->is_ready() && !spawned[2]->is_ready());
+    assert(scope.outstanding() == 2 && scope.waiting() == 3);
+    auto joined = scope.join();
+    assert(!scope.spawn([]{ return Promise<>::resolve(0); })->wait());
+    try{ scope.run([]{ return Promise<>::resolve(0); })->wait(); assert(false); } catch(AsyncScope::closed_error&){}
+    while(!held.empty()){
+      assert(!joined->is_ready());
+      auto r = held.front();
+      held.pop_front();
+      r.resolve(0);
+    }
+    assert(joined->wait());
+    assert((started == std::vector<int>{ 0, 1, 2, 3, 4 }));
+    assert(scope.outstanding() == 0 && scope.peak() == 2);
+  }
+
+  /** run() passes the result on, spawn() reports errors, an abandoned child counts as settled */
+  {
+    std::vector<std::string> errors;
+    AsyncScope scope({ .max_outstanding = 0, .on_error = [&errors](std::exception_ptr e){
+      try{ std::rethrow_exception(e); } catch(std::exception& x){ errors.push_back(x.what()); }
+    }});
+    assert(scope.run([]{ return Promise<>::resolve(std::string("ok")); })->wait() == "ok");
+    try{ scope.run([]() -> Promise<int>::sp { throw test_error("thrown"); })->wait(); assert(false); } catch(test_error&){}
+    scope.spawn([]{ return Promise<>::reject<int>(std::make_exception_ptr(test_error("rejected"))); });
+    scope.spawn([]{ return Promise<>::create<int>([](auto){}); });
+    assert(scope.outstanding() == 0);
+    assert((errors == std::vector<std::string>{ "rejected" }));
+    assert(scope.join()->wait());
+  }
+
+  /** a long chain of waiting children that settle at once does not recurse */
+  {
+    AsyncScope scope({ .max_outstanding = 1 });
+    std::vector<Promise<int>::resolver> first;
+    scope.spawn([&]{ return Promise<>::create<int>([&](auto r){ first.push_back(r); }); });
+    int n = 0;
+    for(int i = 0; i < 200000; i++) scope.spawn([&n]{ return Promise<>::resolve(++n); });
+    assert(n == 0 && scope.waiting() == 200000);
+    first[0].resolve(0);
+    assert(n == 200000 && scope.join()->wait());
+  }
+
+  /** cancel() drops the waiting children and tells the running ones through their token */
+  {
+    virtual_time vt;
+    AsyncScope scope({ .max_outstanding = 3 });
+    std::vector<Promise<int>::sp> results;
+    for(int i = 0; i < 5; i++){
+      results.push_back(scope.run([&vt, i](const AsyncScope::Token& token){
+        return Promise<>::create<int>([&vt, i, token](auto resolver){
+          auto id = vt.timer.after(std::chrono::seconds(10), [resolver, i]{ resolver.resolve(i); });
+          token.on_cancel([&vt, id, resolver]{
+            if(vt.timer.cancel(id)) resolver.reject(std::make_exception_ptr(test_error("stopped")));
+          });
+        });
+      }));
+    }
+    auto ignored = scope.spawn([](const AsyncScope::Token& token){
+      assert(!token.cancelled());
+      return Promise<>::create<int>([](auto){});
+    });
+    auto joined = scope.join();
+    assert(scope.outstanding() == 3 && scope.waiting() == 3);
+    scope.cancel();
+    for(auto& r : results){
+      try{ r->wait(); assert(false); } catch(AsyncScope::cancelled_error&){}
+    }
+    assert(!ignored->wait());
+    assert(joined->wait() && scope.outstanding() == 0 && vt.timer.size() == 0);
+    try{ scope.run([]{ return Promise<>::resolve(0); })->wait(); assert(false); } catch(AsyncScope::cancelled_error&){}
+  }
+
+  /** children on other threads never exceed the cap, a spawning loop is throttled */
+  {
+    ThreadPool pool(4);
+    std::atomic<int> nRunning{0}, nMax{0}, nDone{0};
+    AsyncScope scope({ .max_outstanding = 8 });
+    for(int i = 0; i < 2000; i++){
+      assert(scope.spawn([&]{
+        return Promise<>::create<bool>([&](auto resolver){
+          const int n = ++nRunning;
+          for(int m = nMax; n > m && !nMax.compare_exchange_weak(m, n);){}
+          pool.post([&, resolver]{
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+            nRunning--;
+            nDone++;
+            resolver.resolve(true);
+          });
+        });
+      })->wait());
+      assert(scope.waiting() == 0);
+    }
+    assert(scope.join()->wait());
+    assert(nDone == 2000 && nMax <= 8 && scope.peak() <= 8);
   }
 }
 
 int main()
 {
+#if defined(JPROMISE_SINGLE_THREADED)
+  /** the rest of the suite settles promises from other threads */
+  log() << "================ test_33 ================" << std::endl;
+  test_33();
+  return 0;
+#endif
+
   log() << "================ test_1 ================" << std::endl;
   test_1();
 
@@ -498,4 +1935,72 @@ int main()
 
   log() << "================ test_13 ================" << std::endl;
   test_13();
+
+  log() << "================ test_14 ================" << std::endl;
+  test_14();
+
+  log() << "================ test_15 ================" << std::endl;
+  test_15();
+
+  log() << "================ test_16 ================" << std::endl;
+  test_16();
+
+  log() << "================ test_17 ================" << std::endl;
+  test_17();
+
+  log() << "================ test_18 ================" << std::endl;
+  test_18();
+
+  log() << "================ test_19 ================" << std::endl;
+  test_19();
+
+  log() << "================ test_20 ================" << std::endl;
+  test_20();
+
+  log() << "================ test_21 ================" << std::endl;
+  test_21();
+
+  log() << "================ test_22 ================" << std::endl;
+  test_22();
+
+  log() << "================ test_23 ================" << std::endl;
+  test_23();
+
+  log() << "================ test_24 ================" << std::endl;
+  test_24();
+
+  log() << "================ test_25 ================" << std::endl;
+  test_25();
+
+  log() << "================ test_26 ================" << std::endl;
+  test_26();
+
+  log() << "================ test_27 ================" << std::endl;
+  test_27();
+
+  log() << "================ test_28 ================" << std::endl;
+  test_28();
+
+  log() << "================ test_29 ================" << std::endl;
+  test_29();
+
+  log() << "================ test_30 ================" << std::endl;
+  test_30();
+
+  log() << "================ test_31 ================" << std::endl;
+  test_31();
+
+  log() << "================ test_32 ================" << std::endl;
+  test_32();
+
+  log() << "================ test_33 ================" << std::endl;
+  test_33();
+  log() << "================ test_34 ================" << std::endl;
+  test_34();
+  log() << "================ test_35 ================" << std::endl;
+  test_35();
+  log() << "================ test_36 ================" << std::endl;
+  test_36();
+  log() << "================ test_37 ================" << std::endl;
+  test_37();
 }